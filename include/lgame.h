@@ -0,0 +1,140 @@
+#ifndef LGAME_H
+#define LGAME_H
+
+/*
+ * C interface to the Lgame engine. Every handle is owned by the caller and released with the
+ * matching *_destroy function. Battles share no state, so different battles may be used from
+ * different threads at the same time; a single handle must not be used concurrently.
+ */
+
+#include <stdint.h>
+
+#if defined(_WIN32)
+#define LGAME_API __declspec(dllexport)
+#else
+#define LGAME_API __attribute__((visibility("default")))
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define LGAME_ABI_VERSION 1
+
+typedef struct lgame_team lgame_team;
+typedef struct lgame_battle lgame_battle;
+typedef struct lgame_model lgame_model;
+
+typedef enum lgame_draw_reason {
+    LGAME_DRAW_NONE = 0,
+    LGAME_DRAW_STALEMATE = 1,
+    LGAME_DRAW_CYCLE = 2,
+    LGAME_DRAW_ROUND_CAP = 3,
+    LGAME_DRAW_MUTUAL_KILL = 4  /* both teams died in the same simultaneous round */
+} lgame_draw_reason;
+
+/* Passed by value, so its layout is frozen; options added later live in lgame_options_ex. */
+typedef struct lgame_options {
+    int round_cap;     /* 0 disables the cap */
+    int fast_forward;  /* skip randomness-free rounds when nothing is logged */
+} lgame_options;
+
+/* Options that may grow. Set size to sizeof(lgame_options_ex) before filling it in: the library only
+   reads fields that fit in size, and any it has that the caller's header lacked keep their defaults. */
+typedef struct lgame_options_ex {
+    uint32_t size;
+    int round_cap;
+    int fast_forward;
+    int simultaneous;  /* both teams act on the state the round starts in */
+} lgame_options_ex;
+
+typedef struct lgame_result {
+    int winner;        /* 1 or 2, 0 for a draw */
+    int rounds;
+    int draw_reason;   /* lgame_draw_reason */
+} lgame_result;
+
+typedef struct lgame_stats {
+    int battles;
+    int wins1;
+    int wins2;
+    int draws;
+    double average_rounds;
+} lgame_stats;
+
+typedef struct lgame_unit_info {
+    char type;         /* save-file letter: L, I, A, W, H or G */
+    int position;
+    int hp;
+    int max_hp;
+} lgame_unit_info;
+
+/* Receives every log line of a battle; message is only valid during the call. */
+typedef void (*lgame_log_fn)(const char* message, const char* level, void* user);
+
+LGAME_API int lgame_abi_version(void);
+LGAME_API lgame_options lgame_default_options(void);
+/* Fills the fields of options that fit in options->size with their defaults. */
+LGAME_API void lgame_default_options_ex(lgame_options_ex* options);
+
+LGAME_API lgame_team* lgame_team_create(void);
+LGAME_API void lgame_team_destroy(lgame_team* team);
+/* type: LI, HI, A, W, H or Gu; buffs: space-separated LI buffs (Ho Sp Sh He) or NULL.
+   Returns 0 on success, -1 for an unknown unit type or buff. */
+LGAME_API int lgame_team_add_unit(lgame_team* team, const char* type, const char* buffs);
+/* Appends every unit of a team spec such as "LI:Ho+Sp, 2*HI, A, W, H, Gu"; -1 (team unchanged) if malformed. */
+LGAME_API int lgame_team_add_spec(lgame_team* team, const char* spec);
+LGAME_API int lgame_team_size(const lgame_team* team);
+LGAME_API int lgame_team_cost(const lgame_team* team);
+
+/* Both teams are copied; the battle starts in round 1 and draws its dice from seed. */
+LGAME_API lgame_battle* lgame_battle_create(const lgame_team* team1, const lgame_team* team2,
+                                            const char* name1, const char* name2,
+                                            uint64_t seed, lgame_options options);
+/* Returns NULL if the save file cannot be read. */
+LGAME_API lgame_battle* lgame_battle_load(const char* filename, uint64_t seed, lgame_options options);
+/* As above with extended options; NULL options means the defaults. */
+LGAME_API lgame_battle* lgame_battle_create_ex(const lgame_team* team1, const lgame_team* team2,
+                                               const char* name1, const char* name2,
+                                               uint64_t seed, const lgame_options_ex* options);
+LGAME_API lgame_battle* lgame_battle_load_ex(const char* filename, uint64_t seed, const lgame_options_ex* options);
+LGAME_API void lgame_battle_destroy(lgame_battle* battle);
+LGAME_API void lgame_battle_set_log(lgame_battle* battle, lgame_log_fn log, void* user);
+/* Splits the Archer volleys of each huge round across threads workers (0 = one per core, 1 = off).
+   Results are identical to the single-threaded battle. Not a measured speedup: it is slower on one
+   core, and where it starts to pay off on several cores has not been measured. */
+LGAME_API int lgame_battle_set_threads(lgame_battle* battle, int threads);
+/* Plays one round; returns 1 if a round was played, 0 once the battle is over. */
+LGAME_API int lgame_battle_step(lgame_battle* battle);
+LGAME_API lgame_result lgame_battle_run(lgame_battle* battle);
+LGAME_API int lgame_battle_is_over(const lgame_battle* battle);
+LGAME_API lgame_result lgame_battle_result(const lgame_battle* battle);
+LGAME_API int lgame_battle_round(const lgame_battle* battle);
+/* side is 1 or 2; returns the number of units written, at most capacity. */
+LGAME_API int lgame_battle_units(const lgame_battle* battle, int side, lgame_unit_info* units, int capacity);
+/* Returns 0 on success, -1 if the file cannot be written. */
+LGAME_API int lgame_battle_save(const lgame_battle* battle, const char* filename);
+
+/* Estimates the outcome from the battle's current state by playing continuations with fresh dice
+   on threads workers (0 = one per core) for about budget_ms milliseconds. battles holds the number
+   of continuations played. The battle itself is not changed. */
+LGAME_API lgame_stats lgame_battle_estimate(const lgame_battle* battle, int budget_ms, int threads, uint64_t seed);
+
+/* Plays battles independent battles on threads workers (0 = one per core), battle i seeded with
+   mix(mix(seed) + i), so runs with nearby seeds share no battles. */
+LGAME_API lgame_stats lgame_simulate(const lgame_team* team1, const lgame_team* team2, int battles,
+                                     uint64_t seed, int threads, lgame_options options);
+LGAME_API lgame_stats lgame_simulate_ex(const lgame_team* team1, const lgame_team* team2, int battles,
+                                        uint64_t seed, int threads, const lgame_options_ex* options);
+
+/* Outcome model trained with "Lgame --train"; NULL if the file is missing or for other rules. */
+LGAME_API lgame_model* lgame_model_load(const char* filename);
+LGAME_API void lgame_model_destroy(lgame_model* model);
+/* Predicted expected score of team1 (win 1, draw 0.5) from composition alone, without simulating. */
+LGAME_API double lgame_model_predict(const lgame_model* model, const lgame_team* team1, const lgame_team* team2);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,304 @@
+#include "lgame.h"
+#include "lgame_core.h"
+#include <cstddef>
+
+
+struct lgame_team {
+    vector<unique_ptr<Unit>> units;
+};
+
+
+// Forwards engine log lines to the embedder's callback; silent (and fast-forwardable) without one.
+class CallbackLogger : public Logger {
+public:
+    void log(const string& message, const string& level) override {
+        if (fn_) fn_(message.c_str(), level.c_str(), user_);
+    }
+    bool enabled() const override { return fn_ != nullptr; }
+    void set(lgame_log_fn fn, void* user) {
+        fn_ = fn;
+        user_ = user;
+    }
+private:
+    lgame_log_fn fn_ = nullptr;
+    void* user_ = nullptr;
+};
+
+
+struct lgame_battle {
+    CallbackLogger logger;
+    unique_ptr<ThreadPool> pool;  // declared before battle, which keeps a pointer to it
+    unique_ptr<Battle> battle;
+};
+
+
+struct lgame_model {
+    OutcomeModel model;
+};
+
+
+static SimulationOptions toOptions(lgame_options options) {
+    SimulationOptions result;
+    result.roundCap = options.round_cap;
+    result.fastForward = options.fast_forward != 0;
+    return result;
+}
+
+// A field is the caller's only if it lies within the size the caller's header gave the struct.
+#define LGAME_HAS_FIELD(options, field) \
+    ((options)->size >= offsetof(lgame_options_ex, field) + sizeof((options)->field))
+
+static SimulationOptions toOptions(const lgame_options_ex* options) {
+    SimulationOptions result;
+    if (!options) return result;
+    if (LGAME_HAS_FIELD(options, round_cap)) result.roundCap = options->round_cap;
+    if (LGAME_HAS_FIELD(options, fast_forward)) result.fastForward = options->fast_forward != 0;
+    if (LGAME_HAS_FIELD(options, simultaneous)) result.simultaneous = options->simultaneous != 0;
+    return result;
+}
+
+static lgame_result toResult(const BattleResult& result) {
+    return {result.winner, result.rounds, static_cast<int>(result.drawReason)};
+}
+
+// C++ exceptions must not cross the C boundary; every entry point that can allocate goes through here.
+template <typename F, typename R>
+static R guarded(F body, R fallback) {
+    try {
+        return body();
+    } catch (...) {
+        return fallback;
+    }
+}
+
+
+static lgame_battle* createBattle(const lgame_team* team1, const lgame_team* team2, const char* name1,
+                                  const char* name2, uint64_t seed, const SimulationOptions& options) {
+    if (!team1 || !team2) return nullptr;
+    return guarded([&] {
+        auto handle = make_unique<lgame_battle>();
+        handle->battle = make_unique<Battle>(cloneTeam(team1->units), cloneTeam(team2->units),
+                                             name1 ? name1 : "Team 1", name2 ? name2 : "Team 2",
+                                             make_unique<StreamDice>(seed), handle->logger, options);
+        return handle.release();
+    }, static_cast<lgame_battle*>(nullptr));
+}
+
+static lgame_battle* loadBattle(const char* filename, uint64_t seed, const SimulationOptions& options) {
+    if (!filename) return nullptr;
+    return guarded([&] {
+        auto handle = make_unique<lgame_battle>();
+        string t1, t2;
+        int round = 1;
+        vector<unique_ptr<Unit>> team1, team2;
+        if (!loadGame(filename, t1, t2, round, team1, team2, handle->logger)) return static_cast<lgame_battle*>(nullptr);
+        handle->battle = make_unique<Battle>(std::move(team1), std::move(team2), t1, t2,
+                                             make_unique<StreamDice>(seed), handle->logger, options, round);
+        return handle.release();
+    }, static_cast<lgame_battle*>(nullptr));
+}
+
+static lgame_stats simulate(const lgame_team* team1, const lgame_team* team2, int battles,
+                            uint64_t seed, int threads, const SimulationOptions& options) {
+    lgame_stats empty{0, 0, 0, 0, 0.0};
+    if (!team1 || !team2 || battles <= 0) return empty;
+    return guarded([&] {
+        ThreadPool pool(threads > 0 ? static_cast<size_t>(threads) : thread::hardware_concurrency());
+        BatchStats stats;
+        playBatch(team1->units, team2->units, "Team 1", "Team 2", 1, battles, options,
+                  StoppingRule(), seed, pool, nullptr, stats);
+        double average = stats.battles > 0 ? static_cast<double>(stats.totalRounds) / stats.battles : 0.0;
+        return lgame_stats{stats.battles, stats.wins1, stats.wins2, stats.draws, average};
+    }, empty);
+}
+
+
+extern "C" {
+
+int lgame_abi_version(void) {
+    return LGAME_ABI_VERSION;
+}
+
+lgame_options lgame_default_options(void) {
+    SimulationOptions defaults;
+    return {defaults.roundCap, defaults.fastForward ? 1 : 0};
+}
+
+void lgame_default_options_ex(lgame_options_ex* options) {
+    if (!options) return;
+    SimulationOptions defaults;
+    if (LGAME_HAS_FIELD(options, round_cap)) options->round_cap = defaults.roundCap;
+    if (LGAME_HAS_FIELD(options, fast_forward)) options->fast_forward = defaults.fastForward ? 1 : 0;
+    if (LGAME_HAS_FIELD(options, simultaneous)) options->simultaneous = defaults.simultaneous ? 1 : 0;
+}
+
+lgame_team* lgame_team_create(void) {
+    return guarded([] { return new lgame_team(); }, static_cast<lgame_team*>(nullptr));
+}
+
+void lgame_team_destroy(lgame_team* team) {
+    delete team;
+}
+
+int lgame_team_add_unit(lgame_team* team, const char* type, const char* buffs) {
+    if (!team || !type) return -1;
+    return guarded([&] {
+        vector<string> buffList;
+        istringstream iss(buffs ? buffs : "");
+        string buff;
+        while (iss >> buff) {
+            if (BUFFS.find(buff) == BUFFS.end()) return -1;
+            buffList.push_back(buff);
+        }
+        string code = type;
+        if (!buffList.empty() && code != "LI" && code != "L") return -1;
+        auto unit = makeUnit(code, static_cast<int>(team->units.size()) + 1, buffList);
+        if (!unit) return -1;
+        team->units.push_back(std::move(unit));
+        return 0;
+    }, -1);
+}
+
+int lgame_team_add_spec(lgame_team* team, const char* spec) {
+    if (!team || !spec) return -1;
+    return guarded([&] {
+        vector<unique_ptr<Unit>> units;
+        string error;
+        if (!parseTeamSpec(spec, units, error)) return -1;
+        for (auto& unit : units) {
+            unit->position = team->units.size() + 1;
+            team->units.push_back(std::move(unit));
+        }
+        return 0;
+    }, -1);
+}
+
+int lgame_team_size(const lgame_team* team) {
+    return team ? static_cast<int>(team->units.size()) : 0;
+}
+
+int lgame_team_cost(const lgame_team* team) {
+    return team ? teamCost(team->units) : 0;
+}
+
+lgame_battle* lgame_battle_create(const lgame_team* team1, const lgame_team* team2,
+                                  const char* name1, const char* name2,
+                                  uint64_t seed, lgame_options options) {
+    return createBattle(team1, team2, name1, name2, seed, toOptions(options));
+}
+
+lgame_battle* lgame_battle_create_ex(const lgame_team* team1, const lgame_team* team2,
+                                     const char* name1, const char* name2,
+                                     uint64_t seed, const lgame_options_ex* options) {
+    return createBattle(team1, team2, name1, name2, seed, toOptions(options));
+}
+
+lgame_battle* lgame_battle_load(const char* filename, uint64_t seed, lgame_options options) {
+    return loadBattle(filename, seed, toOptions(options));
+}
+
+lgame_battle* lgame_battle_load_ex(const char* filename, uint64_t seed, const lgame_options_ex* options) {
+    return loadBattle(filename, seed, toOptions(options));
+}
+
+void lgame_battle_destroy(lgame_battle* battle) {
+    delete battle;
+}
+
+void lgame_battle_set_log(lgame_battle* battle, lgame_log_fn log, void* user) {
+    if (battle) battle->logger.set(log, user);
+}
+
+int lgame_battle_set_threads(lgame_battle* battle, int threads) {
+    if (!battle || threads < 0) return -1;
+    return guarded([&] {
+        size_t workers = threads > 0 ? static_cast<size_t>(threads) : thread::hardware_concurrency();
+        battle->battle->parallelize(nullptr);
+        battle->pool = workers > 1 ? make_unique<ThreadPool>(workers) : nullptr;
+        battle->battle->parallelize(battle->pool.get());
+        return 0;
+    }, -1);
+}
+
+int lgame_battle_step(lgame_battle* battle) {
+    if (!battle) return 0;
+    return guarded([&] { return battle->battle->step() ? 1 : 0; }, 0);
+}
+
+lgame_result lgame_battle_run(lgame_battle* battle) {
+    if (!battle) return {0, 0, LGAME_DRAW_NONE};
+    return guarded([&] { return toResult(battle->battle->run()); }, lgame_result{0, 0, LGAME_DRAW_NONE});
+}
+
+int lgame_battle_is_over(const lgame_battle* battle) {
+    return battle && battle->battle->isOver() ? 1 : 0;
+}
+
+lgame_result lgame_battle_result(const lgame_battle* battle) {
+    if (!battle) return {0, 0, LGAME_DRAW_NONE};
+    return toResult(battle->battle->result());
+}
+
+int lgame_battle_round(const lgame_battle* battle) {
+    return battle ? battle->battle->round() : 0;
+}
+
+int lgame_battle_units(const lgame_battle* battle, int side, lgame_unit_info* units, int capacity) {
+    if (!battle || (side != 1 && side != 2)) return 0;
+    const auto& team = side == 1 ? battle->battle->team1() : battle->battle->team2();
+    int count = 0;
+    for (const auto& unit : team) {
+        if (count >= capacity) break;
+        units[count++] = {unit->typeCode(), unit->position, unit->hp, unit->max_hp};
+    }
+    return count;
+}
+
+int lgame_battle_save(const lgame_battle* battle, const char* filename) {
+    if (!battle || !filename) return -1;
+    return guarded([&] {
+        const Battle& b = *battle->battle;
+        NullLogger silent;
+        return saveGame(filename, b.name1(), b.name2(), b.round(), b.team1(), b.team2(), silent) ? 0 : -1;
+    }, -1);
+}
+
+lgame_stats lgame_battle_estimate(const lgame_battle* battle, int budget_ms, int threads, uint64_t seed) {
+    lgame_stats empty{0, 0, 0, 0, 0.0};
+    if (!battle || budget_ms <= 0) return empty;
+    return guarded([&] {
+        ThreadPool pool(threads > 0 ? static_cast<size_t>(threads) : thread::hardware_concurrency());
+        WinEstimate estimate = estimateWinProbability(*battle->battle, chrono::milliseconds(budget_ms), pool, seed);
+        return lgame_stats{estimate.samples, estimate.wins1, estimate.wins2, estimate.draws, 0.0};
+    }, empty);
+}
+
+lgame_stats lgame_simulate(const lgame_team* team1, const lgame_team* team2, int battles,
+                           uint64_t seed, int threads, lgame_options options) {
+    return simulate(team1, team2, battles, seed, threads, toOptions(options));
+}
+
+lgame_stats lgame_simulate_ex(const lgame_team* team1, const lgame_team* team2, int battles,
+                              uint64_t seed, int threads, const lgame_options_ex* options) {
+    return simulate(team1, team2, battles, seed, threads, toOptions(options));
+}
+
+lgame_model* lgame_model_load(const char* filename) {
+    if (!filename) return nullptr;
+    return guarded([&] {
+        auto handle = make_unique<lgame_model>();
+        NullLogger silent;
+        return handle->model.load(filename, silent) ? handle.release() : nullptr;
+    }, static_cast<lgame_model*>(nullptr));
+}
+
+void lgame_model_destroy(lgame_model* model) {
+    delete model;
+}
+
+double lgame_model_predict(const lgame_model* model, const lgame_team* team1, const lgame_team* team2) {
+    if (!model || !team1 || !team2) return 0.5;
+    return guarded([&] { return model->model.predict(team1->units, team2->units); }, 0.5);
+}
+
+}
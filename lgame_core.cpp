@@ -0,0 +1,2763 @@
+#include "lgame_core.h"
+
+
+void applyVolley(Unit* target, int damage, int hits) {
+    if (auto li = dynamic_cast<LightInfantry*>(target)) {
+        li->absorbHits(damage, hits);
+        return;
+    }
+    if (target->hp <= 0 || damage <= 0) return;
+    int lethal_hits = (target->hp + damage - 1) / damage;
+    target->hp -= min(hits, lethal_hits) * damage;
+}
+
+string drawReasonName(DrawReason reason) {
+    switch (reason) {
+        case DrawReason::Stalemate: return "stalemate";
+        case DrawReason::Cycle: return "cycle";
+        case DrawReason::RoundCap: return "round cap";
+        case DrawReason::MutualKill: return "mutual kill";
+        default: return "none";
+    }
+}
+
+bool saveGame(const string& filename, const string& t1, const string& t2, int round,
+              const vector<unique_ptr<Unit>>& team1, const vector<unique_ptr<Unit>>& team2, Logger& logger) {
+    ofstream out(filename);
+    if (!out) {
+        logger.log("Error: Could not save game to " + filename, "ERROR");
+        return false;
+    }
+    out << t1 << '\n' << t2 << '\n' << round << '\n';
+    for (const auto& u : team1) {
+        out << u->typeCode() << ' ' << u->position << ' ' << u->hp << ' ';
+        u->saveExtra(out);
+        out << '\n';
+    }
+    out << "---\n";
+    for (const auto& u : team2) {
+        out << u->typeCode() << ' ' << u->position << ' ' << u->hp << ' ';
+        u->saveExtra(out);
+        out << '\n';
+    }
+    out.close();
+    return true;
+}
+
+bool loadGame(const string& filename, string& t1, string& t2, int& round,
+              vector<unique_ptr<Unit>>& team1, vector<unique_ptr<Unit>>& team2, Logger& logger) {
+    ifstream in(filename);
+    if (!in) {
+        logger.log("Error: Could not open file " + filename, "ERROR");
+        return false;
+    }
+    getline(in, t1);
+    getline(in, t2);
+    string roundStr;
+    getline(in, roundStr);
+    try {
+        round = stoi(roundStr);
+    } catch (...) {
+        logger.log("Error: Invalid round number in save file", "ERROR");
+        in.close();
+        return false;
+    }
+
+    string line;
+    while (getline(in, line) && line != "---") {
+        istringstream iss(line);
+        string type;
+        int pos, hp;
+        if (iss >> type >> pos >> hp) {
+            unique_ptr<Unit> u = makeUnit(type, pos);
+            if (u) {
+                u->hp = hp;
+                u->loadExtra(iss);
+                team1.push_back(std::move(u));
+            } else {
+                logger.log("Warning: Invalid unit type '" + type + "' in team1", "ERROR");
+            }
+        } else {
+            logger.log("Warning: Invalid line in team1: " + line, "ERROR");
+        }
+    }
+
+    while (getline(in, line)) {
+        istringstream iss(line);
+        string type;
+        int pos, hp;
+        if (iss >> type >> pos >> hp) {
+            unique_ptr<Unit> u = makeUnit(type, pos);
+            if (u) {
+                u->hp = hp;
+                u->loadExtra(iss);
+                team2.push_back(std::move(u));
+            } else {
+                logger.log("Warning: Invalid unit type '" + type + "' in team2", "ERROR");
+            }
+        } else {
+            logger.log("Warning: Invalid line in team2: " + line, "ERROR");
+        }
+    }
+
+    for (size_t i = 0; i < team1.size(); i++) {
+        team1[i]->position = i + 1;
+    }
+    for (size_t i = 0; i < team2.size(); i++) {
+        team2[i]->position = i + 1;
+    }
+
+    in.close();
+    return true;
+}
+
+unique_ptr<Unit> makeUnit(const string& type, int pos, const vector<string>& buffs) {
+    if (type == "LI" || type == "L") return make_unique<LightInfantry>(pos, buffs);
+    if (type == "HI" || type == "I") return make_unique<HeavyInfantry>(pos);
+    if (type == "A") return make_unique<Archer>(pos);
+    if (type == "W") return make_unique<Wizard>(pos);
+    if (type == "H") return make_unique<Healer>(pos);
+    if (type == "Gu" || type == "G") return make_unique<GuliayGorodAdapter>(pos);
+    return nullptr;
+}
+
+unique_ptr<Unit> cloneUnit(const Unit& unit) {
+    auto u = unit.clone();
+    u->hp = unit.hp;
+    u->max_hp = unit.max_hp;
+    return u;
+}
+
+vector<unique_ptr<Unit>> cloneTeam(const vector<unique_ptr<Unit>>& team) {
+    vector<unique_ptr<Unit>> copy;
+    copy.reserve(team.size());
+    for (const auto& unit : team) {
+        copy.push_back(cloneUnit(*unit));
+    }
+    return copy;
+}
+
+
+TeamTracker::TeamTracker(const vector<unique_ptr<Unit>>& team) {
+    shadow_.reserve(team.size());
+    for (const auto& unit : team) {
+        shadow_.push_back({unit.get(), UnitState(cloneUnit(*unit))});
+    }
+}
+
+TeamDelta TeamTracker::record(const vector<unique_ptr<Unit>>& team) {
+    // Units keep their relative order between steps, so a short look-ahead finds nearly every match;
+    // the origin index is only built when it fails (a fresh clone, or a long run of deaths).
+    const size_t LOOKAHEAD = 8;
+    TeamDelta delta;
+    vector<Entry> next;
+    next.reserve(team.size());
+    unordered_map<const Unit*, size_t> originIndex;
+    bool indexed = false;
+    size_t j = 0;
+    for (size_t i = 0; i < team.size(); ++i) {
+        const Unit* unit = team[i].get();
+        size_t end = min(shadow_.size(), j + LOOKAHEAD);
+        size_t k = j;
+        while (k < end && shadow_[k].origin != unit) ++k;
+        if (k == end && end < shadow_.size()) {
+            if (!indexed) {
+                for (size_t s = 0; s < shadow_.size(); ++s) originIndex[shadow_[s].origin] = s;
+                indexed = true;
+            }
+            auto it = originIndex.find(unit);
+            k = it != originIndex.end() && it->second >= j ? it->second : shadow_.size();
+        }
+        if (k >= shadow_.size()) {
+            UnitState state(cloneUnit(*unit));
+            delta.inserted.push_back({static_cast<int>(i), state});
+            next.push_back({unit, std::move(state)});
+            continue;
+        }
+        for (; j < k; ++j) delta.removed.push_back({static_cast<int>(j), std::move(shadow_[j].state)});
+        Entry& entry = shadow_[j++];
+        if (!entry.state->sameState(*unit)) {
+            UnitState state(cloneUnit(*unit));
+            delta.changed.push_back({static_cast<int>(i), std::move(entry.state), state});
+            entry.state = std::move(state);
+        }
+        next.push_back({unit, std::move(entry.state)});
+    }
+    for (; j < shadow_.size(); ++j) delta.removed.push_back({static_cast<int>(j), std::move(shadow_[j].state)});
+    shadow_ = std::move(next);
+    return delta;
+}
+
+void TeamTracker::undo(vector<unique_ptr<Unit>>& team, const TeamDelta& delta) {
+    auto replace = [&](size_t index, const UnitState& state) {
+        auto unit = cloneUnit(*state);
+        unit->position = index + 1;
+        shadow_[index] = {unit.get(), state};
+        team[index] = std::move(unit);
+    };
+    if (delta.removed.empty() && delta.inserted.empty()) {
+        for (const auto& change : delta.changed) replace(change.index, change.before);
+        return;
+    }
+    vector<unique_ptr<Unit>> out;
+    vector<Entry> shadow;
+    auto place = [&](const UnitState& state) {
+        out.push_back(cloneUnit(*state));
+        shadow.push_back({out.back().get(), state});
+    };
+    size_t r = 0, in = 0, c = 0;
+    for (size_t i = 0; i <= team.size(); ++i) {
+        while (r < delta.removed.size() && delta.removed[r].first == static_cast<int>(out.size())) place(delta.removed[r++].second);
+        if (i == team.size()) break;
+        if (in < delta.inserted.size() && delta.inserted[in].first == static_cast<int>(i)) {
+            ++in;
+            continue;
+        }
+        if (c < delta.changed.size() && delta.changed[c].index == static_cast<int>(i)) {
+            place(delta.changed[c++].before);
+        } else {
+            out.push_back(std::move(team[i]));
+            shadow.push_back(std::move(shadow_[i]));
+        }
+    }
+    for (size_t i = 0; i < out.size(); ++i) out[i]->position = i + 1;
+    team = std::move(out);
+    shadow_ = std::move(shadow);
+}
+
+void TeamTracker::redo(vector<unique_ptr<Unit>>& team, const TeamDelta& delta) {
+    auto replace = [&](size_t index, const UnitState& state) {
+        auto unit = cloneUnit(*state);
+        unit->position = index + 1;
+        shadow_[index] = {unit.get(), state};
+        team[index] = std::move(unit);
+    };
+    if (delta.removed.empty() && delta.inserted.empty()) {
+        for (const auto& change : delta.changed) replace(change.index, change.after);
+        return;
+    }
+    vector<unique_ptr<Unit>> out;
+    vector<Entry> shadow;
+    auto place = [&](const UnitState& state) {
+        out.push_back(cloneUnit(*state));
+        shadow.push_back({out.back().get(), state});
+    };
+    size_t r = 0, in = 0, c = 0;
+    for (size_t o = 0; o <= team.size(); ++o) {
+        while (in < delta.inserted.size() && delta.inserted[in].first == static_cast<int>(out.size())) place(delta.inserted[in++].second);
+        if (o == team.size()) break;
+        if (r < delta.removed.size() && delta.removed[r].first == static_cast<int>(o)) {
+            ++r;
+            continue;
+        }
+        if (c < delta.changed.size() && delta.changed[c].index == static_cast<int>(out.size())) {
+            place(delta.changed[c++].after);
+        } else {
+            out.push_back(std::move(team[o]));
+            shadow.push_back(std::move(shadow_[o]));
+        }
+    }
+    for (size_t i = 0; i < out.size(); ++i) out[i]->position = i + 1;
+    team = std::move(out);
+    shadow_ = std::move(shadow);
+}
+
+
+bool BattleHistory::step() {
+    Battle::Counters before = battle_.counters();
+    if (!battle_.step()) return false;
+    Entry entry{tracker1_.record(battle_.team1()), tracker2_.record(battle_.team2()), before, battle_.counters()};
+    for (const auto& undone : undone_) bytes_ -= undone.bytes();
+    undone_.clear();
+    bytes_ += entry.bytes();
+    done_.push_back(std::move(entry));
+    while (bytes_ > budget_ && !done_.empty()) {
+        bytes_ -= done_.front().bytes();
+        done_.pop_front();
+    }
+    return true;
+}
+
+bool BattleHistory::undo() {
+    if (done_.empty()) return false;
+    Entry entry = std::move(done_.back());
+    done_.pop_back();
+    tracker1_.undo(battle_.team1(), entry.team1);
+    tracker2_.undo(battle_.team2(), entry.team2);
+    battle_.restore(entry.before);
+    undone_.push_back(std::move(entry));
+    return true;
+}
+
+bool BattleHistory::redo() {
+    if (undone_.empty()) return false;
+    Entry entry = std::move(undone_.back());
+    undone_.pop_back();
+    tracker1_.redo(battle_.team1(), entry.team1);
+    tracker2_.redo(battle_.team2(), entry.team2);
+    battle_.restore(entry.after);
+    done_.push_back(std::move(entry));
+    return true;
+}
+
+
+// One unit in a replay; position is implied by the index in the team.
+struct ReplayUnit {
+    uint8_t type, reserved;
+    uint16_t buffs;          // Light Infantry buffs in order, BUFF_CODES index + 1 per nibble
+    int32_t hp, maxHp, extra;  // extra: damage taken (Light Infantry) or charges (Healer)
+};
+static_assert(sizeof(ReplayUnit) == 16);
+
+static void appendBytes(vector<char>& bytes, const void* data, size_t size) {
+    const char* p = static_cast<const char*>(data);
+    bytes.insert(bytes.end(), p, p + size);
+}
+
+static void appendUnit(vector<char>& bytes, const Unit& unit) {
+    ReplayUnit r{static_cast<uint8_t>(unit.typeCode()), 0, 0, unit.hp, unit.max_hp, 0};
+    if (auto li = dynamic_cast<const LightInfantry*>(&unit)) {
+        for (size_t i = 0; i < li->active_buffs.size() && i < 4; i++) {
+            size_t b = find(BUFF_CODES, BUFF_CODES + 4, li->active_buffs[i]) - BUFF_CODES;
+            r.buffs |= static_cast<uint16_t>((b + 1) << (4 * i));
+        }
+        r.extra = li->total_damage_taken;
+    } else if (auto healer = dynamic_cast<const Healer*>(&unit)) {
+        r.extra = healer->healing_charges;
+    }
+    appendBytes(bytes, &r, sizeof(r));
+}
+
+static unique_ptr<Unit> replayUnit(const ReplayUnit& r) {
+    vector<string> buffs;
+    for (int i = 0; i < 4; i++) {
+        int b = (r.buffs >> (4 * i)) & 0xF;
+        if (b >= 1 && b <= 4) buffs.push_back(BUFF_CODES[b - 1]);
+    }
+    auto unit = makeUnit(string(1, static_cast<char>(r.type)), 0, buffs);
+    if (!unit) return nullptr;
+    unit->hp = r.hp;
+    unit->max_hp = r.maxHp;
+    if (auto li = dynamic_cast<LightInfantry*>(unit.get())) {
+        li->total_damage_taken = r.extra;
+    } else if (auto healer = dynamic_cast<Healer*>(unit.get())) {
+        healer->healing_charges = r.extra;
+    }
+    return unit;
+}
+
+static void appendDelta(vector<char>& bytes, const TeamDelta& delta) {
+    uint32_t counts[3] = {static_cast<uint32_t>(delta.removed.size()), static_cast<uint32_t>(delta.inserted.size()),
+                          static_cast<uint32_t>(delta.changed.size())};
+    appendBytes(bytes, counts, sizeof(counts));
+    for (const auto* list : {&delta.removed, &delta.inserted}) {
+        for (const auto& [index, state] : *list) {
+            int32_t i = index;
+            appendBytes(bytes, &i, sizeof(i));
+            appendUnit(bytes, *state);
+        }
+    }
+    for (const auto& change : delta.changed) {
+        int32_t i = change.index;
+        appendBytes(bytes, &i, sizeof(i));
+        appendUnit(bytes, *change.before);
+        appendUnit(bytes, *change.after);
+    }
+}
+
+// Reads what appendDelta wrote, never past `end`; false on a truncated or corrupt record.
+static bool readDelta(const char*& p, const char* end, TeamDelta& delta) {
+    uint32_t counts[3];
+    if (end - p < static_cast<ptrdiff_t>(sizeof(counts))) return false;
+    memcpy(counts, p, sizeof(counts));
+    p += sizeof(counts);
+    const size_t entry = sizeof(int32_t) + sizeof(ReplayUnit);
+    uint64_t need = (uint64_t(counts[0]) + counts[1]) * entry + uint64_t(counts[2]) * (entry + sizeof(ReplayUnit));
+    if (static_cast<uint64_t>(end - p) < need) return false;
+    auto next = [&](UnitState& state) {
+        ReplayUnit r;
+        memcpy(&r, p, sizeof(r));
+        p += sizeof(r);
+        state = replayUnit(r);
+        return state != nullptr;
+    };
+    for (int list = 0; list < 2; list++) {
+        auto& target = list == 0 ? delta.removed : delta.inserted;
+        for (uint32_t k = 0; k < counts[list]; k++) {
+            int32_t index;
+            memcpy(&index, p, sizeof(index));
+            p += sizeof(index);
+            target.push_back({index, nullptr});
+            if (!next(target.back().second)) return false;
+        }
+    }
+    for (uint32_t k = 0; k < counts[2]; k++) {
+        TeamDelta::Change change;
+        int32_t index;
+        memcpy(&index, p, sizeof(index));
+        p += sizeof(index);
+        change.index = index;
+        if (!next(change.before) || !next(change.after)) return false;
+        delta.changed.push_back(std::move(change));
+    }
+    return true;
+}
+
+
+ReplayRecorder::ReplayRecorder(const string& filename, Battle& battle, uint64_t seed, Logger& logger, int keyframeInterval)
+    : battle_(battle), out_(filename, ios::binary | ios::trunc), tracker1_(battle.team1()), tracker2_(battle.team2()),
+      keyframeInterval_(max(keyframeInterval, 1)) {
+    if (!out_) {
+        logger.log("Error: Could not create replay file " + filename, "ERROR");
+        return;
+    }
+    vector<char> header;
+    appendBytes(header, REPLAY_MAGIC, sizeof(REPLAY_MAGIC));
+    int32_t fields[4] = {1, RULES_VERSION, battle.round(), keyframeInterval_};
+    appendBytes(header, fields, sizeof(fields));
+    appendBytes(header, &seed, sizeof(seed));
+    for (const string* name : {&battle.name1(), &battle.name2()}) {
+        uint32_t length = static_cast<uint32_t>(name->size());
+        appendBytes(header, &length, sizeof(length));
+        appendBytes(header, name->data(), name->size());
+    }
+    out_.write(header.data(), header.size());
+    offset_ = header.size();
+    index_.push_back({0, 0, battle.round()});
+    writeKeyframe();
+}
+
+void ReplayRecorder::writeKeyframe() {
+    vector<char> bytes;
+    for (const auto* team : {&battle_.team1(), &battle_.team2()}) {
+        uint32_t count = static_cast<uint32_t>(team->size());
+        appendBytes(bytes, &count, sizeof(count));
+        for (const auto& unit : *team) appendUnit(bytes, *unit);
+    }
+    index_.back()[1] = static_cast<int64_t>(offset_);
+    out_.write(bytes.data(), bytes.size());
+    offset_ += bytes.size();
+}
+
+bool ReplayRecorder::step() {
+    if (!isOpen() || !battle_.step()) return false;
+    vector<char> bytes;
+    appendDelta(bytes, tracker1_.record(battle_.team1()));
+    appendDelta(bytes, tracker2_.record(battle_.team2()));
+    index_.push_back({static_cast<int64_t>(offset_), 0, battle_.round()});
+    out_.write(bytes.data(), bytes.size());
+    offset_ += bytes.size();
+    if ((index_.size() - 1) % keyframeInterval_ == 0) writeKeyframe();
+    return true;
+}
+
+void ReplayRecorder::close() {
+    if (!isOpen()) return;
+    if (index_.back()[1] == 0) writeKeyframe();
+    uint64_t indexOffset = offset_;
+    out_.write(reinterpret_cast<const char*>(index_.data()), index_.size() * sizeof(index_[0]));
+    const BattleResult& result = battle_.result();
+    int32_t outcome[4] = {result.winner, result.rounds, static_cast<int32_t>(result.drawReason), 0};
+    uint64_t trailer[2] = {index_.size(), indexOffset};
+    out_.write(reinterpret_cast<const char*>(outcome), sizeof(outcome));
+    out_.write(reinterpret_cast<const char*>(trailer), sizeof(trailer));
+    out_.write(REPLAY_MAGIC, sizeof(REPLAY_MAGIC));
+    out_.close();
+}
+
+
+ReplayPlayer::ReplayPlayer(const string& filename, Logger& logger) {
+    int fd = open(filename.c_str(), O_RDONLY);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) != 0) {
+        if (fd >= 0) ::close(fd);
+        logger.log("Error: Could not open replay file " + filename, "ERROR");
+        return;
+    }
+    size_t size = static_cast<size_t>(info.st_size);
+    const size_t headerSize = sizeof(REPLAY_MAGIC) + 4 * sizeof(int32_t) + sizeof(uint64_t);
+    const size_t trailerSize = 4 * sizeof(int32_t) + 2 * sizeof(uint64_t) + sizeof(REPLAY_MAGIC);
+    void* mapped = size >= headerSize + trailerSize ? mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    ::close(fd);
+    if (mapped == MAP_FAILED) {
+        logger.log("Error: " + filename + " is not a replay file", "ERROR");
+        return;
+    }
+    char* base = static_cast<char*>(mapped);
+    const char* trailer = base + size - trailerSize;
+    int32_t fields[4], outcome[4];
+    uint64_t frames, indexOffset;
+    memcpy(fields, base + sizeof(REPLAY_MAGIC), sizeof(fields));
+    memcpy(outcome, trailer, sizeof(outcome));
+    memcpy(&frames, trailer + sizeof(outcome), sizeof(frames));
+    memcpy(&indexOffset, trailer + sizeof(outcome) + sizeof(frames), sizeof(indexOffset));
+    bool valid = memcmp(base, REPLAY_MAGIC, sizeof(REPLAY_MAGIC)) == 0 &&
+                 memcmp(trailer + trailerSize - sizeof(REPLAY_MAGIC), REPLAY_MAGIC, sizeof(REPLAY_MAGIC)) == 0 &&
+                 fields[0] == 1 && frames > 0 && indexOffset >= headerSize && indexOffset <= size - trailerSize &&
+                 // Bounded before multiplying, so a corrupt count cannot wrap around and pass.
+                 frames <= (size - trailerSize - indexOffset) / sizeof(index_[0]) &&
+                 indexOffset + frames * sizeof(index_[0]) + trailerSize == size;
+    if (valid && fields[1] != RULES_VERSION) {
+        munmap(mapped, size);
+        logger.log("Error: " + filename + " was recorded under other rules", "ERROR");
+        return;
+    }
+    const char* p = base + headerSize;
+    for (string* name : {&name1_, &name2_}) {
+        uint32_t length = 0;
+        if (valid && p + sizeof(length) <= base + indexOffset) memcpy(&length, p, sizeof(length));
+        valid = valid && p + sizeof(length) + length <= base + indexOffset;
+        if (valid) name->assign(p + sizeof(length), length);
+        p += sizeof(length) + length;
+    }
+    if (valid) {
+        index_.resize(frames);
+        memcpy(index_.data(), base + indexOffset, frames * sizeof(index_[0]));
+        for (size_t f = 0; f < frames && valid; f++) {
+            valid = index_[f][0] >= 0 && static_cast<uint64_t>(index_[f][0]) < indexOffset &&
+                    index_[f][1] >= 0 && static_cast<uint64_t>(index_[f][1]) < indexOffset && (f == 0 || index_[f][0] > 0);
+            if (index_[f][1] > 0) keyframes_.push_back(static_cast<int>(f));
+        }
+        valid = valid && !keyframes_.empty() && keyframes_.front() == 0;
+    }
+    if (!valid) {
+        munmap(mapped, size);
+        index_.clear();
+        keyframes_.clear();
+        logger.log("Error: " + filename + " is not a complete replay file", "ERROR");
+        return;
+    }
+    memcpy(&seed_, base + sizeof(REPLAY_MAGIC) + sizeof(fields), sizeof(seed_));
+    result_ = {outcome[0], outcome[1], static_cast<DrawReason>(outcome[2])};
+    base_ = base;
+    size_ = size;
+    if (!loadKeyframe(0)) {
+        munmap(base_, size_);
+        base_ = nullptr;
+        logger.log("Error: " + filename + " is not a complete replay file", "ERROR");
+    }
+}
+
+ReplayPlayer::~ReplayPlayer() {
+    if (base_) munmap(base_, size_);
+}
+
+bool ReplayPlayer::loadKeyframe(int frame) {
+    const char* p = base_ + index_[frame][1];
+    const char* end = base_ + size_;
+    vector<unique_ptr<Unit>> teams[2];
+    for (auto& team : teams) {
+        uint32_t count;
+        if (end - p < static_cast<ptrdiff_t>(sizeof(count))) return false;
+        memcpy(&count, p, sizeof(count));
+        p += sizeof(count);
+        if (static_cast<uint64_t>(end - p) < uint64_t(count) * sizeof(ReplayUnit)) return false;
+        team.reserve(count);
+        for (uint32_t i = 0; i < count; i++, p += sizeof(ReplayUnit)) {
+            ReplayUnit r;
+            memcpy(&r, p, sizeof(r));
+            auto unit = replayUnit(r);
+            if (!unit) return false;
+            unit->position = i + 1;
+            team.push_back(std::move(unit));
+        }
+    }
+    team1_ = std::move(teams[0]);
+    team2_ = std::move(teams[1]);
+    tracker1_ = make_unique<TeamTracker>(team1_);
+    tracker2_ = make_unique<TeamTracker>(team2_);
+    frame_ = frame;
+    return true;
+}
+
+bool ReplayPlayer::readDeltas(int frame, TeamDelta& delta1, TeamDelta& delta2) const {
+    const char* p = base_ + index_[frame][0];
+    const char* end = base_ + size_;
+    return readDelta(p, end, delta1) && readDelta(p, end, delta2);
+}
+
+bool ReplayPlayer::stepForward() {
+    if (!isOpen() || frame_ + 1 >= frames()) return false;
+    TeamDelta delta1, delta2;
+    if (!readDeltas(frame_ + 1, delta1, delta2)) return false;
+    tracker1_->redo(team1_, delta1);
+    tracker2_->redo(team2_, delta2);
+    frame_++;
+    return true;
+}
+
+bool ReplayPlayer::stepBackward() {
+    if (!isOpen() || frame_ <= 0) return false;
+    TeamDelta delta1, delta2;
+    if (!readDeltas(frame_, delta1, delta2)) return false;
+    tracker1_->undo(team1_, delta1);
+    tracker2_->undo(team2_, delta2);
+    frame_--;
+    return true;
+}
+
+bool ReplayPlayer::seek(int frame) {
+    if (!isOpen() || frame < 0 || frame >= frames()) return false;
+    auto after = lower_bound(keyframes_.begin(), keyframes_.end(), frame);
+    int start = frame_, cost = abs(frame - frame_);
+    if (after != keyframes_.end() && *after - frame + 1 < cost) {
+        start = *after;
+        cost = *after - frame + 1;
+    }
+    if (after != keyframes_.begin() && frame - *prev(after) + 1 < cost) {
+        start = *prev(after);
+        cost = frame - start + 1;
+    }
+    if (start != frame_ && !loadKeyframe(start)) return false;
+    while (frame_ < frame) {
+        if (!stepForward()) return false;
+    }
+    while (frame_ > frame) {
+        if (!stepBackward()) return false;
+    }
+    lastSeekCost_ = cost;
+    return true;
+}
+
+bool ReplayPlayer::seekRound(int round) {
+    if (!isOpen()) return false;
+    auto it = upper_bound(index_.begin(), index_.end(), round,
+                          [](int value, const array<int64_t, 3>& entry) { return value < entry[2]; });
+    return seek(it == index_.begin() ? 0 : static_cast<int>(it - index_.begin()) - 1);
+}
+
+int unitCost(const Unit& unit) {
+    int cost = unit.cost;
+    if (auto li = dynamic_cast<const LightInfantry*>(&unit)) {
+        for (const auto& buff : li->active_buffs) {
+            auto it = BUFFS.find(buff);
+            if (it != BUFFS.end()) cost += it->second.cost;
+        }
+    }
+    return cost;
+}
+
+int teamCost(const vector<unique_ptr<Unit>>& team) {
+    int cost = 0;
+    for (const auto& unit : team) cost += unitCost(*unit);
+    return cost;
+}
+
+static string trimmed(const string& text) {
+    size_t first = text.find_first_not_of(" \t\r\n");
+    if (first == string::npos) return "";
+    size_t last = text.find_last_not_of(" \t\r\n");
+    return text.substr(first, last - first + 1);
+}
+
+bool parseTeamSpec(const string& spec, vector<unique_ptr<Unit>>& team, string& error) {
+    team.clear();
+    istringstream entries(spec);
+    string entry;
+    while (getline(entries, entry, ',')) {
+        entry = trimmed(entry);
+        if (entry.empty()) {
+            error = "empty unit in team spec";
+            return false;
+        }
+        int count = 1;
+        size_t star = entry.find('*');
+        if (star != string::npos) {
+            string countText = trimmed(entry.substr(0, star));
+            if (countText.empty() || countText.find_first_not_of("0123456789") != string::npos ||
+                countText.size() > 6 || (count = stoi(countText)) <= 0) {
+                error = "bad unit count in '" + entry + "'";
+                return false;
+            }
+            entry = trimmed(entry.substr(star + 1));
+        }
+        string type = entry;
+        vector<string> buffs;
+        size_t colon = entry.find(':');
+        if (colon != string::npos) {
+            type = trimmed(entry.substr(0, colon));
+            istringstream buffList(entry.substr(colon + 1));
+            string buff;
+            while (getline(buffList, buff, '+')) {
+                buff = trimmed(buff);
+                if (BUFFS.find(buff) == BUFFS.end() || find(buffs.begin(), buffs.end(), buff) != buffs.end()) {
+                    error = "invalid or duplicate buff '" + buff + "' in '" + entry + "'";
+                    return false;
+                }
+                buffs.push_back(buff);
+            }
+            if (type != "LI" && type != "L") {
+                error = "only Light Infantry takes buffs: '" + entry + "'";
+                return false;
+            }
+        }
+        for (int i = 0; i < count; i++) {
+            auto unit = makeUnit(type, static_cast<int>(team.size()) + 1, buffs);
+            if (!unit) {
+                error = "unknown unit type '" + type + "'";
+                return false;
+            }
+            team.push_back(std::move(unit));
+        }
+    }
+    if (team.empty()) {
+        error = "team spec has no units";
+        return false;
+    }
+    return true;
+}
+
+bool parseMatchupSpec(const string& line, MatchupSpec& matchup, string& error) {
+    size_t separator = line.find(" vs ");
+    if (separator == string::npos) {
+        error = "expected '<team> vs <team>'";
+        return false;
+    }
+    auto side = [&](string text, string& name, vector<unique_ptr<Unit>>& team, const string& fallback) {
+        size_t equals = text.find('=');
+        name = equals == string::npos ? fallback : trimmed(text.substr(0, equals));
+        if (name.empty()) name = fallback;
+        return parseTeamSpec(equals == string::npos ? text : text.substr(equals + 1), team, error);
+    };
+    return side(line.substr(0, separator), matchup.name1, matchup.team1, "Team 1") &&
+           side(line.substr(separator + 4), matchup.name2, matchup.team2, "Team 2");
+}
+
+int roundBucket(int rounds) {
+    if (rounds <= 0) return 0;
+    return min(ROUND_BUCKETS - 1, static_cast<int>(bit_width(static_cast<unsigned>(rounds))));
+}
+
+string roundBucketLabel(int bucket) {
+    if (bucket == 0) return "0";
+    if (bucket == ROUND_BUCKETS - 1) return to_string(1 << (bucket - 1)) + "+";
+    int low = 1 << (bucket - 1), high = (1 << bucket) - 1;
+    return low == high ? to_string(low) : to_string(low) + "-" + to_string(high);
+}
+
+string encodeTeam(const vector<unique_ptr<Unit>>& team) {
+    string out;
+    for (const auto& unit : team) {
+        if (!out.empty()) out += ",";
+        out += unit->typeCode();
+        if (auto li = dynamic_cast<const LightInfantry*>(unit.get())) {
+            vector<string> buffs = li->active_buffs;
+            sort(buffs.begin(), buffs.end());
+            for (const auto& buff : buffs) out += "+" + buff;
+            out += "@" + to_string(unit->hp) + "/" + to_string(unit->max_hp) + "d" + to_string(li->total_damage_taken);
+        } else {
+            out += "@" + to_string(unit->hp) + "/" + to_string(unit->max_hp);
+        }
+        if (auto healer = dynamic_cast<const Healer*>(unit.get())) out += "c" + to_string(healer->healing_charges);
+    }
+    return out;
+}
+
+string matchupKey(const vector<unique_ptr<Unit>>& team1, const vector<unique_ptr<Unit>>& team2,
+                  int round, const SimulationOptions& options) {
+    return encodeTeam(team1) + "|" + encodeTeam(team2) + "|" + (round == 1 ? "r1" : "r2+") +
+           "|v" + to_string(RULES_VERSION) + (options.simultaneous ? "s" : "") + "/cap" + to_string(options.roundCap);
+}
+
+KeyHash storeKeyHash(const string& key) {
+    using uint128 = unsigned __int128;
+    uint128 hash = static_cast<uint128>(0x6c62272e07bb0142ULL) << 64 | 0x62b821756295c58dULL;
+    const uint128 prime = static_cast<uint128>(1) << 88 | 0x13b;
+    for (unsigned char c : key) {
+        hash ^= c;
+        hash *= prime;
+    }
+    return {static_cast<uint64_t>(hash), static_cast<uint64_t>(hash >> 64)};
+}
+
+double mixtureEvidence(int successes, int trials, double p) {
+    int failures = trials - successes;
+    // log B(1 + s, 1 + f) - s log p - f log(1 - p); a side with no outcomes contributes nothing.
+    double evidence = lgamma(1.0 + successes) + lgamma(1.0 + failures) - lgamma(2.0 + trials);
+    if (successes > 0) evidence -= successes * log(p);
+    if (failures > 0) evidence -= failures * log1p(-p);
+    return evidence;
+}
+
+pair<double, double> confidenceSequence(int successes, int trials, double alpha) {
+    if (trials <= 0) return {0.0, 1.0};
+    // The evidence is convex in p with its minimum (at most 0) at s / n, so each bound is one bisection.
+    double threshold = log(1 / alpha), mean = static_cast<double>(successes) / trials;
+    auto bound = [&](double inside, double outside) {
+        if (mixtureEvidence(successes, trials, outside) < threshold) return outside;
+        for (int i = 0; i < 60; i++) {
+            double middle = (inside + outside) / 2;
+            (mixtureEvidence(successes, trials, middle) < threshold ? inside : outside) = middle;
+        }
+        return inside;
+    };
+    return {bound(mean, 0.0), bound(mean, 1.0)};
+}
+
+void parallelFor(ThreadPool& pool, int count, const function<void(int, size_t)>& body) {
+    atomic<int> next{0};
+    for (size_t w = 0; w < pool.size(); w++) {
+        pool.submit([&](size_t worker) {
+            for (int i = next++; i < count; i = next++) body(i, worker);
+        });
+    }
+    pool.wait();
+}
+
+// Puts the state of copy, a cloneUnit of unit, back into unit without replacing the object.
+static void assignState(Unit& unit, const Unit& copy) {
+    if (auto li = dynamic_cast<LightInfantry*>(&unit)) {
+        *li = static_cast<const LightInfantry&>(copy);
+    } else {
+        unit.hp = copy.hp;  // a volley changes nothing else on other units
+    }
+}
+
+// Archers only reach enemies within three places, so in line the volleys of two chunks of Archers
+// meet only in a band of at most seven enemies. Every chunk but the first runs at once on copies of
+// the band it shares with the chunk before and on the live enemies past it, noting how to undo
+// what it did to them. Then, in chunk order, a chunk whose predecessor struck no one in the shared
+// band is exactly what the sequential pass would have done and takes over its band copies; a chunk
+// whose predecessor did is undone and replayed on the live team. Either way the result is that of
+// the sequential pass, for any number of workers.
+void GameManager::playVolleys(const vector<unique_ptr<Unit>>& own, const vector<int>& archers,
+                              vector<unique_ptr<Unit>>& enemy, const string& ownName, const string& enemyName,
+                              int side, Dice& dice, Logger& logger, DamageTally* tally) {
+    struct Saved {
+        int index, hp;
+        unique_ptr<Unit> unit;  // Light Infantry only: armor and buffs can change as well
+    };
+    struct Chunk {
+        size_t first = 0, last = 0;       // range of archers
+        int bandLow = 0, bandHigh = -1;   // enemy indexes shared with the previous chunk
+        vector<unique_ptr<Unit>> band;
+        vector<char> bandStruck;
+        vector<Saved> saved;              // live enemies as they were before this chunk struck them
+        DamageTally damage;
+    };
+    const int enemies = static_cast<int>(enemy.size());
+    size_t count = min(pool_->size() * 4, archers.size() / VOLLEY_CHUNK);
+    vector<Chunk> chunks(count);
+    for (size_t c = 0; c < count; c++) {
+        Chunk& chunk = chunks[c];
+        chunk.first = archers.size() * c / count;
+        chunk.last = archers.size() * (c + 1) / count;
+        if (c == 0) continue;
+        // Archer at index i reaches enemy indexes i - 3 .. i + 3.
+        chunk.bandLow = max(0, archers[chunk.first] - 3);
+        chunk.bandHigh = min(enemies - 1, archers[chunk.first - 1] + 3);
+        for (int k = chunk.bandLow; k <= chunk.bandHigh; k++) chunk.band.push_back(cloneUnit(*enemy[k]));
+        chunk.bandStruck.assign(chunk.band.size(), 0);
+    }
+
+    auto run = [&](Chunk& chunk, bool speculative) {
+        for (size_t a = chunk.first; a < chunk.last; a++) {
+            Unit* archer = own[archers[a]].get();
+            int last = min(enemies - 1, archers[a] + 3);
+            for (int k = max(0, archers[a] - 3); k <= last; k++) {
+                bool banded = speculative && k >= chunk.bandLow && k <= chunk.bandHigh;
+                Unit* target = banded ? chunk.band[k - chunk.bandLow].get() : enemy[k].get();
+                if (target->hp <= 0) continue;
+                if (banded) {
+                    chunk.bandStruck[k - chunk.bandLow] = 1;
+                } else if (chunk.saved.empty() || chunk.saved.back().index != k) {
+                    // Targets never move backwards along a chunk, so a repeat is always the last one saved.
+                    chunk.saved.push_back({k, target->hp, target->typeCode() == 'L' ? cloneUnit(*target) : nullptr});
+                }
+                strike(archer, target, ownName, enemyName, side, dice, logger, tally ? &chunk.damage : nullptr);
+                break;
+            }
+        }
+    };
+    parallelFor(*pool_, static_cast<int>(count), [&](int c, size_t) { run(chunks[c], c > 0); });
+
+    for (size_t c = 1; c < count; c++) {
+        Chunk& chunk = chunks[c];
+        bool clash = false;
+        for (const Saved& saved : chunks[c - 1].saved) {
+            clash = clash || (saved.index >= chunk.bandLow && saved.index <= chunk.bandHigh);
+        }
+        if (!clash) {
+            for (size_t b = 0; b < chunk.band.size(); b++) {
+                if (chunk.bandStruck[b]) assignState(*enemy[chunk.bandLow + b], *chunk.band[b]);
+            }
+            continue;
+        }
+        for (auto it = chunk.saved.rbegin(); it != chunk.saved.rend(); ++it) {
+            if (it->unit) assignState(*enemy[it->index], *it->unit);
+            else enemy[it->index]->hp = it->hp;
+        }
+        chunk.saved.clear();
+        chunk.damage = DamageTally();
+        run(chunk, false);
+    }
+    if (tally) {
+        for (const Chunk& chunk : chunks) {
+            for (int s = 0; s < 2; s++) {
+                for (int t = 0; t < UNIT_TYPES; t++) tally->dealt[s][t] += chunk.damage.dealt[s][t];
+            }
+        }
+    }
+}
+
+// Brings buffer, last round's copy of team, up to date in place; only new or retyped slots allocate.
+// Enemy copies are only ever struck, so hit points and positions are all other units need.
+static void refreshCopy(vector<unique_ptr<Unit>>& buffer, const vector<unique_ptr<Unit>>& team) {
+    buffer.resize(team.size());
+    for (size_t i = 0; i < team.size(); i++) {
+        const Unit& unit = *team[i];
+        unique_ptr<Unit>& slot = buffer[i];
+        if (!slot || slot->typeCode() != unit.typeCode()) {
+            slot = cloneUnit(unit);
+        } else if (auto li = dynamic_cast<LightInfantry*>(slot.get())) {
+            *li = static_cast<const LightInfantry&>(unit);
+        } else {
+            slot->hp = unit.hp;
+            slot->max_hp = unit.max_hp;
+            slot->position = unit.position;
+        }
+    }
+}
+
+// Each side heals, boosts and clones on its real team but strikes a copy of the enemy as it stood
+// when the round began. Once both sides are done, the damage on every copy lands on the unit it
+// was taken from, and whatever the unit's own side added this round (heals, boosts) stays on top
+// if it survives. Clones made this round were not there to be hit. The two phases touch disjoint
+// teams, so with a pool and silent StreamDice the second one runs on a worker next to the first.
+void GameManager::simulateSimultaneousRound(vector<unique_ptr<Unit>>& t1, vector<unique_ptr<Unit>>& t2,
+                                            const string& n1, const string& n2, int round, Dice& dice,
+                                            Logger& logger, DamageTally* tally) {
+    logger.log("\nRound " + to_string(round) + ":", "INFO");
+    vector<unique_ptr<Unit>>* teams[2] = {&t1, &t2};
+    for (int side = 0; side < 2; side++) {
+        refreshCopy(targets_[side], *teams[side]);
+        opening_[side].clear();
+        for (const auto& unit : *teams[side]) opening_[side].push_back({unit.get(), unit->hp, unit->max_hp});
+    }
+    auto* stream = dynamic_cast<StreamDice*>(&dice);
+    if (pool_ && stream && !logger.enabled()) {
+        if (!partner_) partner_ = make_unique<GameManager>();
+        StreamDice second = *stream;
+        pool_->submit([&](size_t) {
+            second.beginPhase(round, 2);
+            partner_->playPhase(t2, targets_[0], n2, n1, round, 1, second, logger, tally);
+        });
+        dice.beginPhase(round, 1);
+        playPhase(t1, targets_[1], n1, n2, round, 0, dice, logger, tally);
+        pool_->wait();
+    } else {
+        dice.beginPhase(round, 1);
+        playPhase(t1, targets_[1], n1, n2, round, 0, dice, logger, tally);
+        dice.beginPhase(round, 2);
+        playPhase(t2, targets_[0], n2, n1, round, 1, dice, logger, tally);
+    }
+    for (int side = 0; side < 2; side++) {
+        for (size_t i = 0; i < opening_[side].size(); i++) {
+            const Opening& before = opening_[side][i];
+            Unit* unit = before.unit;
+            const Unit& hit = *targets_[side][i];
+            int healed = unit->hp - before.hp, boosted = unit->max_hp - before.max_hp;
+            if (auto li = dynamic_cast<LightInfantry*>(unit)) {
+                int position = li->position;
+                *li = static_cast<const LightInfantry&>(hit);
+                li->position = position;
+            } else {
+                unit->hp = hit.hp;
+                unit->max_hp = hit.max_hp;
+            }
+            if (unit->hp > 0) {
+                unit->hp += healed;
+                unit->max_hp += boosted;
+            }
+        }
+    }
+}
+
+
+// Buff numbers in BUFF_CODES order, looked up once.
+struct InlineBuffTable {
+    int hpBoost[4], attackBoost[4], armor[4], threshold[4];
+    uint8_t horse;
+};
+
+static const InlineBuffTable& inlineBuffs() {
+    static const InlineBuffTable table = [] {
+        InlineBuffTable t{};
+        for (int b = 0; b < 4; b++) {
+            const Buff& buff = BUFFS.at(BUFF_CODES[b]);
+            t.hpBoost[b] = buff.hp_boost;
+            t.attackBoost[b] = buff.attack_boost;
+            t.armor[b] = buff.armor;
+            t.threshold[b] = buff.damage_threshold;
+            if (BUFF_CODES[b] == "Ho") t.horse = static_cast<uint8_t>(1 << b);
+        }
+        return t;
+    }();
+    return table;
+}
+
+bool InlineTeam::from(const vector<unique_ptr<Unit>>& team, InlineTeam& out) {
+    if (team.size() > static_cast<size_t>(INLINE_CAPACITY)) return false;
+    out.size = 0;
+    for (size_t i = 0; i < team.size(); i++) {
+        const Unit& unit = *team[i];
+        if (unit.position != static_cast<int>(i) + 1) return false;
+        InlineUnit u{unit.typeCode(), 0, unit.hp, unit.max_hp, unit.attack, 0, 0};
+        if (auto li = dynamic_cast<const LightInfantry*>(&unit)) {
+            for (const auto& buff : li->active_buffs) {
+                size_t b = find(BUFF_CODES, BUFF_CODES + 4, buff) - BUFF_CODES;
+                if (b >= 4 || (u.buffs & (1 << b))) return false;
+                u.buffs |= static_cast<uint8_t>(1 << b);
+            }
+            u.armor = li->armor;
+            u.extra = li->total_damage_taken;
+        } else if (auto healer = dynamic_cast<const Healer*>(&unit)) {
+            u.extra = healer->healing_charges;
+        } else if (u.type == 'G') {
+            // cloneTeam builds the GuliayGorod from the unit's position, which is where it boosts from.
+            u.extra = unit.position;
+        }
+        out.units[out.size++] = u;
+    }
+    return true;
+}
+
+vector<unique_ptr<Unit>> InlineTeam::toUnits() const {
+    vector<unique_ptr<Unit>> team;
+    team.reserve(size);
+    for (int i = 0; i < size; i++) {
+        const InlineUnit& u = units[i];
+        vector<string> buffs;
+        for (int b = 0; b < 4; b++) {
+            if (u.buffs & (1 << b)) buffs.push_back(BUFF_CODES[b]);
+        }
+        auto unit = makeUnit(string(1, u.type), u.type == 'G' ? u.extra : i + 1, buffs);
+        unit->position = i + 1;
+        unit->hp = u.hp;
+        unit->max_hp = u.maxHp;
+        if (auto li = dynamic_cast<LightInfantry*>(unit.get())) {
+            li->total_damage_taken = u.extra;
+        } else if (auto healer = dynamic_cast<Healer*>(unit.get())) {
+            healer->healing_charges = u.extra;
+        }
+        team.push_back(std::move(unit));
+    }
+    return team;
+}
+
+// The rules below mirror the Unit classes and GameManager step for step, including the double
+// rescaling in LightInfantry::applyBuffs, so both paths agree on every battle.
+static void inlineApplyBuffs(InlineUnit& u) {
+    const InlineBuffTable& table = inlineBuffs();
+    double hp_ratio = u.maxHp > 0 ? static_cast<double>(u.hp) / u.maxHp : 1.0;
+    u.maxHp = 50;
+    u.attack = 8;
+    u.armor = 0;
+    for (int b = 0; b < 4; b++) {
+        if (u.buffs & (1 << b)) {
+            u.maxHp += table.hpBoost[b];
+            u.attack += table.attackBoost[b];
+            u.armor += table.armor[b];
+        }
+    }
+    u.hp = static_cast<int>(u.maxHp * hp_ratio);
+    if (u.hp < 0) u.hp = 0;
+}
+
+static void inlineCheckBuffLoss(InlineUnit& u) {
+    const InlineBuffTable& table = inlineBuffs();
+    uint8_t remaining = 0;
+    for (int b = 0; b < 4; b++) {
+        if (!(u.buffs & (1 << b))) continue;
+        if (u.extra <= table.threshold[b]) {
+            remaining |= static_cast<uint8_t>(1 << b);
+        } else if (table.hpBoost[b] > 0) {
+            u.maxHp -= table.hpBoost[b];
+            u.hp = min(u.hp, u.maxHp);
+        }
+    }
+    u.buffs = remaining;
+    inlineApplyBuffs(u);
+}
+
+static int inlineBuffedMaxHp(const InlineUnit& u) {
+    int boosted = 50;
+    for (int b = 0; b < 4; b++) {
+        if (u.buffs & (1 << b)) boosted += inlineBuffs().hpBoost[b];
+    }
+    return boosted;
+}
+
+static int inlineNextThreshold(const InlineUnit& u) {
+    int threshold = numeric_limits<int>::max();
+    for (int b = 0; b < 4; b++) {
+        if (u.buffs & (1 << b)) threshold = min(threshold, inlineBuffs().threshold[b]);
+    }
+    return threshold;
+}
+
+// LightInfantry::applyDamage, or the plain hp drop other units take from a single hit.
+static void inlineHit(InlineUnit& target, int damage) {
+    if (target.type != 'L') {
+        target.hp -= damage;
+        return;
+    }
+    int reduced = max(0, damage - target.armor);
+    target.hp -= reduced;
+    if (reduced > 0) {
+        target.extra += reduced;
+        inlineCheckBuffLoss(target);
+    }
+    if (target.hp < 0) target.hp = 0;
+}
+
+// applyVolley, with LightInfantry::absorbHits for Light Infantry targets.
+static void inlineVolley(InlineUnit& target, int damage, int hits) {
+    if (target.type != 'L') {
+        if (target.hp <= 0 || damage <= 0) return;
+        int lethal = (target.hp + damage - 1) / damage;
+        target.hp -= min(hits, lethal) * damage;
+        return;
+    }
+    if (damage - target.armor <= 0) return;
+    int boosted = inlineBuffedMaxHp(target);
+    int threshold = inlineNextThreshold(target);
+    for (int i = 0; i < hits && target.hp > 0; i++) {
+        int reduced = damage - target.armor;
+        if (reduced <= 0) return;
+        target.hp -= reduced;
+        target.extra += reduced;
+        if (target.extra > threshold) {
+            inlineCheckBuffLoss(target);
+            boosted = inlineBuffedMaxHp(target);
+            threshold = inlineNextThreshold(target);
+        } else {
+            double hp_ratio = target.maxHp > 0 ? static_cast<double>(target.hp) / target.maxHp : 1.0;
+            target.maxHp = boosted;
+            target.hp = static_cast<int>(target.maxHp * hp_ratio);
+        }
+        if (target.hp < 0) target.hp = 0;
+    }
+}
+
+static int inlineFrontDamage(const InlineUnit& u) {
+    return u.type == 'H' || u.type == 'G' ? 0 : u.attack;
+}
+
+static bool inlineHealable(const InlineUnit& u) {
+    return u.type != 'W' && u.type != 'G';
+}
+
+// One side's half of GameManager::simulateRound; false if a clone does not fit.
+static bool inlinePhase(InlineTeam& own, InlineTeam& enemy, int round, StreamDice& dice) {
+    for (int i = 0; i < own.size; i++) {
+        if (own.units[i].hp <= 0) continue;
+        int self = i;
+        char type = own.units[i].type;
+        if (type == 'W') {
+            if (dice.roll(100, self + 1, RollKind::Clone) < 10) {
+                for (int j = 0; j < own.size; j++) {
+                    const InlineUnit& source = own.units[j];
+                    if (source.hp <= 0 || (source.type != 'L' && source.type != 'A')) continue;
+                    if (own.size == INLINE_CAPACITY) return false;
+                    InlineUnit copy = source;
+                    if (copy.type == 'L') {
+                        inlineApplyBuffs(copy);
+                    } else {
+                        copy.hp = copy.maxHp = 40;
+                    }
+                    memmove(&own.units[j + 2], &own.units[j + 1], (own.size - j - 1) * sizeof(InlineUnit));
+                    own.units[j + 1] = copy;
+                    own.size++;
+                    if (j + 1 <= self) self++;
+                    break;
+                }
+            }
+        } else if (type == 'H') {
+            InlineUnit& healer = own.units[i];
+            if (healer.extra > 0) {
+                for (int j = 0; j < own.size; j++) {
+                    InlineUnit& unit = own.units[j];
+                    if (unit.hp > 0 && unit.hp < 30 && inlineHealable(unit)) {
+                        unit.hp += 5;
+                        healer.extra--;
+                        break;
+                    }
+                }
+            }
+        } else if (type == 'G' && round == 1) {
+            int anchor = own.units[i].extra;
+            for (int j = 0; j < own.size; j++) {
+                InlineUnit& unit = own.units[j];
+                if (unit.hp > 0 && abs(j + 1 - anchor) == 1) {
+                    unit.hp += 10;
+                    unit.maxHp += 10;
+                }
+            }
+        }
+        if (enemy.size == 0) break;
+        const InlineUnit& u = own.units[self];
+        int position = self + 1;
+        if (type == 'A') {
+            for (int t = 0; t < enemy.size; t++) {
+                if (enemy.units[t].hp > 0 && abs(position - (t + 1)) <= 3) {
+                    inlineVolley(enemy.units[t], u.attack, dice.roll(5, position, RollKind::Volley) + 1);
+                    break;
+                }
+            }
+        } else if (position == 1 && enemy.units[0].hp > 0) {
+            if (type == 'L') {
+                int hits = dice.roll(2, position, RollKind::Strikes) + ((u.buffs & inlineBuffs().horse) ? 4 : 2);
+                inlineVolley(enemy.units[0], u.attack, hits);
+            } else if (type == 'I' || type == 'W') {
+                inlineHit(enemy.units[0], u.attack);
+            }
+        }
+    }
+    return true;
+}
+
+// The draw and fast-forward rules below read teams through these, so compiled kernels share them.
+static int unitCount(const InlineTeam& team) { return team.size; }
+static const InlineUnit& unitAt(const InlineTeam& team, int i) { return team.units[i]; }
+static InlineUnit& unitAt(InlineTeam& team, int i) { return team.units[i]; }
+
+static void inlineCleanAndShift(InlineTeam& team) {
+    int kept = 0;
+    for (int i = 0; i < team.size; i++) {
+        if (team.units[i].hp > 0) team.units[kept++] = team.units[i];
+    }
+    team.size = kept;
+}
+
+template <typename Team>
+static bool inlineHasArcher(const Team& team) {
+    for (int i = 0; i < unitCount(team); i++) {
+        if (unitAt(team, i).type == 'A') return true;
+    }
+    return false;
+}
+
+template <typename Team>
+static bool inlineCanClone(const Team& team) {
+    bool wizard = false, target = false;
+    for (int i = 0; i < unitCount(team); i++) {
+        char type = unitAt(team, i).type;
+        wizard = wizard || type == 'W';
+        target = target || type == 'L' || type == 'A';
+    }
+    return wizard && target;
+}
+
+template <typename Team1, typename Team2>
+static uint64_t inlineStateHash(const Team1& t1, const Team2& t2) {
+    uint64_t hash = 1469598103934665603ULL;
+    auto mix = [&hash](uint64_t value) { hash = (hash ^ value) * 1099511628211ULL; };
+    auto mixTeam = [&mix](const auto& team) {
+        for (int i = 0; i < unitCount(team); i++) {
+            const InlineUnit& u = unitAt(team, i);
+            mix(u.type);
+            mix(static_cast<uint32_t>(u.hp));
+            mix(static_cast<uint32_t>(u.maxHp));
+            if (u.type == 'L') {
+                mix(static_cast<uint32_t>(u.extra));
+                for (int b = 0; b < 4; b++) {
+                    if (u.buffs & (1 << b)) mix(BUFF_CODES[b][0] << 8 | BUFF_CODES[b][1]);
+                }
+            } else if (u.type == 'H') {
+                mix(static_cast<uint32_t>(u.extra));
+            }
+        }
+        mix(0xff);
+    };
+    mixTeam(t1);
+    mixTeam(t2);
+    return hash;
+}
+
+template <typename Team1, typename Team2>
+static DrawReason inlineCheckDraw(const Team1& t1, const Team2& t2, int roundsPlayed,
+                                  const SimulationOptions& options, StallState& stall) {
+    if (options.roundCap > 0 && roundsPlayed >= options.roundCap) return DrawReason::RoundCap;
+    if (!inlineHasArcher(t1) && !inlineHasArcher(t2) &&
+        inlineFrontDamage(unitAt(t1, 0)) == 0 && inlineFrontDamage(unitAt(t2, 0)) == 0) {
+        return DrawReason::Stalemate;
+    }
+    uint64_t hash = inlineStateHash(t1, t2);
+    bool unchanged = stall.hashed && hash == stall.lastHash;
+    stall.lastHash = hash;
+    stall.hashed = true;
+    if (unchanged && !inlineCanClone(t1) && !inlineCanClone(t2)) return DrawReason::Cycle;
+    return DrawReason::None;
+}
+
+template <typename Team>
+static long long inlineQuietRounds(const Team& team, const InlineUnit& attacker) {
+    bool canHeal = false;
+    for (int i = 0; i < unitCount(team); i++) {
+        if (unitAt(team, i).type == 'H' && unitAt(team, i).extra > 0) canHeal = true;
+    }
+    if (canHeal) {
+        for (int i = 0; i < unitCount(team); i++) {
+            const InlineUnit& u = unitAt(team, i);
+            if (u.hp > 0 && u.hp < 30 && inlineHealable(u)) return 0;
+        }
+    }
+    const InlineUnit& front = unitAt(team, 0);
+    int damage = inlineFrontDamage(attacker);
+    if (damage <= 0) return numeric_limits<long long>::max();
+    int floor = canHeal && inlineHealable(front) ? 30 : 1;
+    return front.hp < floor ? 0 : (front.hp - floor) / damage;
+}
+
+template <typename Team1, typename Team2>
+static int inlineFastForward(Team1& t1, Team2& t2, int round, int maxSkip) {
+    auto deterministic = [](const auto& team) {
+        for (int i = 0; i < unitCount(team); i++) {
+            if (unitAt(team, i).type == 'L' || unitAt(team, i).type == 'A') return false;
+        }
+        return true;
+    };
+    if (round == 1 || !deterministic(t1) || !deterministic(t2)) return 0;
+    long long skip = min(inlineQuietRounds(t1, unitAt(t2, 0)), inlineQuietRounds(t2, unitAt(t1, 0)));
+    if (skip <= 0 || skip == numeric_limits<long long>::max()) return 0;
+    skip = min<long long>({skip, maxSkip, numeric_limits<int>::max() - round});
+    int damage1 = inlineFrontDamage(unitAt(t1, 0)), damage2 = inlineFrontDamage(unitAt(t2, 0));
+    unitAt(t1, 0).hp -= static_cast<int>(skip) * damage2;
+    unitAt(t2, 0).hp -= static_cast<int>(skip) * damage1;
+    return static_cast<int>(skip);
+}
+
+BattleResult playInline(const InlineTeam& team1, const InlineTeam& team2, int round, const SimulationOptions& options,
+                        uint64_t seed, bool antithetic) {
+    InlineTeam t1 = team1, t2 = team2;
+    StreamDice dice(seed, antithetic);
+    StallState stall;
+    const int firstRound = round;
+    while (true) {
+        int played = round - firstRound;
+        if (t1.size == 0 || t2.size == 0) return {t1.size > 0 ? 1 : 2, played};
+        DrawReason reason = inlineCheckDraw(t1, t2, played, options, stall);
+        if (reason != DrawReason::None) return {0, played, reason};
+        if (options.fastForward) {
+            int maxSkip = options.roundCap > 0 ? options.roundCap - played : numeric_limits<int>::max();
+            round += inlineFastForward(t1, t2, round, maxSkip);
+        }
+        // Only a team that can clone may overflow, so only those need their opening state kept.
+        bool cloning1 = inlineCanClone(t1), cloning2 = inlineCanClone(t2);
+        InlineTeam opening1, opening2;
+        if (cloning1 || cloning2) {
+            opening1 = t1;
+            opening2 = t2;
+        }
+        dice.beginPhase(round, 1);
+        bool fits = inlinePhase(t1, t2, round, dice);
+        if (fits) {
+            dice.beginPhase(round, 2);
+            fits = inlinePhase(t2, t1, round, dice);
+        }
+        if (!fits) {
+            NullLogger silent;
+            SimulationOptions rest = options;
+            if (rest.roundCap > 0) rest.roundCap -= round - firstRound;
+            Battle battle(opening1.toUnits(), opening2.toUnits(), "Team 1", "Team 2",
+                          make_unique<StreamDice>(seed, antithetic), silent, rest, round);
+            BattleResult result = battle.run();
+            result.rounds += round - firstRound;
+            return result;
+        }
+        round++;
+        inlineCleanAndShift(t1);
+        inlineCleanAndShift(t2);
+    }
+}
+
+// A team whose unit types are fixed at compile time. Units keep their slot when they die, and the
+// line (order, position) is rebuilt each round the way cleanAndShift would have left it.
+template <char... Types>
+struct KernelTeam {
+    static constexpr int SIZE = sizeof...(Types);
+    static constexpr char TYPES[SIZE] = {Types...};
+    static constexpr bool has(char type) { return ((Types == type) || ...); }
+    // A clone is inserted into the line, which a fixed layout has no room for.
+    static constexpr bool CLONES = has('W') && (has('L') || has('A'));
+
+    InlineUnit units[SIZE];
+    int order[SIZE];     // slots of the living units, front first
+    int position[SIZE];  // 1-based place in line of each living slot
+    int alive = 0;
+
+    void line() {
+        alive = 0;
+        for (int s = 0; s < SIZE; s++) {
+            if (units[s].hp > 0) {
+                order[alive] = s;
+                position[s] = ++alive;
+            }
+        }
+    }
+};
+
+template <char... Types>
+static int unitCount(const KernelTeam<Types...>& team) { return team.alive; }
+template <char... Types>
+static const InlineUnit& unitAt(const KernelTeam<Types...>& team, int i) { return team.units[team.order[i]]; }
+template <char... Types>
+static InlineUnit& unitAt(KernelTeam<Types...>& team, int i) { return team.units[team.order[i]]; }
+
+template <int... Slots, typename F>
+static void unrolled(integer_sequence<int, Slots...>, F&& body) {
+    (body(integral_constant<int, Slots>()), ...);
+}
+
+// inlinePhase with every unit's type known: the loop over own units is unrolled and each slot keeps
+// only the branches of its own type.
+template <typename Own, typename Enemy>
+static void kernelPhase(Own& own, Enemy& enemy, int round, StreamDice& dice) {
+    unrolled(make_integer_sequence<int, Own::SIZE>(), [&](auto slot) {
+        constexpr char type = Own::TYPES[decltype(slot)::value];
+        InlineUnit& u = own.units[slot];
+        if (u.hp <= 0) return;
+        int position = own.position[slot];
+        if constexpr (type == 'H') {
+            for (int k = 0; k < own.alive && u.extra > 0; k++) {
+                InlineUnit& unit = unitAt(own, k);
+                if (unit.hp > 0 && unit.hp < 30 && inlineHealable(unit)) {
+                    unit.hp += 5;
+                    u.extra--;
+                    break;
+                }
+            }
+        } else if constexpr (type == 'G') {
+            if (round == 1) {
+                for (int k = 0; k < own.alive; k++) {
+                    InlineUnit& unit = unitAt(own, k);
+                    if (unit.hp > 0 && abs(k + 1 - u.extra) == 1) {
+                        unit.hp += 10;
+                        unit.maxHp += 10;
+                    }
+                }
+            }
+        }
+        if constexpr (type == 'A') {
+            for (int k = max(0, position - 4); k < min(enemy.alive, position + 3); k++) {
+                InlineUnit& target = unitAt(enemy, k);
+                if (target.hp > 0) {
+                    inlineVolley(target, u.attack, dice.roll(5, position, RollKind::Volley) + 1);
+                    break;
+                }
+            }
+        } else if constexpr (type == 'L' || type == 'I' || type == 'W') {
+            InlineUnit& front = unitAt(enemy, 0);
+            if (position == 1 && front.hp > 0) {
+                if constexpr (type == 'L') {
+                    int hits = dice.roll(2, position, RollKind::Strikes) + ((u.buffs & inlineBuffs().horse) ? 4 : 2);
+                    inlineVolley(front, u.attack, hits);
+                } else {
+                    inlineHit(front, u.attack);
+                }
+            }
+        }
+    });
+}
+
+// playInline for one pair of type sequences. Neither team can clone, so nothing ever overflows.
+template <typename Team1, typename Team2>
+static BattleResult playKernel(const InlineTeam& team1, const InlineTeam& team2, int round,
+                               const SimulationOptions& options, uint64_t seed, bool antithetic) {
+    static_assert(!Team1::CLONES && !Team2::CLONES, "kernels need teams that cannot clone");
+    Team1 t1;
+    Team2 t2;
+    copy(team1.units, team1.units + Team1::SIZE, t1.units);
+    copy(team2.units, team2.units + Team2::SIZE, t2.units);
+    StreamDice dice(seed, antithetic);
+    StallState stall;
+    const int firstRound = round;
+    while (true) {
+        t1.line();
+        t2.line();
+        int played = round - firstRound;
+        if (t1.alive == 0 || t2.alive == 0) return {t1.alive > 0 ? 1 : 2, played};
+        DrawReason reason = inlineCheckDraw(t1, t2, played, options, stall);
+        if (reason != DrawReason::None) return {0, played, reason};
+        if (options.fastForward) {
+            int maxSkip = options.roundCap > 0 ? options.roundCap - played : numeric_limits<int>::max();
+            round += inlineFastForward(t1, t2, round, maxSkip);
+        }
+        dice.beginPhase(round, 1);
+        kernelPhase(t1, t2, round, dice);
+        dice.beginPhase(round, 2);
+        kernelPhase(t2, t1, round, dice);
+        round++;
+    }
+}
+
+struct KernelEntry {
+    string types1, types2;
+    InlineKernel kernel;
+};
+
+template <typename Team1, typename Team2>
+static void addKernels(vector<KernelEntry>& table) {
+    string types1(Team1::TYPES, Team1::SIZE), types2(Team2::TYPES, Team2::SIZE);
+    table.push_back({types1, types2, &playKernel<Team1, Team2>});
+    table.push_back({types2, types1, &playKernel<Team2, Team1>});
+}
+
+// Unit type letters front to back; each pair is compiled for both seatings. Entries are picked from the
+// top of kernelVolume (`Lgame --kernel-report --store FILE`) and kept only while they beat playInline
+// on their own matchup: 1.2-1.45x for the two below, one core, same results. Teams that can clone
+// cannot be listed (see KernelTeam::CLONES).
+static const vector<KernelEntry>& hotKernels() {
+    static const vector<KernelEntry> table = [] {
+        vector<KernelEntry> t;
+        addKernels<KernelTeam<'L', 'I', 'A'>, KernelTeam<'I', 'I', 'I', 'A'>>(t);
+        addKernels<KernelTeam<'L', 'L', 'I', 'I', 'A', 'H'>, KernelTeam<'I', 'I', 'I', 'A', 'A', 'G'>>(t);
+        return t;
+    }();
+    return table;
+}
+
+InlineKernel findKernel(const InlineTeam& team1, const InlineTeam& team2) {
+    auto types = [](const InlineTeam& team) {
+        string result;
+        for (int i = 0; i < team.size; i++) result += team.units[i].type;
+        return result;
+    };
+    string types1 = types(team1), types2 = types(team2);
+    for (const auto& entry : hotKernels()) {
+        if (entry.types1 == types1 && entry.types2 == types2) return entry.kernel;
+    }
+    return &playInline;
+}
+
+vector<KernelVolume> kernelVolume(ResultStore& store) {
+    // A key is "team1|team2|r..|v<rules>[s]/cap..", each team a comma-separated list of units that
+    // start with their type letter.
+    auto typeLetters = [](const string& team) {
+        string result;
+        size_t start = 0;
+        while (start < team.size()) {
+            result += team[start];
+            size_t comma = team.find(',', start);
+            if (comma == string::npos) break;
+            start = comma + 1;
+        }
+        return result;
+    };
+    map<pair<string, string>, uint64_t> battles;
+    store.forEach([&](const string& key, const StoredMatchup& entry) {
+        size_t bar1 = key.find('|'), bar2 = key.find('|', bar1 + 1), rules = key.find("|v", bar2);
+        if (bar2 == string::npos || rules == string::npos) return;
+        size_t cap = key.find('/', rules);
+        if (cap == string::npos || key[cap - 1] == 's') return;
+        battles[{typeLetters(key.substr(0, bar1)), typeLetters(key.substr(bar1 + 1, bar2 - bar1 - 1))}] +=
+            ResultStore::stats(entry).battles;
+    });
+    vector<KernelVolume> volume;
+    for (const auto& [sides, count] : battles) {
+        bool compiled = any_of(hotKernels().begin(), hotKernels().end(), [&](const KernelEntry& entry) {
+            return entry.types1 == sides.first && entry.types2 == sides.second;
+        });
+        volume.push_back({sides.first, sides.second, count, compiled});
+    }
+    stable_sort(volume.begin(), volume.end(), [](const KernelVolume& a, const KernelVolume& b) {
+        return a.battles > b.battles;
+    });
+    return volume;
+}
+
+int checkInlineEngine(int battles, uint64_t seed, Logger& logger) {
+    static const string TYPES[] = {"LI", "HI", "A", "W", "H", "Gu"};
+    static const string LETTERS = "LIAWHG";  // InlineUnit::type of each entry of TYPES
+    mt19937_64 random(seed);
+    auto randomUnit = [&](const string& type, int position) {
+        vector<string> buffs;
+        if (type == "LI") {
+            for (int b = 0; b < 4; b++) {
+                if (random() % 3 == 0) buffs.push_back(BUFF_CODES[b]);
+            }
+        }
+        return makeUnit(type, position, buffs);
+    };
+    auto randomTeam = [&]() {
+        vector<unique_ptr<Unit>> team;
+        int size = 1 + static_cast<int>(random() % 10);
+        for (int i = 0; i < size; i++) team.push_back(randomUnit(TYPES[random() % 6], i + 1));
+        return team;
+    };
+    // Kernels only run on their own type sequences, so those get built on purpose, some of them wounded.
+    auto kernelTeam = [&](const string& types) {
+        vector<unique_ptr<Unit>> team;
+        for (char letter : types) {
+            auto unit = randomUnit(TYPES[LETTERS.find(letter)], static_cast<int>(team.size()) + 1);
+            if (random() % 4 == 0) unit->hp = 1 + static_cast<int>(random() % unit->hp);
+            team.push_back(std::move(unit));
+        }
+        return team;
+    };
+    const auto& kernels = hotKernels();
+    int mismatches = 0;
+    for (int i = 0; i < battles; i++) {
+        vector<unique_ptr<Unit>> team1, team2;
+        // Odd battles go to a hot kernel, even ones to playInline on arbitrary teams.
+        InlineKernel engine = &playInline;
+        if (i % 2 == 1 && !kernels.empty()) {
+            const KernelEntry& kernel = kernels[random() % kernels.size()];
+            team1 = kernelTeam(kernel.types1);
+            team2 = kernelTeam(kernel.types2);
+            engine = kernel.kernel;
+        } else {
+            team1 = randomTeam();
+            team2 = randomTeam();
+        }
+        SimulationOptions options;
+        options.fastForward = random() % 2 == 0;
+        options.roundCap = random() % 4 == 0 ? 50 : 2000;
+        bool antithetic = random() % 2 == 0;
+        int round = 1 + static_cast<int>(random() % 3);
+        uint64_t battleSeed = StreamDice::battleSeed(seed, i);
+
+        InlineTeam packed1, packed2;
+        if (!InlineTeam::from(team1, packed1) || !InlineTeam::from(team2, packed2)) continue;
+        if (engine != &playInline && findKernel(packed1, packed2) != engine) {
+            mismatches++;
+            logger.log("Battle " + to_string(i) + " (" + formatTeamSpec(team1) + " vs " + formatTeamSpec(team2) +
+                       "): findKernel does not return the kernel built for these types", "ERROR");
+            continue;
+        }
+        BattleResult inlined = engine(packed1, packed2, round, options, battleSeed, antithetic);
+        NullLogger silent;
+        Battle battle(cloneTeam(team1), cloneTeam(team2), "Team 1", "Team 2",
+                      make_unique<StreamDice>(battleSeed, antithetic), silent, options, round);
+        BattleResult regular = battle.run();
+        if (inlined.winner != regular.winner || inlined.rounds != regular.rounds ||
+            inlined.drawReason != regular.drawReason) {
+            mismatches++;
+            logger.log("Battle " + to_string(i) + " (" + formatTeamSpec(team1) + " vs " + formatTeamSpec(team2) +
+                       ", dice seed " + to_string(battleSeed) + (antithetic ? " antithetic" : "") +
+                       ", round " + to_string(round) + "): " + (engine == &playInline ? "inline" : "kernel") +
+                       " winner " + to_string(inlined.winner) + " after " + to_string(inlined.rounds) +
+                       " rounds, Battle::run winner " + to_string(regular.winner) + " after " +
+                       to_string(regular.rounds) + " rounds", "ERROR");
+        }
+    }
+    return mismatches;
+}
+
+int playBatch(const vector<unique_ptr<Unit>>& team1, const vector<unique_ptr<Unit>>& team2,
+              const string& t1, const string& t2, int round, int battles, const SimulationOptions& options,
+              const StoppingRule& stopping, uint64_t seed, ThreadPool& pool, StoredMatchup* entry, BatchStats& stats,
+              ColumnWriter* columns, uint64_t matchupId, NotableBattles* notable) {
+    NullLogger silent;
+    // Stored battles used the first seeds, so a rerun continues the sequence instead of repeating it.
+    int first = stats.battles;
+    int remaining = max(0, battles - first);
+
+    // Workers fold results into their own stats and publish them in small chunks, so the stopping
+    // rule sees fresh numbers without a lock per battle.
+    const int publishEvery = stopping.mode == StoppingRule::Mode::Fixed ? numeric_limits<int>::max() : 16;
+    vector<BatchStats> local(pool.size());
+    mutex statsMutex;
+    atomic<bool> stop{stopping.satisfied(stats)};
+    atomic<int> played{0};
+    auto publish = [&](BatchStats& pending) {
+        lock_guard<mutex> lock(statsMutex);
+        stats.merge(pending);
+        pending = BatchStats();
+        if (stopping.satisfied(stats)) stop = true;
+    };
+    vector<vector<uint64_t>> rows(pool.size());
+    vector<uint64_t> composition = columns ? compositionRow(team1, team2) : vector<uint64_t>();
+    vector<NotableBattles> notables(notable ? pool.size() : 0, NotableBattles(notable ? notable->perKind() : 0));
+    // Columns and notable picks read damage tallies off the Battle; plain counting runs inline.
+    InlineTeam packed1, packed2;
+    bool packed = !columns && !notable && !options.simultaneous && InlineTeam::from(team1, packed1) && InlineTeam::from(team2, packed2);
+    InlineKernel kernel = packed ? findKernel(packed1, packed2) : nullptr;
+    parallelFor(pool, remaining, [&](int i, size_t worker) {
+        if (stop) return;
+        uint64_t battleSeed = StreamDice::battleSeed(seed, first + i);
+        if (packed) {
+            BattleResult result = kernel(packed1, packed2, round, options, battleSeed, false);
+            if (entry) ResultStore::add(entry, result);
+            played++;
+            local[worker].add(result);
+            if (local[worker].battles >= publishEvery) publish(local[worker]);
+            return;
+        }
+        Battle battle(cloneTeam(team1), cloneTeam(team2), t1, t2,
+                      make_unique<StreamDice>(battleSeed), silent, options, round);
+        if (columns || notable) battle.trackDamage();
+        BattleResult result = battle.run();
+        if (entry) ResultStore::add(entry, result);
+        played++;
+        local[worker].add(result);
+        if (local[worker].battles >= publishEvery) publish(local[worker]);
+        if (columns) {
+            appendBattleRow(rows[worker], matchupId, battleSeed, composition, battle);
+            if (rows[worker].size() >= 1024 * columns->columnCount()) {
+                columns->append(rows[worker]);
+                rows[worker].clear();
+            }
+        }
+        if (notable) notables[worker].add(BattleSummary::of(first + i, battleSeed, battle));
+    });
+    for (auto& pending : local) stats.merge(pending);
+    if (notable) {
+        for (const auto& pending : notables) notable->merge(pending);
+    }
+    if (columns) {
+        for (const auto& pending : rows) columns->append(pending);
+    }
+    return played;
+}
+
+void playMatchup(const vector<unique_ptr<Unit>>& team1, const vector<unique_ptr<Unit>>& team2,
+                 const string& t1, const string& t2, int round, int battles, const SimulationOptions& options,
+                 const StoppingRule& stopping, uint64_t seed, StoredMatchup* entry, BatchStats& stats,
+                 ColumnWriter* columns, uint64_t matchupId) {
+    NullLogger silent;
+    vector<uint64_t> rows;
+    vector<uint64_t> composition = columns ? compositionRow(team1, team2) : vector<uint64_t>();
+    InlineTeam packed1, packed2;
+    bool packed = !columns && !options.simultaneous && InlineTeam::from(team1, packed1) && InlineTeam::from(team2, packed2);
+    InlineKernel kernel = packed ? findKernel(packed1, packed2) : nullptr;
+    // Battle numbers continue after the stored ones, as in playBatch.
+    for (int i = stats.battles; stats.battles < battles && !stopping.satisfied(stats); i++) {
+        uint64_t battleSeed = StreamDice::battleSeed(seed, i);
+        if (packed) {
+            BattleResult result = kernel(packed1, packed2, round, options, battleSeed, false);
+            if (entry) ResultStore::add(entry, result);
+            stats.add(result);
+            continue;
+        }
+        Battle battle(cloneTeam(team1), cloneTeam(team2), t1, t2,
+                      make_unique<StreamDice>(battleSeed), silent, options, round);
+        if (columns) battle.trackDamage();
+        BattleResult result = battle.run();
+        if (entry) ResultStore::add(entry, result);
+        stats.add(result);
+        if (columns) appendBattleRow(rows, matchupId, battleSeed, composition, battle);
+    }
+    if (columns) columns->append(rows);
+}
+
+BatchStats runBatch(const vector<unique_ptr<Unit>>& team1, const vector<unique_ptr<Unit>>& team2,
+                    const string& t1, const string& t2, int round, int battles, const SimulationOptions& options,
+                    const StoppingRule& stopping, uint64_t seed, ThreadPool& pool, ResultStore* store, Logger& logger,
+                    ColumnWriter* columns, NotableBattles* notable) {
+    BatchStats stats;
+    StoredMatchup* entry = store ? store->findOrCreate(matchupKey(team1, team2, round, options)) : nullptr;
+    if (entry) {
+        stats = ResultStore::stats(*entry);
+        logger.log("Reusing " + to_string(stats.battles) + " stored battles for this matchup", "INFO");
+    }
+    logger.log("Running up to " + to_string(max(0, battles - stats.battles)) + " battles on " + to_string(pool.size()) +
+               " threads: " + t1 + " vs " + t2 + ", seed " + to_string(seed), "INFO");
+    auto start = chrono::steady_clock::now();
+    int played = playBatch(team1, team2, t1, t2, round, battles, options, stopping, seed, pool, entry, stats, columns, 0,
+                           notable);
+    auto elapsed = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start).count();
+    logger.log(stats.summary(t1, t2) + ", time: " + to_string(elapsed) + " ms", "INFO");
+    logger.log(stats.histogram(), "INFO");
+    if (stopping.mode != StoppingRule::Mode::Fixed) {
+        auto [low, high] = confidenceSequence(stats.wins1, stats.wins1 + stats.wins2, stopping.alpha);
+        ostringstream interval;
+        interval << fixed << setprecision(1) << t1 << " share of decisive battles: "
+                 << 100.0 * low << "% - " << 100.0 * high << "% after " << played << " new battles"
+                 << (stopping.satisfied(stats) ? " (stopping rule met)" : " (battle budget exhausted)");
+        logger.log(interval.str(), "INFO");
+    }
+    return stats;
+}
+
+BattleResult replayBattle(const vector<unique_ptr<Unit>>& team1, const vector<unique_ptr<Unit>>& team2,
+                          const string& t1, const string& t2, int round, const SimulationOptions& options,
+                          const BattleSummary& battle, Logger& logger) {
+    Battle replay(cloneTeam(team1), cloneTeam(team2), t1, t2, make_unique<StreamDice>(battle.seed), logger, options, round);
+    return replay.run();
+}
+
+BattleSummary BattleSummary::of(int index, uint64_t seed, const Battle& battle) {
+    BattleSummary summary;
+    summary.index = index;
+    summary.seed = seed;
+    summary.result = battle.result();
+    summary.clones = battle.clones(0) + battle.clones(1);
+    if (summary.result.winner != 0) {
+        long long dealt[2] = {};
+        for (int side = 0; side < 2; side++) {
+            for (int type = 0; type < UNIT_TYPES; type++) dealt[side] += battle.damage().dealt[side][type];
+        }
+        int winner = summary.result.winner - 1;
+        summary.upset = static_cast<double>(dealt[1 - winner]) / max(dealt[winner], 1LL);
+    }
+    return summary;
+}
+
+bool NotableBattles::better(int kind, const BattleSummary& a, const BattleSummary& b) {
+    double ka, kb;
+    switch (kind) {
+        case 0: ka = a.result.rounds; kb = b.result.rounds; break;
+        case 1: ka = a.upset; kb = b.upset; break;
+        case 2: ka = a.clones; kb = b.clones; break;
+        default: {
+            // Smallest hashed seeds: a uniform sample that any split of the batch agrees on.
+            uint64_t ha = StreamDice::mix(a.seed), hb = StreamDice::mix(b.seed);
+            return ha != hb ? ha < hb : a.index < b.index;
+        }
+    }
+    return ka != kb ? ka > kb : a.index < b.index;
+}
+
+void NotableBattles::keep(int kind, const BattleSummary& battle) {
+    auto& kept = kept_[kind];
+    if (perKind_ == 0 || (kept.size() == perKind_ && !better(kind, battle, kept.back()))) return;
+    auto at = upper_bound(kept.begin(), kept.end(), battle,
+                          [&](const BattleSummary& a, const BattleSummary& b) { return better(kind, a, b); });
+    kept.insert(at, battle);
+    if (kept.size() > perKind_) kept.pop_back();
+}
+
+void NotableBattles::add(const BattleSummary& battle) {
+    keep(0, battle);
+    if (battle.upset > 0) keep(1, battle);
+    if (battle.clones > 0) keep(2, battle);
+    keep(3, battle);
+}
+
+void NotableBattles::merge(const NotableBattles& other) {
+    for (int kind = 0; kind < KINDS; kind++) {
+        for (const auto& battle : other.kept_[kind]) keep(kind, battle);
+    }
+}
+
+vector<pair<string, BattleSummary>> NotableBattles::picks() const {
+    static const string names[KINDS] = {"longest", "upset", "clones", "sample"};
+    vector<pair<string, BattleSummary>> picks;
+    for (int kind = 0; kind < KINDS; kind++) {
+        for (const auto& battle : kept_[kind]) {
+            auto same = find_if(picks.begin(), picks.end(), [&](const auto& pick) { return pick.second.index == battle.index; });
+            if (same != picks.end()) same->first += "," + names[kind];
+            else picks.push_back({names[kind], battle});
+        }
+    }
+    return picks;
+}
+
+uint64_t randomSeed() {
+    return static_cast<uint64_t>(chrono::system_clock::now().time_since_epoch().count());
+}
+
+double battleScore(const BattleResult& result) {
+    return result.winner == 1 ? 1.0 : result.winner == 0 ? 0.5 : 0.0;
+}
+
+void runComparison(const vector<unique_ptr<Unit>>& candidateA, const vector<unique_ptr<Unit>>& candidateB,
+                   const vector<unique_ptr<Unit>>& opponent, const string& nameA, const string& nameB,
+                   const string& opponentName, int round, int battles, const SimulationOptions& options,
+                   bool commonRandomNumbers, bool antithetic, uint64_t seed, ThreadPool& pool, Logger& logger) {
+    NullLogger silent;
+    InlineTeam packedA, packedB, packedOpponent;
+    bool packed = !options.simultaneous && InlineTeam::from(candidateA, packedA) && InlineTeam::from(candidateB, packedB) &&
+                  InlineTeam::from(opponent, packedOpponent);
+    InlineKernel kernelA = packed ? findKernel(packedA, packedOpponent) : nullptr;
+    InlineKernel kernelB = packed ? findKernel(packedB, packedOpponent) : nullptr;
+    auto play = [&](const vector<unique_ptr<Unit>>& candidate, const string& name, uint64_t battleSeed, bool mirrored) {
+        if (packed) {
+            bool first = &candidate == &candidateA;
+            InlineKernel kernel = first ? kernelA : kernelB;
+            return battleScore(kernel(first ? packedA : packedB, packedOpponent, round, options, battleSeed, mirrored));
+        }
+        Battle battle(cloneTeam(candidate), cloneTeam(opponent), name, opponentName,
+                      make_unique<StreamDice>(battleSeed, mirrored), silent, options, round);
+        return battleScore(battle.run());
+    };
+    auto sample = [&](const vector<unique_ptr<Unit>>& candidate, const string& name, uint64_t battleSeed) {
+        double score = play(candidate, name, battleSeed, false);
+        return antithetic ? (score + play(candidate, name, battleSeed, true)) / 2 : score;
+    };
+
+    logger.log("Comparing " + nameA + " and " + nameB + " against " + opponentName + " over " +
+               to_string(battles) + " samples, seed " + to_string(seed), "INFO");
+    vector<pair<double, double>> samples(battles);
+    parallelFor(pool, battles, [&](int i, size_t) {
+        uint64_t seedA = StreamDice::battleSeed(seed, i);
+        uint64_t seedB = commonRandomNumbers ? seedA : StreamDice::battleSeed(~seed, i);
+        samples[i] = {sample(candidateA, nameA, seedA), sample(candidateB, nameB, seedB)};
+    });
+    double sumA = 0, sumB = 0, sumDiff = 0, squaresA = 0, squaresB = 0, squaresDiff = 0;
+    for (auto [a, b] : samples) {
+        sumA += a;
+        sumB += b;
+        sumDiff += a - b;
+        squaresA += a * a;
+        squaresB += b * b;
+        squaresDiff += (a - b) * (a - b);
+    }
+
+    double n = battles;
+    auto variance = [n](double sum, double squares) { return n > 1 ? max(0.0, (squares - sum * sum / n) / (n - 1)) : 0.0; };
+    double meanDiff = sumDiff / n;
+    double pairedVariance = variance(sumDiff, squaresDiff);
+    double independentVariance = variance(sumA, squaresA) + variance(sumB, squaresB);
+    ostringstream out;
+    out << fixed << setprecision(3)
+        << nameA << " score: " << sumA / n << ", " << nameB << " score: " << sumB / n
+        << ", difference: " << meanDiff << " +- " << 1.96 * sqrt(pairedVariance / n);
+    logger.log(out.str(), "INFO");
+    if (pairedVariance > 0) {
+        ostringstream gain;
+        gain << fixed << setprecision(1) << "Variance of the difference is " << independentVariance / pairedVariance
+             << "x lower than with independent samples";
+        logger.log(gain.str(), "INFO");
+    }
+}
+
+
+static string unitSpec(const Unit& unit) {
+    static const map<char, string> codes = {{'L', "LI"}, {'I', "HI"}, {'A', "A"}, {'W', "W"}, {'H', "H"}, {'G', "Gu"}};
+    string spec = codes.at(unit.typeCode());
+    if (auto li = dynamic_cast<const LightInfantry*>(&unit)) {
+        for (size_t i = 0; i < li->active_buffs.size(); i++) spec += (i == 0 ? ":" : "+") + li->active_buffs[i];
+    }
+    return spec;
+}
+
+string formatTeamSpec(const vector<unique_ptr<Unit>>& team) {
+    string spec;
+    for (size_t i = 0; i < team.size();) {
+        string unit = unitSpec(*team[i]);
+        size_t run = 1;
+        while (i + run < team.size() && unitSpec(*team[i + run]) == unit) run++;
+        if (!spec.empty()) spec += ", ";
+        spec += run > 1 ? to_string(run) + "*" + unit : unit;
+        i += run;
+    }
+    return spec;
+}
+
+bool TeamEnumerator::next(vector<unique_ptr<Unit>>& team) {
+    static const vector<string> types = {"LI", "HI", "A", "W", "H", "Gu"};
+    static const vector<int> costs = [] {
+        vector<int> result;
+        for (const auto& type : types) result.push_back(makeUnit(type, 1)->cost);
+        return result;
+    }();
+    int cheapest = *min_element(costs.begin(), costs.end());
+    bool canExtend = !started_ || (cost_ + cheapest <= budget_ && (maxUnits_ <= 0 || static_cast<int>(current_.size()) < maxUnits_));
+    started_ = true;
+    if (canExtend) {
+        // Descend: the current team plus the first unit that still fits.
+        for (int t = 0; t < static_cast<int>(types.size()); t++) {
+            if (cost_ + costs[t] <= budget_) {
+                current_.push_back(t);
+                cost_ += costs[t];
+                break;
+            }
+        }
+    } else {
+        // Advance the last slot to the next type that fits, backtracking when a slot runs out.
+        while (!current_.empty()) {
+            int t = current_.back();
+            cost_ -= costs[t];
+            current_.pop_back();
+            while (++t < static_cast<int>(types.size()) && cost_ + costs[t] > budget_) {}
+            if (t < static_cast<int>(types.size())) {
+                current_.push_back(t);
+                cost_ += costs[t];
+                break;
+            }
+        }
+    }
+    if (current_.empty()) return false;
+    team.clear();
+    for (int t : current_) team.push_back(makeUnit(types[t], static_cast<int>(team.size()) + 1));
+    return true;
+}
+
+string PipelineReport::summary() const {
+    auto rate = [](double count, double seconds) { return seconds > 0 ? count / seconds : 0.0; };
+    auto queue = [](const string& name, const Queue& q) {
+        ostringstream out;
+        out << fixed << setprecision(1) << "queue " << name << ": capacity " << q.capacity << ", average depth "
+            << (q.samples > 0 ? q.depthSum / q.samples : 0.0) << ", max depth " << q.maxDepth
+            << ", producers blocked " << 1000 * q.blockedSeconds << " ms";
+        return out.str();
+    };
+    ostringstream out;
+    out << fixed << setprecision(1)
+        << "generator: " << generated << " matchups, " << rate(generated, generatorSeconds) << "/s busy\n"
+        << "workers: " << simulated << " matchups, " << battles << " battles, "
+        << rate(battles, seconds) << " battles/s, busy " << (seconds > 0 ? 100 * workerSeconds / seconds : 0.0) << "% of the time\n"
+        << "aggregator: " << aggregated << " outcomes, " << rate(aggregated, aggregatorSeconds) << "/s busy\n"
+        << queue("generator -> workers", jobs) << "\n"
+        << queue("workers -> aggregator", outcomes) << "\n"
+        << "total: " << seconds << " s";
+    return out.str();
+}
+
+PipelineReport runPipeline(const function<bool(MatchupSpec&)>& generate, const function<void(MatchupOutcome&)>& consume,
+                           const PipelineOptions& options, ResultStore* store, ColumnWriter* columns) {
+    using Clock = chrono::steady_clock;
+    auto secondsSince = [](Clock::time_point start) { return chrono::duration<double>(Clock::now() - start).count(); };
+    BoundedQueue<MatchupJob> jobs(options.queueCapacity);
+    BoundedQueue<MatchupOutcome> outcomes(options.queueCapacity);
+    size_t workerCount = max<size_t>(options.workers, 1);
+    PipelineReport report;
+    report.jobs.capacity = jobs.capacity();
+    report.outcomes.capacity = outcomes.capacity();
+
+    // Pushes into a queue, recording its depth and any time spent waiting for room.
+    auto push = [&](auto& queue, auto& item, PipelineReport::Queue& counters) {
+        size_t depth = queue.depth();
+        counters.depthSum += depth;
+        counters.samples++;
+        counters.maxDepth = max(counters.maxDepth, depth);
+        if (queue.tryPush(item)) return;
+        auto start = Clock::now();
+        queue.push(item);
+        counters.blockedSeconds += secondsSince(start);
+    };
+
+    auto started = Clock::now();
+    thread generator([&] {
+        MatchupJob job;
+        double busy = 0;
+        while (true) {
+            auto start = Clock::now();
+            job.matchup = MatchupSpec();
+            bool more = generate(job.matchup);
+            busy += secondsSince(start);
+            if (!more) break;
+            job.id = report.generated++;
+            push(jobs, job, report.jobs);
+        }
+        report.generatorSeconds = busy;
+        jobs.close();
+    });
+
+    vector<PipelineReport> workerReports(workerCount);
+    vector<thread> workers;
+    for (size_t w = 0; w < workerCount; w++) {
+        workers.emplace_back([&, w] {
+            PipelineReport& local = workerReports[w];
+            MatchupJob job;
+            MatchupOutcome outcome;
+            while (jobs.pop(job)) {
+                auto start = Clock::now();
+                MatchupSpec& m = job.matchup;
+                outcome = MatchupOutcome{job.id, m.name1, m.name2, teamCost(m.team1), teamCost(m.team2), BatchStats()};
+                StoredMatchup* entry = store ? store->findOrCreate(matchupKey(m.team1, m.team2, options.round, options.simulation)) : nullptr;
+                if (entry) outcome.stats = ResultStore::stats(*entry);
+                int before = outcome.stats.battles;
+                playMatchup(m.team1, m.team2, m.name1, m.name2, options.round, options.battles, options.simulation,
+                            options.stopping, options.seed, entry, outcome.stats, columns, job.id);
+                local.simulated++;
+                local.battles += outcome.stats.battles - before;
+                local.workerSeconds += secondsSince(start);
+                push(outcomes, outcome, local.outcomes);
+            }
+        });
+    }
+
+    // The aggregator runs here, so `consume` never needs to be thread-safe.
+    thread closer([&] {
+        generator.join();
+        for (auto& worker : workers) worker.join();
+        outcomes.close();
+    });
+    MatchupOutcome outcome;
+    while (outcomes.pop(outcome)) {
+        auto start = Clock::now();
+        consume(outcome);
+        report.aggregated++;
+        report.aggregatorSeconds += secondsSince(start);
+    }
+    closer.join();
+
+    for (const auto& local : workerReports) {
+        report.simulated += local.simulated;
+        report.battles += local.battles;
+        report.workerSeconds += local.workerSeconds;
+        report.outcomes.depthSum += local.outcomes.depthSum;
+        report.outcomes.samples += local.outcomes.samples;
+        report.outcomes.maxDepth = max(report.outcomes.maxDepth, local.outcomes.maxDepth);
+        report.outcomes.blockedSeconds += local.outcomes.blockedSeconds;
+    }
+    report.workerSeconds /= workerCount;
+    report.seconds = secondsSince(started);
+    return report;
+}
+
+WinEstimate estimateWinProbability(const Battle& battle, chrono::milliseconds budget, ThreadPool& pool,
+                                   uint64_t seed, int maxSamples) {
+    auto start = chrono::steady_clock::now();
+    auto deadline = start + budget;
+    // The round cap counts from the start of the real battle, not from the fork.
+    SimulationOptions options = battle.options();
+    if (options.roundCap > 0) options.roundCap = max(1, options.roundCap - battle.roundsPlayed());
+    InlineTeam packed1, packed2;
+    bool packed = !options.simultaneous && InlineTeam::from(battle.team1(), packed1) && InlineTeam::from(battle.team2(), packed2);
+    InlineKernel kernel = packed ? findKernel(packed1, packed2) : nullptr;
+    atomic<int> next{0};
+    vector<WinEstimate> local(pool.size());
+    for (size_t w = 0; w < pool.size(); w++) {
+        pool.submit([&](size_t worker) {
+            NullLogger silent;
+            WinEstimate& counts = local[worker];
+            for (int k = next++; k < maxSamples; k = next++) {
+                uint64_t forkSeed = StreamDice::battleSeed(seed, k);
+                int winner;
+                if (packed) {
+                    winner = kernel(packed1, packed2, battle.round(), options, forkSeed, false).winner;
+                } else {
+                    Battle fork(cloneTeam(battle.team1()), cloneTeam(battle.team2()), battle.name1(), battle.name2(),
+                                make_unique<StreamDice>(forkSeed), silent, options, battle.round());
+                    winner = fork.run().winner;
+                }
+                counts.samples++;
+                if (winner == 1) counts.wins1++;
+                else if (winner == 2) counts.wins2++;
+                else counts.draws++;
+                if (chrono::steady_clock::now() >= deadline) break;
+            }
+        });
+    }
+    pool.wait();
+    WinEstimate estimate;
+    for (const auto& counts : local) {
+        estimate.samples += counts.samples;
+        estimate.wins1 += counts.wins1;
+        estimate.wins2 += counts.wins2;
+        estimate.draws += counts.draws;
+    }
+    estimate.elapsedMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    return estimate;
+}
+
+ColumnWriter::ColumnWriter(const string& filename, const vector<ColumnInfo>& columns, Logger& logger, size_t blockRows)
+    : out_(filename, ios::binary | ios::trunc), columns_(columns), blockRows_(max<size_t>(blockRows, 1)),
+      pending_(columns.size()) {
+    if (!out_) {
+        logger.log("Error: Could not create column file " + filename, "ERROR");
+        return;
+    }
+    uint32_t header[6] = {1, static_cast<uint32_t>(columns_.size()), static_cast<uint32_t>(min<size_t>(blockRows_, UINT32_MAX)), 0, 0, 0};
+    out_.write(COLUMN_MAGIC, sizeof(COLUMN_MAGIC));
+    out_.write(reinterpret_cast<const char*>(header), sizeof(header));
+    for (const auto& column : columns_) {
+        char descriptor[24] = {};
+        strncpy(descriptor, column.name.c_str(), sizeof(descriptor) - 1);
+        descriptor[sizeof(descriptor) - 1] = static_cast<char>(column.width);
+        out_.write(descriptor, sizeof(descriptor));
+    }
+    offset_ = sizeof(COLUMN_MAGIC) + sizeof(header) + 24 * columns_.size();
+}
+
+void ColumnWriter::append(const vector<uint64_t>& rows) {
+    if (!isOpen() || columns_.empty()) return;
+    lock_guard<mutex> lock(mutex_);
+    for (size_t i = 0; i + columns_.size() <= rows.size(); i += columns_.size()) {
+        for (size_t c = 0; c < columns_.size(); c++) pending_[c].push_back(rows[i + c]);
+        if (pending_[0].size() >= blockRows_) flushBlock();
+    }
+}
+
+void ColumnWriter::flushBlock() {
+    size_t n = pending_[0].size();
+    if (n == 0) return;
+    static const char padding[8] = {};
+    for (size_t c = 0; c < columns_.size(); c++) {
+        const auto& values = pending_[c];
+        ColumnChunk chunk{offset_, *min_element(values.begin(), values.end()), *max_element(values.begin(), values.end())};
+        int width = columns_[c].width;
+        vector<char> bytes(n * width);
+        for (size_t i = 0; i < n; i++) memcpy(&bytes[i * width], &values[i], width);
+        out_.write(bytes.data(), bytes.size());
+        size_t pad = (8 - bytes.size() % 8) % 8;
+        out_.write(padding, pad);
+        offset_ += bytes.size() + pad;
+        chunks_.push_back(chunk);
+        pending_[c].clear();
+    }
+    blockRowCounts_.push_back(n);
+}
+
+void ColumnWriter::close() {
+    lock_guard<mutex> lock(mutex_);
+    if (!out_.is_open()) return;
+    flushBlock();
+    uint64_t indexOffset = offset_;
+    for (size_t b = 0; b < blockRowCounts_.size(); b++) {
+        out_.write(reinterpret_cast<const char*>(&blockRowCounts_[b]), sizeof(uint64_t));
+        out_.write(reinterpret_cast<const char*>(&chunks_[b * columns_.size()]), sizeof(ColumnChunk) * columns_.size());
+    }
+    uint64_t trailer[2] = {blockRowCounts_.size(), indexOffset};
+    out_.write(reinterpret_cast<const char*>(trailer), sizeof(trailer));
+    out_.write(COLUMN_MAGIC, sizeof(COLUMN_MAGIC));
+    out_.close();
+}
+
+ColumnReader::ColumnReader(const string& filename, Logger& logger) {
+    int fd = open(filename.c_str(), O_RDONLY);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) != 0) {
+        if (fd >= 0) ::close(fd);
+        logger.log("Error: Could not open column file " + filename, "ERROR");
+        return;
+    }
+    size_t size = static_cast<size_t>(info.st_size);
+    const size_t headerSize = sizeof(COLUMN_MAGIC) + 6 * sizeof(uint32_t), trailerSize = 2 * sizeof(uint64_t) + sizeof(COLUMN_MAGIC);
+    void* mapped = size >= headerSize + trailerSize ? mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    ::close(fd);
+    if (mapped == MAP_FAILED) {
+        logger.log("Error: " + filename + " is not a column file", "ERROR");
+        return;
+    }
+    char* base = static_cast<char*>(mapped);
+    const char* trailer = base + size - trailerSize;
+    uint32_t header[6];
+    memcpy(header, base + sizeof(COLUMN_MAGIC), sizeof(header));
+    uint64_t blockCount, indexOffset;
+    memcpy(&blockCount, trailer, sizeof(uint64_t));
+    memcpy(&indexOffset, trailer + sizeof(uint64_t), sizeof(uint64_t));
+    size_t columnCount = header[1];
+    size_t blockBytes = sizeof(uint64_t) + columnCount * sizeof(ColumnChunk);
+    // Counts are bounded by the bytes actually there before multiplying, so corrupt ones cannot wrap around.
+    if (memcmp(base, COLUMN_MAGIC, sizeof(COLUMN_MAGIC)) != 0 ||
+        memcmp(trailer + 2 * sizeof(uint64_t), COLUMN_MAGIC, sizeof(COLUMN_MAGIC)) != 0 || header[0] != 1 ||
+        indexOffset < headerSize || indexOffset > size - trailerSize || columnCount > (indexOffset - headerSize) / 24 ||
+        blockCount > (size - trailerSize - indexOffset) / blockBytes ||
+        indexOffset + blockCount * blockBytes + trailerSize != size) {
+        munmap(mapped, size);
+        logger.log("Error: " + filename + " is not a complete column file", "ERROR");
+        return;
+    }
+    for (size_t c = 0; c < columnCount; c++) {
+        const char* descriptor = base + headerSize + 24 * c;
+        columns_.push_back({string(descriptor, strnlen(descriptor, 23)), descriptor[23]});
+    }
+    const char* index = base + indexOffset;
+    for (uint64_t b = 0; b < blockCount; b++) {
+        uint64_t n;
+        memcpy(&n, index, sizeof(n));
+        index += sizeof(n);
+        blockRows_.push_back(n);
+        rows_ += n;
+        for (size_t c = 0; c < columnCount; c++, index += sizeof(ColumnChunk)) {
+            ColumnChunk chunk;
+            memcpy(&chunk, index, sizeof(chunk));
+            chunks_.push_back(chunk);
+        }
+    }
+    base_ = base;
+    size_ = size;
+}
+
+ColumnReader::~ColumnReader() {
+    if (base_) munmap(base_, size_);
+}
+
+int ColumnReader::columnIndex(const string& name) const {
+    for (size_t c = 0; c < columns_.size(); c++) {
+        if (columns_[c].name == name) return static_cast<int>(c);
+    }
+    return -1;
+}
+
+ColumnSummary summarizeColumn(const ColumnReader& reader, int column, uint64_t low, uint64_t high) {
+    ColumnSummary summary;
+    summary.rows = reader.rows();
+    summary.min = numeric_limits<uint64_t>::max();
+    for (size_t b = 0; b < reader.blocks(); b++) {
+        const ColumnChunk& chunk = reader.chunk(b, column);
+        if (chunk.max < low || chunk.min > high) {
+            summary.blocksSkipped++;
+            continue;
+        }
+        uint64_t matching = 0, lowest = numeric_limits<uint64_t>::max(), highest = 0;
+        long double sum = 0;
+        // Integer sums vectorize; fall back to long double only when the block could overflow them.
+        bool exact = reader.blockRows(b) == 0 || chunk.max <= numeric_limits<uint64_t>::max() / reader.blockRows(b);
+        if (chunk.min >= low && chunk.max <= high) {
+            if (exact) {
+                uint64_t total = 0;
+                reader.scanBlock(b, column, [&](uint64_t value) { total += value; });
+                sum = total;
+            } else {
+                reader.scanBlock(b, column, [&](uint64_t value) { sum += value; });
+            }
+            matching = reader.blockRows(b);
+            lowest = chunk.min;
+            highest = chunk.max;
+        } else {
+            reader.scanBlock(b, column, [&](uint64_t value) {
+                if (value < low || value > high) return;
+                matching++;
+                sum += value;
+                lowest = min(lowest, value);
+                highest = max(highest, value);
+            });
+        }
+        summary.matching += matching;
+        summary.sum += sum;
+        summary.min = min(summary.min, lowest);
+        summary.max = max(summary.max, highest);
+    }
+    if (summary.matching == 0) summary.min = 0;
+    return summary;
+}
+
+vector<ColumnInfo> battleColumns() {
+    static const vector<string> codes = {"LI", "HI", "A", "W", "H", "Gu"};
+    vector<ColumnInfo> columns = {{"matchup", 8}, {"seed", 8}, {"winner", 1}, {"rounds", 4}};
+    for (int side = 1; side <= 2; side++) {
+        for (const auto& code : codes) columns.push_back({"count" + to_string(side) + "_" + code, 1});
+    }
+    columns.push_back({"buffs1", 4});
+    columns.push_back({"buffs2", 4});
+    for (const char* kind : {"survivors", "damage"}) {
+        for (int side = 1; side <= 2; side++) {
+            for (const auto& code : codes) {
+                columns.push_back({string(kind) + to_string(side) + "_" + code, string(kind) == "survivors" ? 2 : 4});
+            }
+        }
+    }
+    return columns;
+}
+
+vector<uint64_t> compositionRow(const vector<unique_ptr<Unit>>& team1, const vector<unique_ptr<Unit>>& team2) {
+    vector<uint64_t> row;
+    uint64_t buffs[2] = {};
+    int side = 0;
+    for (const auto* team : {&team1, &team2}) {
+        uint64_t counts[UNIT_TYPES] = {};
+        for (size_t i = 0; i < team->size(); i++) {
+            const Unit* unit = (*team)[i].get();
+            uint64_t& count = counts[unitTypeIndex(unit->typeCode())];
+            if (count < 255) count++;
+            auto li = dynamic_cast<const LightInfantry*>(unit);
+            if (!li || i >= BUFF_POSITIONS) continue;
+            for (int b = 0; b < 4; b++) {
+                if (find(li->active_buffs.begin(), li->active_buffs.end(), BUFF_CODES[b]) != li->active_buffs.end()) {
+                    buffs[side] |= 1ULL << (4 * i + b);
+                }
+            }
+        }
+        row.insert(row.end(), counts, counts + UNIT_TYPES);
+        side++;
+    }
+    row.insert(row.end(), buffs, buffs + 2);
+    return row;
+}
+
+void appendBattleRow(vector<uint64_t>& rows, uint64_t matchupId, uint64_t seed, const vector<uint64_t>& composition,
+                     const Battle& battle) {
+    const BattleResult& result = battle.result();
+    rows.insert(rows.end(), {matchupId, seed, static_cast<uint64_t>(result.winner), static_cast<uint64_t>(result.rounds)});
+    rows.insert(rows.end(), composition.begin(), composition.end());
+    for (const auto* team : {&battle.team1(), &battle.team2()}) {
+        uint64_t survivors[UNIT_TYPES] = {};
+        for (const auto& unit : *team) {
+            if (unit->hp > 0) survivors[unitTypeIndex(unit->typeCode())]++;
+        }
+        rows.insert(rows.end(), survivors, survivors + UNIT_TYPES);
+    }
+    for (int side = 0; side < 2; side++) {
+        for (int type = 0; type < UNIT_TYPES; type++) {
+            rows.push_back(static_cast<uint64_t>(min<long long>(battle.damage().dealt[side][type], UINT32_MAX)));
+        }
+    }
+}
+
+static int unitTypeFromCode(const string& code) {
+    static const map<string, int> types = {{"LI", 0}, {"L", 0}, {"HI", 1}, {"I", 1}, {"A", 2}, {"W", 3}, {"H", 4},
+                                           {"Gu", 5}, {"G", 5}};
+    auto it = types.find(code);
+    return it == types.end() ? -1 : it->second;
+}
+
+static bool parseTeamTerm(const string& text, TeamTerm& term, string& error) {
+    size_t at = text.find('@');
+    if (at != string::npos) {
+        term.kind = TeamTerm::Kind::Buff;
+        string buff = text.substr(0, at), position = text.substr(at + 1);
+        if (buff.rfind("LI:", 0) == 0) buff = buff.substr(3);
+        term.buff = static_cast<int>(find(BUFF_CODES, BUFF_CODES + 4, buff) - BUFF_CODES);
+        if (term.buff == 4 || position.empty() || position.find_first_not_of("0123456789") != string::npos ||
+            position.size() > 2 || stoi(position) < 1 || stoi(position) > BUFF_POSITIONS) {
+            error = "bad buff term '" + text + "' (expected e.g. Sh@1, positions 1-" + to_string(BUFF_POSITIONS) + ")";
+            return false;
+        }
+        term.position = stoi(position);
+        return true;
+    }
+    size_t op = text.find_first_of("<>=!");
+    term.type = unitTypeFromCode(text.substr(0, op));
+    if (term.type < 0) {
+        error = "unknown unit type in '" + text + "'";
+        return false;
+    }
+    if (op == string::npos) return true;
+    size_t digits = text.find_first_not_of("<>=!", op);
+    term.op = text.substr(op, digits == string::npos ? string::npos : digits - op);
+    string value = digits == string::npos ? "" : text.substr(digits);
+    static const vector<string> ops = {"<", "<=", "=", "==", "!=", ">=", ">"};
+    if (find(ops.begin(), ops.end(), term.op) == ops.end() || value.empty() || value.size() > 3 ||
+        value.find_first_not_of("0123456789") != string::npos) {
+        error = "bad count term '" + text + "' (expected e.g. A >= 2)";
+        return false;
+    }
+    term.value = stoi(value);
+    return true;
+}
+
+bool parseResultQuery(const string& text, ResultQuery& query, string& error) {
+    query = ResultQuery();
+    istringstream words(text);
+    vector<string> tokens;
+    string word;
+    while (words >> word) tokens.push_back(word);
+    vector<TeamTerm>* side = &query.team;
+    string pending;
+    bool negated = false;
+    auto finish = [&]() {
+        if (pending.empty()) return true;
+        TeamTerm term;
+        if (!parseTeamTerm(pending, term, error)) return false;
+        term.negated = negated;
+        side->push_back(term);
+        pending.clear();
+        negated = false;
+        return true;
+    };
+    for (size_t i = 0; i < tokens.size(); i++) {
+        const string& token = tokens[i];
+        if (token == "and" || token == "vs" || token == "seat") {
+            if (!finish()) return false;
+            if (token == "vs") {
+                if (side == &query.opponent) {
+                    error = "only one 'vs' allowed";
+                    return false;
+                }
+                side = &query.opponent;
+            } else if (token == "seat") {
+                if (i + 1 >= tokens.size() || (tokens[i + 1] != "1" && tokens[i + 1] != "2")) {
+                    error = "'seat' expects 1 or 2";
+                    return false;
+                }
+                query.seat = stoi(tokens[++i]);
+            }
+        } else if (token == "not" && pending.empty()) {
+            negated = !negated;
+        } else {
+            pending += token;
+        }
+    }
+    return finish();
+}
+
+ResultIndex::ResultIndex(const ColumnReader& reader) : reader_(reader) {
+    auto find = [&](const string& name) {
+        int column = reader.columnIndex(name);
+        if (column < 0) valid_ = false;
+        return column;
+    };
+    winner_ = find("winner");
+    rounds_ = find("rounds");
+    static const vector<string> codes = {"LI", "HI", "A", "W", "H", "Gu"};
+    for (int side = 0; side < 2; side++) {
+        for (int type = 0; type < UNIT_TYPES; type++) counts_[side][type] = find("count" + to_string(side + 1) + "_" + codes[type]);
+        buffs_[side] = find("buffs" + to_string(side + 1));
+    }
+}
+
+const vector<Bitmap>& ResultIndex::equalityIndex(int column) {
+    auto it = equality_.find(column);
+    if (it != equality_.end()) return it->second;
+    uint64_t largest = 0;
+    for (size_t b = 0; b < reader_.blocks(); b++) largest = max(largest, reader_.chunk(b, column).max);
+    vector<Bitmap> index(min<uint64_t>(largest, 255) + 1, Bitmap(reader_.rows()));
+    uint64_t row = 0;
+    reader_.scan(column, [&](uint64_t value) { index[min<uint64_t>(value, 255)].set(row++); });
+    return equality_[column] = std::move(index);
+}
+
+const vector<Bitmap>& ResultIndex::bitIndex(int column) {
+    auto it = bits_.find(column);
+    if (it != bits_.end()) return it->second;
+    vector<Bitmap> index(4 * BUFF_POSITIONS, Bitmap(reader_.rows()));
+    uint64_t row = 0;
+    reader_.scan(column, [&](uint64_t value) {
+        for (uint64_t rest = value; rest; rest &= rest - 1) {
+            int bit = countr_zero(rest);
+            if (bit < 4 * BUFF_POSITIONS) index[bit].set(row);
+        }
+        row++;
+    });
+    return bits_[column] = std::move(index);
+}
+
+Bitmap ResultIndex::termBitmap(const TeamTerm& term, int side) {
+    Bitmap result(reader_.rows());
+    if (term.kind == TeamTerm::Kind::Buff) {
+        result = bitIndex(buffs_[side])[4 * (term.position - 1) + term.buff];
+    } else {
+        const vector<Bitmap>& index = equalityIndex(counts_[side][term.type]);
+        for (int value = 0; value < static_cast<int>(index.size()); value++) {
+            bool match = term.op == "<" ? value < term.value : term.op == "<=" ? value <= term.value :
+                         term.op == ">" ? value > term.value : term.op == ">=" ? value >= term.value :
+                         term.op == "!=" ? value != term.value : value == term.value;
+            if (match) result |= index[value];
+        }
+    }
+    if (term.negated) result.flip(reader_.rows());
+    return result;
+}
+
+Bitmap ResultIndex::teamBitmap(const vector<TeamTerm>& terms, int side) {
+    Bitmap result(reader_.rows());
+    result.flip(reader_.rows());
+    for (const auto& term : terms) result &= termBitmap(term, side);
+    return result;
+}
+
+long double ResultIndex::sumRounds(const Bitmap& rows) const {
+    long double sum = 0;
+    uint64_t row = 0;
+    reader_.scan(rounds_, [&](uint64_t value) {
+        if (rows.test(row++)) sum += value;
+    });
+    return sum;
+}
+
+QueryResult ResultIndex::run(const ResultQuery& query) {
+    QueryResult result;
+    if (!valid_) return result;
+    const vector<Bitmap>& winners = equalityIndex(winner_);
+    Bitmap none(reader_.rows());
+    for (int seat = 1; seat <= 2; seat++) {
+        if (query.seat != 0 && query.seat != seat) continue;
+        Bitmap rows = teamBitmap(query.team, seat - 1);
+        rows &= teamBitmap(query.opponent, 2 - seat);
+        uint64_t battles = rows.count();
+        if (battles == 0) continue;
+        uint64_t wins = rows.countAnd(static_cast<int>(winners.size()) > seat ? winners[seat] : none);
+        uint64_t draws = rows.countAnd(winners[0]);
+        result.battles += battles;
+        result.wins += wins;
+        result.draws += draws;
+        result.losses += battles - wins - draws;
+        result.rounds += sumRounds(rows);
+    }
+    return result;
+}
+
+size_t ResultIndex::indexBytes() const {
+    size_t bytes = 0;
+    for (const auto* indexes : {&equality_, &bits_}) {
+        for (const auto& [column, bitmaps] : *indexes) {
+            for (const auto& bitmap : bitmaps) bytes += bitmap.words.size() * sizeof(uint64_t);
+        }
+    }
+    return bytes;
+}
+
+void OutcomeModel::features(const uint64_t* composition, double* x) {
+    x[0] = 1;
+    for (int i = 0; i < 2 * UNIT_TYPES; i++) x[1 + i] = static_cast<double>(composition[i]);
+    for (int side = 0; side < 2; side++) {
+        uint64_t buffs = composition[2 * UNIT_TYPES + side];
+        for (int b = 0; b < 4; b++) {
+            int count = 0;
+            for (int position = 0; position < BUFF_POSITIONS; position++) count += buffs >> (4 * position + b) & 1;
+            x[1 + 2 * UNIT_TYPES + 4 * side + b] = count;
+        }
+    }
+}
+
+double OutcomeModel::predict(const uint64_t* composition) const {
+    double x[FEATURES];
+    features(composition, x);
+    double z = 0;
+    for (int i = 0; i < FEATURES; i++) z += weights[i] * x[i];
+    return 1 / (1 + exp(-z));
+}
+
+bool OutcomeModel::save(const string& filename, Logger& logger) const {
+    ofstream out(filename);
+    if (!out) {
+        logger.log("Error: Could not save model to " + filename, "ERROR");
+        return false;
+    }
+    out << "LGMODEL1 " << RULES_VERSION << ' ' << FEATURES << '\n' << setprecision(17);
+    for (double weight : weights) out << weight << '\n';
+    return static_cast<bool>(out);
+}
+
+bool OutcomeModel::load(const string& filename, Logger& logger) {
+    ifstream in(filename);
+    string magic;
+    int rulesVersion = 0, features = 0;
+    if (!in || !(in >> magic >> rulesVersion >> features) || magic != "LGMODEL1" || features != FEATURES) {
+        logger.log("Error: " + filename + " is not an outcome model", "ERROR");
+        return false;
+    }
+    if (rulesVersion != RULES_VERSION) {
+        logger.log("Error: " + filename + " was trained for rules version " + to_string(rulesVersion), "ERROR");
+        return false;
+    }
+    for (double& weight : weights) {
+        if (!(in >> weight)) {
+            logger.log("Error: " + filename + " is truncated", "ERROR");
+            return false;
+        }
+    }
+    return true;
+}
+
+string CalibrationReport::summary() const {
+    ostringstream out;
+    out << fixed << setprecision(4) << "trained on " << trainMatchups << " matchups (" << static_cast<long long>(trainBattles)
+        << " battles), tested on " << testMatchups << " held-out matchups (" << static_cast<long long>(testBattles)
+        << " battles)\nBrier score of matchup mean scores " << brier << " (constant baseline " << baselineBrier << "), log loss " << logLoss
+        << "\npredicted  observed  battles\n";
+    for (const auto& bin : bins) {
+        if (bin.battles == 0) continue;
+        out << setw(9) << bin.predicted / bin.battles << "  " << setw(8) << bin.observed / bin.battles << "  "
+            << static_cast<long long>(bin.battles) << "\n";
+    }
+    string text = out.str();
+    text.pop_back();
+    return text;
+}
+
+bool trainOutcomeModel(const ColumnReader& reader, OutcomeModel& model, CalibrationReport& report, string& error) {
+    const int compositionColumns = 2 * UNIT_TYPES + 2;
+    static const vector<string> codes = {"LI", "HI", "A", "W", "H", "Gu"};
+    vector<int> columns;
+    for (int side = 1; side <= 2; side++) {
+        for (const auto& code : codes) columns.push_back(reader.columnIndex("count" + to_string(side) + "_" + code));
+    }
+    columns.push_back(reader.columnIndex("buffs1"));
+    columns.push_back(reader.columnIndex("buffs2"));
+    columns.push_back(reader.columnIndex("winner"));
+    if (find(columns.begin(), columns.end(), -1) != columns.end()) {
+        error = "the file has no composition columns";
+        return false;
+    }
+
+    // Battles of one composition collapse into a weight and a mean score, block by block.
+    struct Group {
+        double battles = 0, score = 0;
+    };
+    map<vector<uint64_t>, Group> groups;
+    for (size_t b = 0; b < reader.blocks(); b++) {
+        vector<vector<uint64_t>> values(columns.size());
+        for (size_t c = 0; c < columns.size(); c++) {
+            values[c].reserve(reader.blockRows(b));
+            reader.scanBlock(b, columns[c], [&](uint64_t value) { values[c].push_back(value); });
+        }
+        vector<uint64_t> key(compositionColumns);
+        for (uint64_t row = 0; row < reader.blockRows(b); row++) {
+            for (int c = 0; c < compositionColumns; c++) key[c] = values[c][row];
+            Group& group = groups[key];
+            uint64_t winner = values[compositionColumns][row];
+            group.battles++;
+            group.score += winner == 1 ? 1.0 : winner == 0 ? 0.5 : 0.0;
+        }
+    }
+
+    const int n = OutcomeModel::FEATURES;
+    struct Sample {
+        double x[OutcomeModel::FEATURES];
+        double battles, score;
+    };
+    vector<Sample> train, test;
+    for (const auto& [key, group] : groups) {
+        Sample sample;
+        OutcomeModel::features(key.data(), sample.x);
+        sample.battles = group.battles;
+        sample.score = group.score / group.battles;
+        uint64_t hash = 0;
+        for (uint64_t value : key) hash = StreamDice::mix(hash ^ value);
+        (hash % 5 == 0 ? test : train).push_back(sample);
+    }
+    if (train.empty() || test.empty()) {
+        error = "need at least two distinct matchups with some of them held out; got " + to_string(groups.size());
+        return false;
+    }
+
+    // Newton's method on the weighted log-likelihood with a light ridge penalty, which keeps the
+    // Hessian invertible when some feature never varies (say, no team ever had a Helmet).
+    const double ridge = 1e-3;
+    fill(begin(model.weights), end(model.weights), 0.0);
+    for (int iteration = 0; iteration < 50; iteration++) {
+        vector<double> gradient(n, 0.0), hessian(n * n, 0.0);
+        for (const auto& sample : train) {
+            double z = 0;
+            for (int i = 0; i < n; i++) z += model.weights[i] * sample.x[i];
+            double p = 1 / (1 + exp(-z));
+            double residual = sample.battles * (sample.score - p), curvature = sample.battles * p * (1 - p);
+            for (int i = 0; i < n; i++) {
+                gradient[i] += residual * sample.x[i];
+                for (int j = 0; j <= i; j++) hessian[i * n + j] += curvature * sample.x[i] * sample.x[j];
+            }
+        }
+        for (int i = 0; i < n; i++) {
+            gradient[i] -= ridge * model.weights[i];
+            hessian[i * n + i] += ridge;
+            for (int j = 0; j < i; j++) hessian[j * n + i] = hessian[i * n + j];
+        }
+        // Gaussian elimination with partial pivoting; the step ends up in gradient.
+        for (int col = 0; col < n; col++) {
+            int pivot = col;
+            for (int row = col + 1; row < n; row++) {
+                if (fabs(hessian[row * n + col]) > fabs(hessian[pivot * n + col])) pivot = row;
+            }
+            for (int k = 0; k < n; k++) swap(hessian[col * n + k], hessian[pivot * n + k]);
+            swap(gradient[col], gradient[pivot]);
+            for (int row = col + 1; row < n; row++) {
+                double factor = hessian[row * n + col] / hessian[col * n + col];
+                for (int k = col; k < n; k++) hessian[row * n + k] -= factor * hessian[col * n + k];
+                gradient[row] -= factor * gradient[col];
+            }
+        }
+        double stepSize = 0;
+        for (int row = n - 1; row >= 0; row--) {
+            for (int k = row + 1; k < n; k++) gradient[row] -= hessian[row * n + k] * gradient[k];
+            gradient[row] /= hessian[row * n + row];
+            model.weights[row] += gradient[row];
+            stepSize = max(stepSize, fabs(gradient[row]));
+        }
+        if (stepSize < 1e-9) break;
+    }
+
+    report = CalibrationReport();
+    report.trainMatchups = train.size();
+    report.testMatchups = test.size();
+    double meanScore = 0;
+    for (const auto& sample : train) {
+        report.trainBattles += sample.battles;
+        meanScore += sample.battles * sample.score;
+    }
+    meanScore /= report.trainBattles;
+    for (const auto& sample : test) {
+        double z = 0;
+        for (int i = 0; i < n; i++) z += model.weights[i] * sample.x[i];
+        double p = 1 / (1 + exp(-z)), clamped = min(max(p, 1e-9), 1 - 1e-9);
+        report.testBattles += sample.battles;
+        report.brier += sample.battles * (sample.score - p) * (sample.score - p);
+        report.baselineBrier += sample.battles * (sample.score - meanScore) * (sample.score - meanScore);
+        report.logLoss -= sample.battles * (sample.score * log(clamped) + (1 - sample.score) * log(1 - clamped));
+        CalibrationBin& bin = report.bins[min(9, static_cast<int>(p * 10))];
+        bin.predicted += sample.battles * p;
+        bin.observed += sample.battles * sample.score;
+        bin.battles += sample.battles;
+    }
+    report.brier /= report.testBattles;
+    report.baselineBrier /= report.testBattles;
+    report.logLoss /= report.testBattles;
+    return true;
+}
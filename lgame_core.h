@@ -0,0 +1,2244 @@
+#ifndef LGAME_CORE_H
+#define LGAME_CORE_H
+
+#include <iostream>
+#include <vector>
+#include <string>
+#include <cstdlib>
+#include <ctime>
+#include <fstream>
+#include <sstream>
+#include <map>
+#include <chrono>
+#include <algorithm>
+#include <random>
+#include <stack>
+#include <memory>
+#include <limits>
+#include <iomanip>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <queue>
+#include <deque>
+#include <array>
+#include <unordered_map>
+#include <cstring>
+#include <cmath>
+#include <bit>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+
+class Logger {
+public:
+    virtual void log(const string& message, const string& level = "INFO") = 0;
+    virtual bool enabled() const { return true; }
+    virtual ~Logger() = default;
+};
+
+
+class NullLogger : public Logger {
+public:
+    void log(const string&, const string&) override {}
+    bool enabled() const override { return false; }
+};
+
+
+class ConsoleLogger : public Logger {
+public:
+    void log(const string& message, const string& level) override {
+        cout << message << "\n";
+    }
+};
+
+
+// Plain log file without timestamps, for logs written in bulk.
+class FileLogger : public Logger {
+public:
+    FileLogger(const string& filename) : out_(filename, ios::trunc) {}
+    bool isOpen() const { return out_.is_open(); }
+    void log(const string& message, const string& level) override {
+        out_ << "[" << level << "] " << message << "\n";
+    }
+private:
+    ofstream out_;
+};
+
+
+class LoggerProxy : public Logger {
+public:
+    LoggerProxy(const string& filename) : file_logger(filename.c_str(), ios::app) {
+        real_logger = make_unique<ConsoleLogger>();
+        if (!file_logger.is_open()) {
+            real_logger->log("Failed to open log file: " + filename, "ERROR");
+        } else {
+            real_logger->log("Successfully opened log file: " + filename, "DEBUG");
+        }
+    }
+    void log(const string& message, const string& level) override {
+        real_logger->log(message, level);
+        if (file_logger.is_open()) {
+            auto now = chrono::system_clock::now();
+            auto time = chrono::system_clock::to_time_t(now);
+            string timestamp = ctime(&time);
+            timestamp.pop_back();
+            file_logger << "[" << timestamp << "] [" << level << "] " << message << "\n";
+            file_logger.flush();
+        }
+    }
+    ~LoggerProxy() {
+        if (file_logger.is_open()) {
+            file_logger.close();
+        }
+    }
+private:
+    unique_ptr<Logger> real_logger;
+    ofstream file_logger;
+};
+
+
+struct Buff {
+    string name;
+    int hp_boost, attack_boost, extra_attacks, armor, cost, damage_threshold;
+};
+
+
+inline const map<string, Buff> BUFFS = {
+    {"Ho", {"Horse", 5, 0, 2, 0, 5, 15}},
+    {"Sp", {"Spear", 0, 5, 0, 0, 3, 10}},
+    {"Sh", {"Shield", 0, 0, 0, 10, 4, 20}},
+    {"He", {"Helmet", 5, 0, 0, 0, 2, 25}}
+};
+
+
+enum class RollKind { Strikes = 1, Volley = 2, Clone = 3 };
+
+
+// Source of every random decision made during a battle. The engine tells it whose turn it is,
+// so a roll can be identified by (round, side, position, kind) rather than by draw order.
+class Dice {
+public:
+    virtual void beginPhase(int round, int side) {}
+    virtual int roll(int sides, int position, RollKind kind) = 0;
+    virtual ~Dice() = default;
+};
+
+
+// Counter-based dice: each roll is a hash of the seed and the roll's identity, so two battles with
+// the same seed make the same decision wherever the same unit slot rolls in the same round
+// (common random numbers). The antithetic twin mirrors every roll, k -> sides - 1 - k.
+class StreamDice : public Dice {
+public:
+    StreamDice(uint64_t seed, bool antithetic = false) : seed_(seed), antithetic_(antithetic) {}
+    void beginPhase(int round, int side) override {
+        phase_ = mix(seed_ ^ mix((static_cast<uint64_t>(round) << 2) | static_cast<uint64_t>(side)));
+    }
+    int roll(int sides, int position, RollKind kind) override {
+        uint64_t bits = mix(phase_ ^ mix((static_cast<uint64_t>(position) << 8) | static_cast<uint64_t>(kind)));
+        int value = min(sides - 1, static_cast<int>((bits >> 11) * 0x1.0p-53 * sides));
+        return antithetic_ ? sides - 1 - value : value;
+    }
+    static uint64_t mix(uint64_t x) {
+        x += 0x9e3779b97f4a7c15ULL;
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+        return x ^ (x >> 31);
+    }
+    // Dice seed of battle i of a run. The run seed is mixed before i is added, so runs with nearby
+    // seeds (N and N + 1) do not share battles.
+    static uint64_t battleSeed(uint64_t seed, uint64_t i) { return mix(mix(seed) + i); }
+private:
+    uint64_t seed_;
+    bool antithetic_;
+    uint64_t phase_ = 0;
+};
+
+
+class Unit {
+public:
+    string name;
+    int hp, max_hp, attack, position, cost;
+    virtual void attackUnit(Unit* target, const string& attackerTeam, const string& targetTeam, Dice& dice, Logger& logger) = 0;
+    virtual void specialAbility(vector<unique_ptr<Unit>>& team, const string& teamName, int round, Dice& dice, Logger& logger) {}
+    virtual unique_ptr<Unit> clone() const = 0;
+    virtual char typeCode() const = 0;
+    virtual void saveExtra(ofstream& out) const { out << max_hp << ' '; }
+    virtual void loadExtra(istringstream& iss) { iss >> max_hp; }
+    // Equal apart from position, which follows from the index in the team.
+    virtual bool sameState(const Unit& other) const {
+        return typeCode() == other.typeCode() && hp == other.hp && max_hp == other.max_hp && attack == other.attack;
+    }
+    virtual void updatePositions(vector<unique_ptr<Unit>>& team) {
+        for (size_t i = 0; i < team.size(); ++i) {
+            team[i]->position = i + 1;
+        }
+    }
+    virtual ~Unit() = default;
+};
+
+
+class GuliayGorod {
+public:
+    string name;
+    int hp, max_hp, cost;
+    GuliayGorod(int pos) {
+        name = "GuliayGorod";
+        hp = max_hp = 80;
+        cost = 25;
+        position = pos;
+    }
+    void boostAllies(vector<unique_ptr<Unit>>& team, const string& teamName, int round, Logger& logger) {
+        if (round != 1) return;
+        for (auto& unit : team) {
+            if (unit->hp > 0 && abs(unit->position - position) == 1) boost(unit.get(), teamName, logger);
+        }
+    }
+    // Boosts one living neighbour; boostAllies and GameManager pick which.
+    void boost(Unit* unit, const string& teamName, Logger& logger) {
+        unit->hp += 10;
+        unit->max_hp += 10;
+        logger.log(teamName + ": GuliayGorod [" + to_string(position) + "] boosts " +
+                   unit->name + " [" + to_string(unit->position) + "] HP and max HP to " + to_string(unit->hp) + ".", "INFO");
+    }
+    int getPosition() const { return position; }
+    void setPosition(int pos) { position = pos; }
+private:
+    int position;
+};
+
+
+class GuliayGorodAdapter : public Unit {
+public:
+    GuliayGorodAdapter(int pos) : guliayGorod(pos) {
+        name = guliayGorod.name;
+        hp = guliayGorod.hp;
+        max_hp = guliayGorod.max_hp;
+        attack = 0;
+        position = pos;
+        cost = guliayGorod.cost;
+    }
+    void attackUnit(Unit*, const string&, const string&, Dice&, Logger&) override {}
+    void specialAbility(vector<unique_ptr<Unit>>& team, const string& teamName, int round, Dice& dice, Logger& logger) override {
+        guliayGorod.boostAllies(team, teamName, round, logger);
+    }
+    unique_ptr<Unit> clone() const override {
+        auto adapter = make_unique<GuliayGorodAdapter>(position);
+        adapter->hp = hp;
+        return adapter;
+    }
+    char typeCode() const override { return 'G'; }
+    void saveExtra(ofstream& out) const override {}
+    void loadExtra(istringstream& iss) override {}
+    GuliayGorod& gorod() { return guliayGorod; }
+private:
+    GuliayGorod guliayGorod;
+};
+
+
+void applyVolley(Unit* target, int damage, int hits);
+
+
+class LightInfantry : public Unit {
+public:
+    vector<string> active_buffs;
+    int total_damage_taken = 0;
+    int armor = 0;
+    LightInfantry(int pos, const vector<string>& buffs = {}) {
+        name = "Light Infantry";
+        hp = max_hp = 50;
+        attack = 8;
+        position = pos;
+        cost = 10;
+        active_buffs = buffs;
+        applyBuffs();
+    }
+    void applyBuffs() {
+        double hp_ratio = max_hp > 0 ? static_cast<double>(hp) / max_hp : 1.0;
+        max_hp = 50;
+        attack = 8;
+        armor = 0;
+        for (const auto& buff : active_buffs) {
+            auto it = BUFFS.find(buff);
+            if (it != BUFFS.end()) {
+                max_hp += it->second.hp_boost;
+                attack += it->second.attack_boost;
+                armor += it->second.armor;
+            }
+        }
+        hp = static_cast<int>(max_hp * hp_ratio);
+        if (hp < 0) hp = 0;
+    }
+    void applyDamage(int damage, Logger& logger) {
+        int reduced_damage = max(0, damage - armor);
+        logger.log(name + " [" + to_string(position) + "] takes " + to_string(reduced_damage) +
+                   " damage (raw: " + to_string(damage) + ", armor: " + to_string(armor) +
+                   "). HP before: " + to_string(hp), "INFO");
+        hp -= reduced_damage;
+        if (reduced_damage > 0) {
+            total_damage_taken += reduced_damage;
+            checkBuffLoss(logger);
+        }
+        if (hp < 0) hp = 0;
+        logger.log(name + " [" + to_string(position) + "] HP after: " + to_string(hp), "INFO");
+    }
+    void checkBuffLoss(Logger& logger) {
+        vector<string> remaining_buffs;
+        for (const auto& buff : active_buffs) {
+            auto it = BUFFS.find(buff);
+            if (it != BUFFS.end() && total_damage_taken <= it->second.damage_threshold) {
+                remaining_buffs.push_back(buff);
+            } else if (it != BUFFS.end()) {
+                logger.log(name + " [" + to_string(position) + "] loses " + it->second.name +
+                           " due to " + to_string(total_damage_taken) + " damage taken.", "INFO");
+                if (it->second.hp_boost > 0) {
+                    max_hp -= it->second.hp_boost;
+                    hp = min(hp, max_hp);
+                }
+            }
+        }
+        active_buffs = remaining_buffs;
+        applyBuffs();
+    }
+    int buffedMaxHp() const {
+        int boosted = 50;
+        for (const auto& buff : active_buffs) {
+            auto it = BUFFS.find(buff);
+            if (it != BUFFS.end()) boosted += it->second.hp_boost;
+        }
+        return boosted;
+    }
+    int nextBuffThreshold() const {
+        int threshold = numeric_limits<int>::max();
+        for (const auto& buff : active_buffs) {
+            auto it = BUFFS.find(buff);
+            if (it != BUFFS.end()) threshold = min(threshold, it->second.damage_threshold);
+        }
+        return threshold;
+    }
+    // Same outcome as calling applyDamage once per hit while hp > 0, minus the logging.
+    // applyBuffs rescales hp through a double ratio that can shave a point off, so hits
+    // are still stepped one by one; only buff loss goes through the full checkBuffLoss.
+    void absorbHits(int damage, int hits) {
+        if (damage - armor <= 0) return;
+        NullLogger silent;
+        int boosted = buffedMaxHp();
+        int threshold = nextBuffThreshold();
+        for (int i = 0; i < hits && hp > 0; i++) {
+            int reduced_damage = damage - armor;
+            if (reduced_damage <= 0) return;
+            hp -= reduced_damage;
+            total_damage_taken += reduced_damage;
+            if (total_damage_taken > threshold) {
+                checkBuffLoss(silent);
+                boosted = buffedMaxHp();
+                threshold = nextBuffThreshold();
+            } else {
+                double hp_ratio = max_hp > 0 ? static_cast<double>(hp) / max_hp : 1.0;
+                max_hp = boosted;
+                hp = static_cast<int>(max_hp * hp_ratio);
+            }
+            if (hp < 0) hp = 0;
+        }
+    }
+    void attackUnit(Unit* target, const string& attackerTeam, const string& targetTeam, Dice& dice, Logger& logger) override {
+        if (!target) return;
+        int attacks = dice.roll(2, position, RollKind::Strikes) + (hasBuff("Ho") ? 4 : 2);
+        if (!logger.enabled()) {
+            applyVolley(target, attack, attacks);
+            return;
+        }
+        for (int i = 0; i < attacks && target->hp > 0; i++) {
+            logger.log(attackerTeam + ": " + name + " [" + to_string(position) + "] attacks " +
+                       targetTeam + ": " + target->name + " [" + to_string(target->position) + "] and deals " + to_string(attack) + " damage.", "INFO");
+            if (auto li = dynamic_cast<LightInfantry*>(target)) {
+                li->applyDamage(attack, logger);
+            } else {
+                target->hp -= attack;
+            }
+        }
+    }
+    bool hasBuff(const string& buff_code) const {
+        return find(active_buffs.begin(), active_buffs.end(), buff_code) != active_buffs.end();
+    }
+    unique_ptr<Unit> clone() const override {
+        auto li = make_unique<LightInfantry>(position, active_buffs);
+        li->hp = hp;
+        li->max_hp = max_hp;
+        li->total_damage_taken = total_damage_taken;
+        li->applyBuffs();
+        return li;
+    }
+    bool sameState(const Unit& other) const override {
+        if (!Unit::sameState(other)) return false;
+        const auto& li = static_cast<const LightInfantry&>(other);
+        return total_damage_taken == li.total_damage_taken && armor == li.armor && active_buffs == li.active_buffs;
+    }
+    char typeCode() const override { return 'L'; }
+    void saveExtra(ofstream& out) const override {
+        out << max_hp << ' ' << total_damage_taken << ' ';
+        for (const auto& buff : active_buffs) out << buff;
+        out << ' ';
+    }
+    void loadExtra(istringstream& iss) override {
+        iss >> max_hp >> total_damage_taken;
+        string buff_str;
+        iss >> buff_str;
+        active_buffs.clear();
+        for (size_t i = 0; i < buff_str.size(); i += 2) {
+            string buff_code = buff_str.substr(i, 2);
+            if (BUFFS.find(buff_code) != BUFFS.end()) {
+                active_buffs.push_back(buff_code);
+            }
+        }
+        applyBuffs();
+    }
+};
+
+
+class HeavyInfantry : public Unit {
+public:
+    HeavyInfantry(int pos) {
+        name = "Heavy Infantry"; hp = max_hp = 100; attack = 20; position = pos; cost = 30;
+    }
+    void attackUnit(Unit* target, const string& attackerTeam, const string& targetTeam, Dice& dice, Logger& logger) override {
+        if (!target) return;
+        logger.log(attackerTeam + ": " + name + " [" + to_string(position) + "] attacks " +
+                   targetTeam + ": " + target->name + " [" + to_string(target->position) + "] and deals " + to_string(attack) + " damage.", "INFO");
+        if (auto li = dynamic_cast<LightInfantry*>(target)) {
+            li->applyDamage(attack, logger);
+        } else {
+            target->hp -= attack;
+        }
+    }
+    unique_ptr<Unit> clone() const override { return make_unique<HeavyInfantry>(position); }
+    char typeCode() const override { return 'I'; }
+};
+
+
+class Archer : public Unit {
+public:
+    Archer(int pos) {
+        name = "Archer"; hp = max_hp = 40; attack = 7; position = pos; cost = 20;
+    }
+    void attackUnit(Unit* target, const string& attackerTeam, const string& targetTeam, Dice& dice, Logger& logger) override {
+        if (!target) return;
+        int attacks = dice.roll(5, position, RollKind::Volley) + 1;
+        if (!logger.enabled()) {
+            applyVolley(target, attack, attacks);
+            return;
+        }
+        for (int i = 0; i < attacks && target->hp > 0; i++) {
+            logger.log(attackerTeam + ": " + name + " [" + to_string(position) + "] attacks " +
+                       targetTeam + ": " + target->name + " [" + to_string(target->position) + "] and deals " + to_string(attack) + " damage.", "INFO");
+            if (auto li = dynamic_cast<LightInfantry*>(target)) {
+                li->applyDamage(attack, logger);
+            } else {
+                target->hp -= attack;
+            }
+        }
+    }
+    unique_ptr<Unit> clone() const override { return make_unique<Archer>(position); }
+    char typeCode() const override { return 'A'; }
+};
+
+
+class Wizard : public Unit {
+public:
+    Wizard(int pos) {
+        name = "Wizard"; hp = max_hp = 30; attack = 5; position = pos; cost = 30;
+    }
+    void attackUnit(Unit* target, const string& attackerTeam, const string& targetTeam, Dice& dice, Logger& logger) override {
+        if (!target) return;
+        logger.log(attackerTeam + ": " + name + " [" + to_string(position) + "] attacks " +
+                   targetTeam + ": " + target->name + " [" + to_string(target->position) + "] and deals " + to_string(attack) + " damage.", "INFO");
+        if (auto li = dynamic_cast<LightInfantry*>(target)) {
+            li->applyDamage(attack, logger);
+        } else {
+            target->hp -= attack;
+        }
+    }
+    void specialAbility(vector<unique_ptr<Unit>>& team, const string& teamName, int round, Dice& dice, Logger& logger) override {
+        if (dice.roll(100, position, RollKind::Clone) < 10) {
+            for (size_t i = 0; i < team.size(); i++) {
+                if (isCloneSource(team[i].get())) {
+                    cloneAt(team, i, teamName, logger);
+                    break;
+                }
+            }
+        }
+    }
+    static bool isCloneSource(const Unit* unit) {
+        return unit->hp > 0 && (dynamic_cast<const LightInfantry*>(unit) || dynamic_cast<const Archer*>(unit));
+    }
+    // Copies team[source], the first clone source of the team, into the slot right behind it.
+    void cloneAt(vector<unique_ptr<Unit>>& team, size_t source, const string& teamName, Logger& logger) {
+        string originalName = team[source]->name;
+        auto cloned = team[source]->clone();
+        cloned->position = source + 2;
+        team.insert(team.begin() + source + 1, std::move(cloned));
+        logger.log(teamName + ": " + name + " [" + to_string(position) + "] clones " + originalName + " at position " + to_string(source + 2) + "!", "INFO");
+        updatePositions(team);
+    }
+    unique_ptr<Unit> clone() const override { return make_unique<Wizard>(position); }
+    char typeCode() const override { return 'W'; }
+};
+
+
+class Healer : public Unit {
+public:
+    int healing_charges = 5;
+    Healer(int pos) {
+        name = "Healer"; hp = max_hp = 50; attack = 8; position = pos; cost = 15;
+    }
+    void attackUnit(Unit*, const string&, const string&, Dice&, Logger&) override {}
+    void specialAbility(vector<unique_ptr<Unit>>& team, const string& teamName, int round, Dice& dice, Logger& logger) override {
+        if (healing_charges > 0) {
+            for (auto& unit : team) {
+                if (isWounded(unit.get())) {
+                    heal(unit.get(), teamName, logger);
+                    break;
+                }
+            }
+        }
+    }
+    // Spends one charge on target, which the caller has picked as the first wounded unit of the team.
+    void heal(Unit* target, const string& teamName, Logger& logger) {
+        target->hp += 5;
+        healing_charges--;
+        logger.log(teamName + ": " + name + " [" + to_string(position) + "] heals " +
+                   target->name + " [" + to_string(target->position) + "] for 5 HP. Charges left: " + to_string(healing_charges) + ".", "INFO");
+    }
+    static bool isHealable(const Unit* unit) {
+        return dynamic_cast<const Wizard*>(unit) == nullptr &&
+               dynamic_cast<const GuliayGorodAdapter*>(unit) == nullptr;
+    }
+    static bool isWounded(const Unit* unit) {
+        return unit->hp > 0 && unit->hp < 30 && isHealable(unit);
+    }
+    void saveExtra(ofstream& out) const override {
+        out << max_hp << ' ' << healing_charges << ' ';
+    }
+    void loadExtra(istringstream& iss) override {
+        iss >> max_hp >> healing_charges;
+    }
+    unique_ptr<Unit> clone() const override {
+        auto healer = make_unique<Healer>(position);
+        healer->healing_charges = healing_charges;
+        return healer;
+    }
+    bool sameState(const Unit& other) const override {
+        return Unit::sameState(other) && healing_charges == static_cast<const Healer&>(other).healing_charges;
+    }
+    char typeCode() const override { return 'H'; }
+};
+
+
+class UnitFactory {
+public:
+    virtual unique_ptr<Unit> createUnit(const string& type, int pos, Logger& logger) = 0;
+    virtual void createTeam(vector<unique_ptr<Unit>>& team, const string& teamName, int balance, Logger& logger) = 0;
+    virtual ~UnitFactory() = default;
+};
+
+
+// MutualKill only happens in simultaneous rounds, where both teams can die at once.
+enum class DrawReason { None, Stalemate, Cycle, RoundCap, MutualKill };
+
+string drawReasonName(DrawReason reason);
+
+
+struct BattleResult {
+    int winner = 0;
+    int rounds = 0;
+    DrawReason drawReason = DrawReason::None;
+};
+
+
+struct SimulationOptions {
+    bool fastForward = true;
+    int roundCap = 100000;
+    // Both teams act on the round's opening state instead of team 1 first; other rules, other results.
+    bool simultaneous = false;
+};
+
+
+struct StallState {
+    uint64_t lastHash = 0;
+    bool hashed = false;
+};
+
+
+// Unit type order used by per-type statistics: LI, HI, A, W, H, Gu, keyed by Unit::typeCode().
+inline const string UNIT_CODES = "LIAWHG";
+inline const int UNIT_TYPES = 6;
+inline int unitTypeIndex(char code) { return static_cast<int>(UNIT_CODES.find(code)); }
+
+// Hit points taken off the enemy by each side's units, per attacker type. Overkill does not count.
+struct DamageTally {
+    long long dealt[2][UNIT_TYPES] = {};
+
+    void add(int side, char attacker, long long damage) {
+        if (damage > 0) dealt[side][unitTypeIndex(attacker)] += damage;
+    }
+};
+
+
+class ThreadPool;
+
+
+// The units a Healer may pick, in team order. During a team's own phase hit points only go up, so
+// a unit that stops being wounded never becomes wounded again and the first entry still wounded is
+// the Healer's choice: picking walks a cursor forward instead of rescanning the team for every Healer.
+class WoundedIndex {
+public:
+    void rebuild(const vector<unique_ptr<Unit>>& team) {
+        units_.clear();
+        next_ = 0;
+        for (const auto& unit : team) {
+            if (Healer::isWounded(unit.get())) units_.push_back(unit.get());
+        }
+    }
+    Unit* first() {
+        while (next_ < units_.size() && !Healer::isWounded(units_[next_])) next_++;
+        return next_ < units_.size() ? units_[next_] : nullptr;
+    }
+private:
+    vector<Unit*> units_;
+    size_t next_ = 0;
+};
+
+
+// Round rules shared by every Battle; all game state lives in the caller, the members are only
+// lookup indexes rebuilt for every phase.
+class GameManager {
+public:
+
+    void displayTeam(const vector<unique_ptr<Unit>>& team, const string& teamName, Logger& logger) {
+        logger.log(teamName + ":", "INFO");
+        if (team.empty()) {
+            logger.log("No units remaining.", "INFO");
+            return;
+        }
+        for (const auto& unit : team) {
+            string unit_info = "[" + to_string(unit->position) + "] " + unit->name + " - " +
+                               to_string(unit->hp) + "/" + to_string(unit->max_hp) + " HP";
+            if (auto li = dynamic_cast<LightInfantry*>(unit.get())) {
+                if (!li->active_buffs.empty()) {
+                    unit_info += " (Buffs: ";
+                    for (size_t i = 0; i < li->active_buffs.size(); ++i) {
+                        auto it = BUFFS.find(li->active_buffs[i]);
+                        unit_info += (it != BUFFS.end() ? it->second.name : li->active_buffs[i]);
+                        if (i < li->active_buffs.size() - 1) unit_info += ", ";
+                    }
+                    unit_info += ")";
+                }
+            }
+            logger.log(unit_info, "INFO");
+        }
+    }
+
+    bool isTeamAlive(const vector<unique_ptr<Unit>>& team) {
+        return !team.empty();
+    }
+
+    // Drops the dead and renumbers the rest in one pass over the team. Most rounds kill few units, so
+    // the stretch before the first death is only read: positions already right are not written back.
+    void cleanAndShift(vector<unique_ptr<Unit>>& team) {
+        size_t size = team.size(), i = 0;
+        for (; i < size && team[i]->hp > 0; i++) {
+            if (team[i]->position != static_cast<int>(i) + 1) team[i]->position = i + 1;
+        }
+        size_t kept = i;
+        for (; i < size; i++) {
+            if (team[i]->hp <= 0) continue;
+            team[i]->position = kept + 1;
+            team[kept++] = std::move(team[i]);
+        }
+        team.resize(kept);
+    }
+
+    void createTeam(vector<unique_ptr<Unit>>& team, const string& teamName, int balance, UnitFactory& factory, Logger& logger) {
+        factory.createTeam(team, teamName, balance, logger);
+        displayTeam(team, teamName, logger);
+    }
+
+    // Damage the unit deals per round from position 1; Healer and GuliayGorod have empty attackUnit.
+    int frontDamage(const Unit* unit) const {
+        if (dynamic_cast<const Healer*>(unit) || dynamic_cast<const GuliayGorodAdapter*>(unit)) return 0;
+        return unit->attack;
+    }
+
+    // Only LightInfantry and Archer roll dice that change the state (attack counts, Wizard clone targets).
+    bool isDeterministic(const vector<unique_ptr<Unit>>& team) const {
+        for (const auto& unit : team) {
+            if (dynamic_cast<const LightInfantry*>(unit.get()) || dynamic_cast<const Archer*>(unit.get())) return false;
+        }
+        return true;
+    }
+
+    bool hasArcher(const vector<unique_ptr<Unit>>& team) const {
+        for (const auto& unit : team) {
+            if (dynamic_cast<const Archer*>(unit.get())) return true;
+        }
+        return false;
+    }
+
+    // A Wizard only ever changes its team when there is a LightInfantry or Archer to copy.
+    bool canClone(const vector<unique_ptr<Unit>>& team) const {
+        bool wizard = false, target = false;
+        for (const auto& unit : team) {
+            if (dynamic_cast<const Wizard*>(unit.get())) wizard = true;
+            if (dynamic_cast<const LightInfantry*>(unit.get()) || dynamic_cast<const Archer*>(unit.get())) target = true;
+        }
+        return wizard && target;
+    }
+
+    uint64_t stateHash(const vector<unique_ptr<Unit>>& t1, const vector<unique_ptr<Unit>>& t2) const {
+        uint64_t hash = 1469598103934665603ULL;
+        auto mix = [&hash](uint64_t value) { hash = (hash ^ value) * 1099511628211ULL; };
+        for (const auto* team : {&t1, &t2}) {
+            for (const auto& unit : *team) {
+                mix(unit->typeCode());
+                mix(static_cast<uint32_t>(unit->hp));
+                mix(static_cast<uint32_t>(unit->max_hp));
+                if (auto li = dynamic_cast<const LightInfantry*>(unit.get())) {
+                    mix(static_cast<uint32_t>(li->total_damage_taken));
+                    for (const auto& buff : li->active_buffs) mix(buff[0] << 8 | buff[1]);
+                } else if (auto healer = dynamic_cast<const Healer*>(unit.get())) {
+                    mix(static_cast<uint32_t>(healer->healing_charges));
+                }
+            }
+            mix(0xff);
+        }
+        return hash;
+    }
+
+    // Called before every round. Without Archers nobody but the two front units can deal damage, so two
+    // harmless fronts never end the battle. Hit points only go down apart from limited heals and the
+    // round-1 boost, so a round that leaves the state untouched repeats forever unless a Wizard can
+    // still clone something.
+    DrawReason checkDraw(const vector<unique_ptr<Unit>>& t1, const vector<unique_ptr<Unit>>& t2,
+                         int roundsPlayed, const SimulationOptions& options, StallState& stall) {
+        if (options.roundCap > 0 && roundsPlayed >= options.roundCap) return DrawReason::RoundCap;
+        if (!hasArcher(t1) && !hasArcher(t2) &&
+            frontDamage(t1.front().get()) == 0 && frontDamage(t2.front().get()) == 0) {
+            return DrawReason::Stalemate;
+        }
+        uint64_t hash = stateHash(t1, t2);
+        bool unchanged = stall.hashed && hash == stall.lastHash;
+        stall.lastHash = hash;
+        stall.hashed = true;
+        if (unchanged && !canClone(t1) && !canClone(t2)) return DrawReason::Cycle;
+        return DrawReason::None;
+    }
+
+    // How many rounds the front unit of team can absorb from attacker before something other than
+    // a plain hp drop happens: its death or a Healer stepping in.
+    long long quietRoundsFor(const vector<unique_ptr<Unit>>& team, const Unit* attacker) const {
+        bool canHeal = false;
+        for (const auto& unit : team) {
+            auto healer = dynamic_cast<const Healer*>(unit.get());
+            if (healer && healer->healing_charges > 0) canHeal = true;
+        }
+        if (canHeal) {
+            for (const auto& unit : team) {
+                if (Healer::isWounded(unit.get())) return 0;
+            }
+        }
+        const Unit* front = team.front().get();
+        int damage = frontDamage(attacker);
+        if (damage <= 0) return numeric_limits<long long>::max();
+        int floor = canHeal && Healer::isHealable(front) ? 30 : 1;
+        return front->hp < floor ? 0 : (front->hp - floor) / damage;
+    }
+
+    // Once neither team can roll anything that matters, every round is front unit against front unit
+    // until a death or a heal. Skips straight to that round and returns how many rounds were skipped.
+    int fastForward(vector<unique_ptr<Unit>>& t1, vector<unique_ptr<Unit>>& t2, int round,
+                    int maxSkip = numeric_limits<int>::max(), DamageTally* tally = nullptr) {
+        if (round == 1 || !isDeterministic(t1) || !isDeterministic(t2)) return 0;
+        long long skip = min(quietRoundsFor(t1, t2.front().get()), quietRoundsFor(t2, t1.front().get()));
+        if (skip <= 0 || skip == numeric_limits<long long>::max()) return 0;
+        skip = min<long long>({skip, maxSkip, numeric_limits<int>::max() - round});
+        t1.front()->hp -= static_cast<int>(skip) * frontDamage(t2.front().get());
+        t2.front()->hp -= static_cast<int>(skip) * frontDamage(t1.front().get());
+        if (tally) {
+            tally->add(0, t1.front()->typeCode(), skip * frontDamage(t1.front().get()));
+            tally->add(1, t2.front()->typeCode(), skip * frontDamage(t2.front().get()));
+        }
+        return static_cast<int>(skip);
+    }
+
+    void simulateRound(vector<unique_ptr<Unit>>& t1, vector<unique_ptr<Unit>>& t2,
+                       const string& n1, const string& n2, int round, Dice& dice, Logger& logger,
+                       DamageTally* tally = nullptr) {
+        logger.log("\nRound " + to_string(round) + ":", "INFO");
+        dice.beginPhase(round, 1);
+        playPhase(t1, t2, n1, n2, round, 0, dice, logger, tally);
+        dice.beginPhase(round, 2);
+        playPhase(t2, t1, n2, n1, round, 1, dice, logger, tally);
+    }
+
+    // simulateRound without a first mover: see lgame_core.cpp. Same dice, different rules.
+    void simulateSimultaneousRound(vector<unique_ptr<Unit>>& t1, vector<unique_ptr<Unit>>& t2,
+                                   const string& n1, const string& n2, int round, Dice& dice, Logger& logger,
+                                   DamageTally* tally = nullptr);
+
+    // Lets unlogged phases of huge battles split their Archer volleys across pool (nullptr: never)
+    // and the two phases of a simultaneous round run side by side. Results are the same with or
+    // without it. The pool must not be the one running the battle.
+    void parallelize(ThreadPool* pool) { pool_ = pool; }
+
+private:
+    // Indexes of the units that act in a phase, grouped by what they do, in team order.
+    struct Roster {
+        vector<int> healers, wizards, gorods, strikers, archers, abilities;
+        bool cloneTarget = false;
+    };
+
+    void strike(Unit* u, Unit* target, const string& from, const string& to, int side, Dice& dice, Logger& logger,
+                DamageTally* tally) {
+        if (!tally) {
+            u->attackUnit(target, from, to, dice, logger);
+            return;
+        }
+        int before = target->hp;
+        u->attackUnit(target, from, to, dice, logger);
+        tally->add(side, u->typeCode(), before - max(target->hp, 0));
+    }
+
+    static bool standsInLine(const vector<unique_ptr<Unit>>& team) {
+        for (size_t i = 0; i < team.size(); i++) {
+            if (team[i]->position != static_cast<int>(i) + 1) return false;
+        }
+        return true;
+    }
+
+    // Nobody leaves or joins the enemy during a phase, so whether it stands in line holds throughout.
+    bool enemyInLine(const vector<unique_ptr<Unit>>& enemy) {
+        if (!enemyLineReady_) {
+            enemyInLine_ = standsInLine(enemy);
+            enemyLineReady_ = true;
+        }
+        return enemyInLine_;
+    }
+
+    void attackFrom(Unit* u, vector<unique_ptr<Unit>>& enemy, const string& from, const string& to, int side,
+                    Dice& dice, Logger& logger, DamageTally* tally) {
+        bool archer = dynamic_cast<Archer*>(u) != nullptr;
+        if (!archer && u->position != 1) return;
+        if (enemyInLine(enemy)) {
+            // Position p stands at index p - 1, so the targets are a window of indexes, not a scan.
+            int first = archer ? max(0, u->position - 4) : 0;
+            int last = archer ? min(static_cast<int>(enemy.size()) - 1, u->position + 2) : 0;
+            for (int k = first; k <= last; k++) {
+                if (enemy[k]->hp > 0) {
+                    strike(u, enemy[k].get(), from, to, side, dice, logger, tally);
+                    break;
+                }
+            }
+            return;
+        }
+        for (auto& tgt : enemy) {
+            if (tgt->hp > 0 && (archer ? abs(u->position - tgt->position) <= 3 : tgt->position == 1)) {
+                strike(u, tgt.get(), from, to, side, dice, logger, tally);
+                break;
+            }
+        }
+    }
+
+    // The Archers' part of the attack pass split into chunks run on pool_; see lgame_core.cpp.
+    void playVolleys(const vector<unique_ptr<Unit>>& own, const vector<int>& archers, vector<unique_ptr<Unit>>& enemy,
+                     const string& ownName, const string& enemyName, int side, Dice& dice, Logger& logger,
+                     DamageTally* tally);
+
+    // Healer::specialAbility with the target taken from the wounded index, built on first use in a phase.
+    void heal(Healer* healer, const vector<unique_ptr<Unit>>& own, const string& ownName, Logger& logger) {
+        if (healer->healing_charges <= 0) return;
+        if (!woundedReady_) {
+            wounded_.rebuild(own);
+            woundedReady_ = true;
+        }
+        if (Unit* target = wounded_.first()) healer->heal(target, ownName, logger);
+    }
+
+    // Wizard::specialAbility with the source found once per phase. While a team acts nothing in it dies
+    // and clones land behind the source, so the first living LightInfantry or Archer keeps its index.
+    void castClone(Wizard* wizard, vector<unique_ptr<Unit>>& own, const string& ownName, Dice& dice, Logger& logger) {
+        if (dice.roll(100, wizard->position, RollKind::Clone) >= 10) return;
+        if (!sourceReady_) {
+            cloneSource_ = -1;
+            for (size_t i = 0; i < own.size() && cloneSource_ < 0; i++) {
+                if (Wizard::isCloneSource(own[i].get())) cloneSource_ = static_cast<int>(i);
+            }
+            sourceReady_ = true;
+        }
+        if (cloneSource_ < 0) return;
+        wizard->cloneAt(own, cloneSource_, ownName, logger);
+        // The clone may be wounded and sits mid-team; updatePositions has put every unit back in line.
+        woundedReady_ = false;
+        lineReady_ = inLine_ = true;
+    }
+
+    // GuliayGorod::boostAllies without the scan: when every unit stands at index + 1, the neighbours
+    // of position p are at indexes p - 2 and p. Teams built with other positions keep the scan.
+    void boost(GuliayGorodAdapter* adapter, vector<unique_ptr<Unit>>& own, const string& ownName, int round,
+               Logger& logger) {
+        if (round != 1) return;
+        if (!lineReady_) {
+            inLine_ = true;
+            for (size_t i = 0; i < own.size() && inLine_; i++) inLine_ = own[i]->position == static_cast<int>(i) + 1;
+            lineReady_ = true;
+        }
+        GuliayGorod& gorod = adapter->gorod();
+        if (!inLine_) {
+            gorod.boostAllies(own, ownName, round, logger);
+            return;
+        }
+        for (int index : {gorod.getPosition() - 2, gorod.getPosition()}) {
+            if (index >= 0 && index < static_cast<int>(own.size()) && own[index]->hp > 0) {
+                gorod.boost(own[index].get(), ownName, logger);
+            }
+        }
+    }
+
+    void playPhase(vector<unique_ptr<Unit>>& own, vector<unique_ptr<Unit>>& enemy, const string& ownName,
+                   const string& enemyName, int round, int side, Dice& dice, Logger& logger, DamageTally* tally) {
+        // The enemy's attacks since the last phase changed who is wounded and who can be cloned.
+        woundedReady_ = sourceReady_ = lineReady_ = enemyLineReady_ = false;
+        // A logged phase keeps the unit-by-unit narration.
+        if (!logger.enabled() && !enemy.empty() && playBatchedPhase(own, enemy, ownName, enemyName, round, side, dice, logger, tally)) {
+            return;
+        }
+        // Indexed on purpose: a Wizard clone inserts into own while it is being walked.
+        for (size_t i = 0; i < own.size(); i++) {
+            Unit* u = own[i].get();
+            if (u->hp <= 0) continue;
+            char type = u->typeCode();
+            if (type == 'H') heal(static_cast<Healer*>(u), own, ownName, logger);
+            else if (type == 'W') castClone(static_cast<Wizard*>(u), own, ownName, dice, logger);
+            else if (type == 'G') boost(static_cast<GuliayGorodAdapter*>(u), own, ownName, round, logger);
+            if (enemy.empty()) break;
+            attackFrom(u, enemy, ownName, enemyName, side, dice, logger, tally);
+        }
+    }
+
+    // The unit-by-unit phase as passes over the units that do something: Healers, then the Wizards'
+    // clone rolls, then round-1 GuliayGorod boosts, then every attack. Abilities only touch their own
+    // team and attacks only the enemy, so the split changes nothing as long as no clone reshuffles
+    // positions; rolls are keyed by position, not draw order (see Dice), so a Wizard can roll
+    // ahead. Returns false without touching anything when a clone would happen.
+    bool playBatchedPhase(vector<unique_ptr<Unit>>& own, vector<unique_ptr<Unit>>& enemy, const string& ownName,
+                          const string& enemyName, int round, int side, Dice& dice, Logger& logger, DamageTally* tally) {
+        Roster& roster = roster_;
+        roster.healers.clear();
+        roster.wizards.clear();
+        roster.gorods.clear();
+        roster.strikers.clear();
+        roster.archers.clear();
+        roster.cloneTarget = false;
+        bool inLine = true;
+        for (size_t i = 0; i < own.size(); i++) {
+            Unit* u = own[i].get();
+            inLine = inLine && u->position == static_cast<int>(i) + 1;
+            if (u->hp <= 0) continue;
+            char type = u->typeCode();
+            if (type == 'H') roster.healers.push_back(i);
+            else if (type == 'W') roster.wizards.push_back(i);
+            else if (type == 'G') roster.gorods.push_back(i);
+            else if (type == 'L' || type == 'A') roster.cloneTarget = true;
+            if (type == 'A') roster.archers.push_back(i);
+            if (type == 'A' || u->position == 1) roster.strikers.push_back(i);
+        }
+        lineReady_ = true;
+        inLine_ = inLine;
+        if (roster.cloneTarget) {
+            for (int i : roster.wizards) {
+                if (dice.roll(100, own[i]->position, RollKind::Clone) < 10) return false;
+            }
+        }
+        if (round == 1 && !roster.healers.empty() && !roster.gorods.empty()) {
+            // A boost can lift a wounded unit out of a Healer's reach, so on round 1 the two keep team order.
+            roster.abilities.clear();
+            merge(roster.healers.begin(), roster.healers.end(), roster.gorods.begin(), roster.gorods.end(),
+                  back_inserter(roster.abilities));
+            for (int i : roster.abilities) {
+                if (own[i]->typeCode() == 'H') heal(static_cast<Healer*>(own[i].get()), own, ownName, logger);
+                else boost(static_cast<GuliayGorodAdapter*>(own[i].get()), own, ownName, round, logger);
+            }
+        } else {
+            for (int i : roster.healers) heal(static_cast<Healer*>(own[i].get()), own, ownName, logger);
+            if (round == 1) {
+                for (int i : roster.gorods) boost(static_cast<GuliayGorodAdapter*>(own[i].get()), own, ownName, round, logger);
+            }
+        }
+        // Workers attack with `logger` too, which is safe only because playPhase calls this for
+        // !logger.enabled() alone; a logging caller would get lines from different threads interleaved.
+        if (pool_ && inLine && enemyInLine(enemy) && roster.archers.size() >= 2 * VOLLEY_CHUNK &&
+            dynamic_cast<StreamDice*>(&dice)) {
+            // In line only the unit at index 0 stands at position 1, so any non-Archer striker goes first.
+            if (roster.strikers.front() != roster.archers.front()) {
+                attackFrom(own[roster.strikers.front()].get(), enemy, ownName, enemyName, side, dice, logger, tally);
+            }
+            playVolleys(own, roster.archers, enemy, ownName, enemyName, side, dice, logger, tally);
+            return true;
+        }
+        for (int i : roster.strikers) attackFrom(own[i].get(), enemy, ownName, enemyName, side, dice, logger, tally);
+        return true;
+    }
+
+    Roster roster_;
+    // Fewest Archers worth a task of their own. A volley costs a few tenths of a microsecond, so a
+    // chunk is about a millisecond of work against a few microseconds of dispatch, band copy and
+    // in-order validation; under two chunks there is nothing to run side by side.
+    static constexpr size_t VOLLEY_CHUNK = 4096;
+
+    WoundedIndex wounded_;
+    int cloneSource_ = -1;
+    bool woundedReady_ = false, sourceReady_ = false, lineReady_ = false, inLine_ = false;
+    bool enemyLineReady_ = false, enemyInLine_ = false;
+    ThreadPool* pool_ = nullptr;
+    // Simultaneous rounds: each team's copy as the enemy strikes it, and every unit's state before
+    // its own side acted, kept between rounds so only new slots allocate.
+    struct Opening {
+        Unit* unit;
+        int hp, max_hp;
+    };
+    vector<unique_ptr<Unit>> targets_[2];
+    vector<Opening> opening_[2];
+    // Plays team 2's phase of a simultaneous round on a worker, with indexes of its own.
+    unique_ptr<GameManager> partner_;
+};
+
+
+// One self-contained game: both teams, their names, the round counter, its own dice and log sink.
+// Battles share nothing mutable, so any number of them can run on different threads at once.
+class Battle {
+public:
+    Battle(vector<unique_ptr<Unit>> team1, vector<unique_ptr<Unit>> team2, const string& name1, const string& name2,
+           unique_ptr<Dice> dice, Logger& logger, const SimulationOptions& options = SimulationOptions(), int round = 1)
+        : team1_(std::move(team1)), team2_(std::move(team2)), name1_(name1), name2_(name2),
+          dice_(std::move(dice)), logger_(logger), options_(options), round_(round), firstRound_(round) {}
+
+    // Plays one round unless the battle is already decided; returns whether a round was played.
+    bool step() {
+        if (over_ || finished()) return false;
+        if (options_.fastForward && !logger_.enabled()) {
+            int maxSkip = options_.roundCap > 0 ? options_.roundCap - roundsPlayed() : numeric_limits<int>::max();
+            round_ += rules_.fastForward(team1_, team2_, round_, maxSkip, tally());
+        }
+        size_t size1 = team1_.size(), size2 = team2_.size();
+        if (options_.simultaneous) {
+            rules_.simulateSimultaneousRound(team1_, team2_, name1_, name2_, round_++, *dice_, logger_, tally());
+        } else {
+            rules_.simulateRound(team1_, team2_, name1_, name2_, round_++, *dice_, logger_, tally());
+        }
+        // Nothing leaves a team before cleanAndShift, so any growth is Wizard clones.
+        clones_[0] += static_cast<int>(team1_.size() - size1);
+        clones_[1] += static_cast<int>(team2_.size() - size2);
+        rules_.cleanAndShift(team1_);
+        rules_.cleanAndShift(team2_);
+        return true;
+    }
+
+    BattleResult run() {
+        while (step()) {}
+        return result_;
+    }
+
+    bool isOver() const { return over_; }
+    const BattleResult& result() const { return result_; }
+    int round() const { return round_; }
+    int roundsPlayed() const { return round_ - firstRound_; }
+    const SimulationOptions& options() const { return options_; }
+    const string& name1() const { return name1_; }
+    const string& name2() const { return name2_; }
+    vector<unique_ptr<Unit>>& team1() { return team1_; }
+    vector<unique_ptr<Unit>>& team2() { return team2_; }
+    const vector<unique_ptr<Unit>>& team1() const { return team1_; }
+    const vector<unique_ptr<Unit>>& team2() const { return team2_; }
+
+    // Off by default: the per-attack bookkeeping costs a little in every round.
+    void trackDamage() { trackDamage_ = true; }
+    // See GameManager::parallelize. Slower on one core; no multi-core gain has been measured yet.
+    void parallelize(ThreadPool* pool) { rules_.parallelize(pool); }
+    const DamageTally& damage() const { return damage_; }
+    // Wizard clones made so far by side 0 (team 1) or 1 (team 2).
+    int clones(int side) const { return clones_[side]; }
+
+    // Everything besides the teams that a step changes, so BattleHistory can move a battle back and forth.
+    struct Counters {
+        int round;
+        StallState stall;
+        BattleResult result;
+        bool over;
+        DamageTally damage;
+        int clones[2];
+    };
+    Counters counters() const { return {round_, stall_, result_, over_, damage_, {clones_[0], clones_[1]}}; }
+    void restore(const Counters& counters) {
+        round_ = counters.round;
+        stall_ = counters.stall;
+        result_ = counters.result;
+        over_ = counters.over;
+        damage_ = counters.damage;
+        clones_[0] = counters.clones[0];
+        clones_[1] = counters.clones[1];
+    }
+
+private:
+    DamageTally* tally() { return trackDamage_ ? &damage_ : nullptr; }
+
+    bool finished() {
+        bool alive1 = rules_.isTeamAlive(team1_), alive2 = rules_.isTeamAlive(team2_);
+        if (alive1 && alive2) {
+            DrawReason reason = rules_.checkDraw(team1_, team2_, roundsPlayed(), options_, stall_);
+            if (reason == DrawReason::None) return false;
+            result_ = {0, roundsPlayed(), reason};
+        } else if (!alive1 && !alive2) {
+            // Neither seat may win this, or the seat bias the simultaneous rules remove would return.
+            result_ = {0, roundsPlayed(), DrawReason::MutualKill};
+        } else {
+            result_ = {alive1 ? 1 : 2, roundsPlayed()};
+        }
+        over_ = true;
+        return true;
+    }
+
+    GameManager rules_;
+    vector<unique_ptr<Unit>> team1_, team2_;
+    string name1_, name2_;
+    unique_ptr<Dice> dice_;
+    Logger& logger_;
+    SimulationOptions options_;
+    int round_, firstRound_;
+    StallState stall_;
+    BattleResult result_;
+    bool over_ = false;
+    bool trackDamage_ = false;
+    DamageTally damage_;
+    int clones_[2] = {};
+};
+
+
+// Creates a unit from a factory code ("LI"/"L", "HI"/"I", "A", "W", "H", "Gu"/"G"); nullptr if unknown.
+unique_ptr<Unit> makeUnit(const string& type, int pos, const vector<string>& buffs = {});
+unique_ptr<Unit> cloneUnit(const Unit& unit);
+vector<unique_ptr<Unit>> cloneTeam(const vector<unique_ptr<Unit>>& team);
+
+
+// Frozen copy of a unit. History entries and team shadows hold the same copy for as long as the
+// unit does not change, so an unchanged unit is stored once however many rounds are remembered.
+using UnitState = shared_ptr<const Unit>;
+
+// Rough upper bound on the memory behind one UnitState, used for history budgets.
+inline const size_t UNIT_STATE_BYTES = sizeof(LightInfantry) + 64;
+
+// How a team got from one step to the next: units removed (by index before the step), units
+// inserted (by index after it) and units changed in place (by index after it), all ascending.
+struct TeamDelta {
+    struct Change {
+        int index;
+        UnitState before, after;
+    };
+    vector<pair<int, UnitState>> removed, inserted;
+    vector<Change> changed;
+
+    bool empty() const { return removed.empty() && inserted.empty() && changed.empty(); }
+    size_t bytes() const {
+        return sizeof(TeamDelta) + (removed.size() + inserted.size()) * (sizeof(pair<int, UnitState>) + UNIT_STATE_BYTES) +
+               changed.size() * (sizeof(Change) + 2 * UNIT_STATE_BYTES);
+    }
+};
+
+// Keeps a shadow of frozen states in step with a live team. record() diffs the team against the
+// shadow (units are matched by identity, so deaths and clones do not make the rest look changed);
+// undo()/redo() apply a delta to the live team, cloning only the units the delta touches.
+class TeamTracker {
+public:
+    explicit TeamTracker(const vector<unique_ptr<Unit>>& team);
+
+    TeamDelta record(const vector<unique_ptr<Unit>>& team);
+    void undo(vector<unique_ptr<Unit>>& team, const TeamDelta& delta);
+    void redo(vector<unique_ptr<Unit>>& team, const TeamDelta& delta);
+
+private:
+    struct Entry {
+        const Unit* origin;
+        UnitState state;
+    };
+    vector<Entry> shadow_;
+};
+
+// Undo/redo over the steps of a battle, bounded by a memory budget: once the recorded deltas
+// exceed it the oldest steps are forgotten. The teams must only change through step/undo/redo
+// while the history is in use.
+class BattleHistory {
+public:
+    BattleHistory(Battle& battle, size_t budgetBytes)
+        : battle_(battle), budget_(budgetBytes), tracker1_(battle.team1()), tracker2_(battle.team2()) {}
+
+    // Plays a step and records it; anything undone before is dropped, as in CommandManager.
+    bool step();
+    bool undo();
+    bool redo();
+
+    bool canUndo() const { return !done_.empty(); }
+    bool canRedo() const { return !undone_.empty(); }
+    size_t bytes() const { return bytes_; }
+    size_t depth() const { return done_.size(); }
+
+private:
+    struct Entry {
+        TeamDelta team1, team2;
+        Battle::Counters before, after;
+        size_t bytes() const { return sizeof(Entry) + team1.bytes() + team2.bytes(); }
+    };
+
+    Battle& battle_;
+    size_t budget_;
+    TeamTracker tracker1_, tracker2_;
+    deque<Entry> done_, undone_;
+    size_t bytes_ = 0;
+};
+
+
+// Replay file: a header with the seed, first round, keyframe interval and team names; then one
+// record per frame (the state after each step) holding the TeamDeltas of both sides, and every
+// keyframeInterval frames plus the last a keyframe with both teams in full; then an index of
+// {delta offset, keyframe offset, round} per frame, and a trailer with the result, frame count,
+// index offset and the magic again.
+inline const char REPLAY_MAGIC[8] = {'L', 'G', 'R', 'P', 'L', 'Y', '0', '1'};
+
+// Steps a battle and appends every step to a replay. Battles recorded with fast-forward on store
+// one frame per step, which may cover several rounds; the index keeps the real round of each frame.
+class ReplayRecorder {
+public:
+    ReplayRecorder(const string& filename, Battle& battle, uint64_t seed, Logger& logger, int keyframeInterval = 256);
+    ~ReplayRecorder() { close(); }
+    bool isOpen() const { return out_.is_open(); }
+
+    bool step();
+    // Writes the final keyframe, the index and the trailer; the file is unreadable until this has run.
+    void close();
+
+private:
+    void writeKeyframe();
+
+    Battle& battle_;
+    ofstream out_;
+    TeamTracker tracker1_, tracker2_;
+    int keyframeInterval_;
+    // Per frame: delta offset, keyframe offset (0 where absent) and round.
+    vector<array<int64_t, 3>> index_;
+    uint64_t offset_ = 0;
+};
+
+// Moves through a recorded battle without re-simulating it: seek() starts from the current frame or
+// the nearest keyframe before or after the target, whichever is closest, and replays deltas from there.
+class ReplayPlayer {
+public:
+    ReplayPlayer(const string& filename, Logger& logger);
+    ~ReplayPlayer();
+    bool isOpen() const { return base_ != nullptr; }
+
+    uint64_t seed() const { return seed_; }
+    const string& name1() const { return name1_; }
+    const string& name2() const { return name2_; }
+    const BattleResult& result() const { return result_; }
+    int frames() const { return static_cast<int>(index_.size()); }
+    int keyframes() const { return static_cast<int>(keyframes_.size()); }
+    int frame() const { return frame_; }
+    // Round about to be played in the current frame.
+    int round() const { return static_cast<int>(index_[frame_][2]); }
+    // Frames moved through by the last seek, counting a keyframe load as one.
+    int lastSeekCost() const { return lastSeekCost_; }
+
+    bool seek(int frame);
+    // Last frame whose round is at most `round` (the first frame for earlier rounds).
+    bool seekRound(int round);
+    bool stepForward();
+    bool stepBackward();
+
+    const vector<unique_ptr<Unit>>& team1() const { return team1_; }
+    const vector<unique_ptr<Unit>>& team2() const { return team2_; }
+
+private:
+    bool loadKeyframe(int frame);
+    bool readDeltas(int frame, TeamDelta& delta1, TeamDelta& delta2) const;
+
+    char* base_ = nullptr;
+    size_t size_ = 0;
+    uint64_t seed_ = 0;
+    string name1_, name2_;
+    BattleResult result_;
+    vector<array<int64_t, 3>> index_;
+    vector<int> keyframes_;
+    int frame_ = -1, lastSeekCost_ = 0;
+    vector<unique_ptr<Unit>> team1_, team2_;
+    unique_ptr<TeamTracker> tracker1_, tracker2_;
+};
+
+// Price of a unit including its Light Infantry buffs, as charged by the team factories.
+int unitCost(const Unit& unit);
+int teamCost(const vector<unique_ptr<Unit>>& team);
+
+// Team spec: comma-separated units, each a factory code with optional '+'-joined Light Infantry
+// buffs and an optional count, e.g. "LI:Ho+Sp, 2*HI, A, W, H, Gu". Budgets are not checked here.
+bool parseTeamSpec(const string& spec, vector<unique_ptr<Unit>>& team, string& error);
+
+// One line of a matchup file: "[name =] <team spec> vs [name =] <team spec>".
+struct MatchupSpec {
+    string name1, name2;
+    vector<unique_ptr<Unit>> team1, team2;
+};
+bool parseMatchupSpec(const string& line, MatchupSpec& matchup, string& error);
+
+bool saveGame(const string& filename, const string& t1, const string& t2, int round,
+              const vector<unique_ptr<Unit>>& team1, const vector<unique_ptr<Unit>>& team2, Logger& logger);
+bool loadGame(const string& filename, string& t1, string& t2, int& round,
+              vector<unique_ptr<Unit>>& team1, vector<unique_ptr<Unit>>& team2, Logger& logger);
+
+
+// Bump whenever unit stats, buffs or round order change: stored results are keyed by it.
+inline const int RULES_VERSION = 1;
+inline const int ROUND_BUCKETS = 16;
+
+// Bucket 0 holds zero-round battles, bucket b holds [2^(b-1), 2^b), the last one everything longer.
+int roundBucket(int rounds);
+string roundBucketLabel(int bucket);
+
+
+struct BatchStats {
+    int battles = 0, wins1 = 0, wins2 = 0, draws = 0;
+    long long totalRounds = 0;
+    map<DrawReason, int> drawReasons;
+    long long roundHistogram[ROUND_BUCKETS] = {};
+
+    void add(const BattleResult& result) {
+        battles++;
+        totalRounds += result.rounds;
+        roundHistogram[roundBucket(result.rounds)]++;
+        if (result.winner == 1) wins1++;
+        else if (result.winner == 2) wins2++;
+        else {
+            draws++;
+            drawReasons[result.drawReason]++;
+        }
+    }
+
+    void merge(const BatchStats& other) {
+        battles += other.battles;
+        wins1 += other.wins1;
+        wins2 += other.wins2;
+        draws += other.draws;
+        totalRounds += other.totalRounds;
+        for (const auto& [reason, count] : other.drawReasons) drawReasons[reason] += count;
+        for (int b = 0; b < ROUND_BUCKETS; b++) roundHistogram[b] += other.roundHistogram[b];
+    }
+
+    string summary(const string& t1, const string& t2) const {
+        ostringstream out;
+        double total = max(battles, 1);
+        out << fixed << setprecision(1)
+            << t1 << " wins: " << wins1 << " (" << 100.0 * wins1 / total << "%), "
+            << t2 << " wins: " << wins2 << " (" << 100.0 * wins2 / total << "%), "
+            << "draws: " << draws << " (" << 100.0 * draws / total << "%)";
+        if (!drawReasons.empty()) {
+            out << " [";
+            for (auto it = drawReasons.begin(); it != drawReasons.end(); ++it) {
+                if (it != drawReasons.begin()) out << ", ";
+                out << drawReasonName(it->first) << ": " << it->second;
+            }
+            out << "]";
+        }
+        out << ", average rounds: " << totalRounds / total;
+        return out.str();
+    }
+
+    string histogram() const {
+        string out = "Rounds:";
+        for (int b = 0; b < ROUND_BUCKETS; b++) {
+            if (roundHistogram[b] > 0) out += " " + roundBucketLabel(b) + ": " + to_string(roundHistogram[b]);
+        }
+        return out;
+    }
+};
+
+
+// What a batch keeps about every battle: enough to play it again exactly, plus cheap metrics.
+struct BattleSummary {
+    int index = 0;          // battle number in the batch; its dice seed is StreamDice::battleSeed(batch seed, index)
+    uint64_t seed = 0;
+    BattleResult result;
+    int clones = 0;         // Wizard clones made by both sides
+    double upset = 0;       // damage dealt by the loser per point dealt by the winner; 0 for draws
+
+    static BattleSummary of(int index, uint64_t seed, const Battle& battle);
+};
+
+// Fixed-size samples of a batch: the longest battles, the biggest upsets, the most Wizard clones and
+// a uniform random sample. Each worker keeps its own and merge() combines them; ties and the uniform
+// sample (the battles with the smallest hashed seeds) do not depend on which worker saw what, so the
+// picks are the same for any thread count.
+class NotableBattles {
+public:
+    explicit NotableBattles(size_t perKind = 3) : perKind_(perKind) {}
+
+    size_t perKind() const { return perKind_; }
+    void add(const BattleSummary& battle);
+    void merge(const NotableBattles& other);
+    // Each kept battle once, with the kinds it was kept for ("longest", "upset", "clones", "sample").
+    vector<pair<string, BattleSummary>> picks() const;
+
+private:
+    static const int KINDS = 4;
+    // Whether `a` ranks above `b` for a kind; equal metrics go to the earlier battle.
+    static bool better(int kind, const BattleSummary& a, const BattleSummary& b);
+    void keep(int kind, const BattleSummary& battle);
+
+    size_t perKind_;
+    vector<BattleSummary> kept_[KINDS];
+};
+
+
+// Canonical text form of a team's full state: type letter, LI buffs in sorted order, hp and the
+// counters that affect later rounds. Two teams with the same encoding play out identically.
+string encodeTeam(const vector<unique_ptr<Unit>>& team);
+// Only round 1 is special (GuliayGorod boosts), and the round cap decides which long battles are draws.
+string matchupKey(const vector<unique_ptr<Unit>>& team1, const vector<unique_ptr<Unit>>& team2,
+                  int round, const SimulationOptions& options);
+
+
+// Bytes of a matchup key held in its record; the rest of a longer key fills whole slots right after it.
+inline const size_t STORE_KEY_INLINE = 296;
+inline const int STORED_DRAW_REASONS = 4;
+
+
+struct KeyHash {
+    uint64_t low, high;
+    bool operator==(const KeyHash&) const = default;
+};
+
+// 128-bit FNV-1a (offset basis 0x6c62272e07bb014262b821756295c58d, prime 2^88 + 0x13b). Fixed by
+// its definition rather than by the standard library, so every build sharing a store agrees on it.
+KeyHash storeKeyHash(const string& key);
+
+
+// On-disk layout of one matchup; counters are only touched with atomic builtins so several
+// processes can add to the same record through their shared mappings.
+struct StoredMatchup {
+    uint32_t keyLength;
+    uint32_t keySlots;      // slots after this record taken by the key past STORE_KEY_INLINE
+    KeyHash keyHash;
+    char key[STORE_KEY_INLINE];
+    uint64_t wins1, wins2, draws;
+    uint64_t drawsByReason[STORED_DRAW_REASONS];
+    uint64_t totalRounds;
+    uint64_t roundHistogram[ROUND_BUCKETS];
+};
+
+
+static_assert(sizeof(StoredMatchup) == 512, "StoredMatchup is an on-disk record");
+
+
+struct StoreHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t recordSize;
+    uint64_t slotCount;     // records plus the slots holding their long keys
+    char reserved[40];
+};
+
+
+static_assert(sizeof(StoreHeader) == 64, "StoreHeader is an on-disk record");
+
+
+// Append-only file of StoredMatchup records behind a fixed header, each followed by the slots of its key
+// if that is longer than STORE_KEY_INLINE. The whole address window is
+// mapped once, so growing the file never moves a record and pointers handed out stay valid.
+// Appends are serialized by a mutex inside the process and flock across processes; counters are
+// updated lock-free.
+class ResultStore {
+public:
+    ResultStore(const string& filename, Logger& logger) : filename_(filename), logger_(logger) {
+        fd_ = ::open(filename.c_str(), O_RDWR | O_CREAT, 0644);
+        if (fd_ < 0) {
+            logger_.log("Error: Could not open result store " + filename, "ERROR");
+            return;
+        }
+        void* mapped = mmap(nullptr, MAP_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+        if (mapped == MAP_FAILED) {
+            logger_.log("Error: Could not map result store " + filename, "ERROR");
+            ::close(fd_);
+            fd_ = -1;
+            return;
+        }
+        base_ = static_cast<char*>(mapped);
+        flock(fd_, LOCK_EX);
+        bool valid = true;
+        if (fileSize() < sizeof(StoreHeader)) {
+            valid = ftruncate(fd_, sizeof(StoreHeader) + GROW_RECORDS * sizeof(StoredMatchup)) == 0;
+            if (valid) {
+                memcpy(header()->magic, MAGIC, sizeof(header()->magic));
+                header()->version = 3;
+                header()->recordSize = sizeof(StoredMatchup);
+                __atomic_store_n(&header()->slotCount, 0, __ATOMIC_RELEASE);
+            }
+        } else {
+            valid = memcmp(header()->magic, MAGIC, sizeof(header()->magic)) == 0 &&
+                    header()->version == 3 && header()->recordSize == sizeof(StoredMatchup);
+        }
+        flock(fd_, LOCK_UN);
+        if (!valid) {
+            logger_.log("Error: " + filename + " is not a compatible result store", "ERROR");
+            close();
+        }
+    }
+
+    ~ResultStore() { close(); }
+
+    bool isOpen() const { return base_ != nullptr; }
+
+    StoredMatchup* findOrCreate(const string& key) {
+        if (!isOpen()) return nullptr;
+        KeyHash hash = storeKeyHash(key);
+        lock_guard<mutex> lock(mutex_);
+        refreshIndex();
+        if (StoredMatchup* entry = lookup(key, hash)) return entry;
+
+        flock(fd_, LOCK_EX);
+        refreshIndex();
+        if (StoredMatchup* entry = lookup(key, hash)) {
+            flock(fd_, LOCK_UN);
+            return entry;
+        }
+        uint64_t count = header()->slotCount;
+        uint64_t keySlots = key.size() > STORE_KEY_INLINE
+                                ? (key.size() - STORE_KEY_INLINE + sizeof(StoredMatchup) - 1) / sizeof(StoredMatchup)
+                                : 0;
+        size_t needed = sizeof(StoreHeader) + (count + 1 + keySlots) * sizeof(StoredMatchup);
+        if (needed > MAP_BYTES) {
+            flock(fd_, LOCK_UN);
+            logger_.log("Error: Result store " + filename_ + " is full", "ERROR");
+            return nullptr;
+        }
+        if (fileSize() < needed &&
+            ftruncate(fd_, min(MAP_BYTES, needed + GROW_RECORDS * sizeof(StoredMatchup))) != 0) {
+            flock(fd_, LOCK_UN);
+            logger_.log("Error: Could not grow result store " + filename_, "ERROR");
+            return nullptr;
+        }
+        StoredMatchup* entry = record(count);
+        memset(entry, 0, (1 + keySlots) * sizeof(StoredMatchup));
+        entry->keyLength = key.size();
+        entry->keySlots = keySlots;
+        entry->keyHash = hash;
+        size_t inlined = min(key.size(), STORE_KEY_INLINE);
+        memcpy(entry->key, key.data(), inlined);
+        memcpy(keyTail(entry), key.data() + inlined, key.size() - inlined);
+        __atomic_store_n(&header()->slotCount, count + 1 + keySlots, __ATOMIC_RELEASE);
+        flock(fd_, LOCK_UN);
+        index_.emplace(hash.low, count);
+        indexed_ = count + 1 + keySlots;
+        return entry;
+    }
+
+    static void add(StoredMatchup* entry, const BattleResult& result) {
+        if (result.winner == 1) __atomic_fetch_add(&entry->wins1, 1, __ATOMIC_RELAXED);
+        else if (result.winner == 2) __atomic_fetch_add(&entry->wins2, 1, __ATOMIC_RELAXED);
+        else {
+            __atomic_fetch_add(&entry->draws, 1, __ATOMIC_RELAXED);
+            int reason = static_cast<int>(result.drawReason) - 1;
+            if (reason >= 0 && reason < STORED_DRAW_REASONS) __atomic_fetch_add(&entry->drawsByReason[reason], 1, __ATOMIC_RELAXED);
+        }
+        __atomic_fetch_add(&entry->totalRounds, static_cast<uint64_t>(result.rounds), __ATOMIC_RELAXED);
+        __atomic_fetch_add(&entry->roundHistogram[roundBucket(result.rounds)], 1, __ATOMIC_RELAXED);
+    }
+
+    // Calls visit(key, entry) for every stored matchup, oldest first.
+    void forEach(const function<void(const string&, const StoredMatchup&)>& visit) {
+        if (!isOpen()) return;
+        lock_guard<mutex> lock(mutex_);
+        uint64_t count = __atomic_load_n(&header()->slotCount, __ATOMIC_ACQUIRE);
+        for (uint64_t i = 0; i < count; i += 1 + record(i)->keySlots) {
+            StoredMatchup* entry = record(i);
+            if (entry->keyLength > STORE_KEY_INLINE + entry->keySlots * sizeof(StoredMatchup) ||
+                i + entry->keySlots >= count) {
+                continue;
+            }
+            size_t inlined = min<size_t>(entry->keyLength, STORE_KEY_INLINE);
+            string key(entry->key, inlined);
+            key.append(keyTail(entry), entry->keyLength - inlined);
+            visit(key, *entry);
+        }
+    }
+
+    static BatchStats stats(const StoredMatchup& entry) {
+        BatchStats stats;
+        stats.wins1 = __atomic_load_n(&entry.wins1, __ATOMIC_RELAXED);
+        stats.wins2 = __atomic_load_n(&entry.wins2, __ATOMIC_RELAXED);
+        stats.draws = __atomic_load_n(&entry.draws, __ATOMIC_RELAXED);
+        stats.battles = stats.wins1 + stats.wins2 + stats.draws;
+        for (int reason = 0; reason < STORED_DRAW_REASONS; reason++) {
+            int count = __atomic_load_n(&entry.drawsByReason[reason], __ATOMIC_RELAXED);
+            if (count > 0) stats.drawReasons[static_cast<DrawReason>(reason + 1)] = count;
+        }
+        stats.totalRounds = __atomic_load_n(&entry.totalRounds, __ATOMIC_RELAXED);
+        for (int b = 0; b < ROUND_BUCKETS; b++) {
+            stats.roundHistogram[b] = __atomic_load_n(&entry.roundHistogram[b], __ATOMIC_RELAXED);
+        }
+        return stats;
+    }
+
+private:
+    static constexpr size_t MAP_BYTES = size_t(1) << 30;
+    static constexpr size_t GROW_RECORDS = 1024;
+    static constexpr char MAGIC[8] = {'L', 'G', 'S', 'T', 'O', 'R', 'E', '1'};
+
+    StoreHeader* header() const { return reinterpret_cast<StoreHeader*>(base_); }
+    StoredMatchup* record(uint64_t i) const {
+        return reinterpret_cast<StoredMatchup*>(base_ + sizeof(StoreHeader)) + i;
+    }
+
+    size_t fileSize() const {
+        struct stat st;
+        return fstat(fd_, &st) == 0 ? static_cast<size_t>(st.st_size) : 0;
+    }
+
+    // Where a key continues past STORE_KEY_INLINE: the slots right after its record.
+    static char* keyTail(StoredMatchup* entry) { return reinterpret_cast<char*>(entry + 1); }
+
+    // The hash only narrows the search; the full key decides, so a collision cannot merge two matchups.
+    StoredMatchup* lookup(const string& key, const KeyHash& hash) const {
+        auto [first, last] = index_.equal_range(hash.low);
+        for (auto it = first; it != last; ++it) {
+            StoredMatchup* entry = record(it->second);
+            size_t inlined = min(key.size(), STORE_KEY_INLINE);
+            if (entry->keyHash == hash && entry->keyLength == key.size() &&
+                memcmp(entry->key, key.data(), inlined) == 0 &&
+                memcmp(keyTail(entry), key.data() + inlined, key.size() - inlined) == 0) {
+                return entry;
+            }
+        }
+        return nullptr;
+    }
+
+    // Picks up records appended by other processes since the last look.
+    void refreshIndex() {
+        uint64_t count = __atomic_load_n(&header()->slotCount, __ATOMIC_ACQUIRE);
+        while (indexed_ < count) {
+            const StoredMatchup* entry = record(indexed_);
+            // A key claiming more bytes than its slots hold is damage; leave the record unmatched.
+            if (entry->keyLength <= STORE_KEY_INLINE + entry->keySlots * sizeof(StoredMatchup) &&
+                indexed_ + entry->keySlots < count) {
+                index_.emplace(entry->keyHash.low, indexed_);
+            }
+            indexed_ += 1 + entry->keySlots;
+        }
+    }
+
+    void close() {
+        if (base_) munmap(base_, MAP_BYTES);
+        if (fd_ >= 0) ::close(fd_);
+        base_ = nullptr;
+        fd_ = -1;
+    }
+
+    string filename_;
+    Logger& logger_;
+    int fd_ = -1;
+    char* base_ = nullptr;
+    mutex mutex_;
+    unordered_multimap<uint64_t, uint64_t> index_;   // low hash word -> first slot of a record
+    uint64_t indexed_ = 0;
+};
+
+
+// Columnar per-battle results. A file is a 32-byte header, a table of column descriptors, then blocks
+// in which every column is one contiguous array of fixed-width unsigned values, and finally an index
+// with each block's row count and, per column, its offset and min/max. The index sits at the end so
+// blocks can be streamed out as they fill; a reader maps the file and touches only the columns and
+// blocks it asks for.
+struct ColumnInfo {
+    string name;
+    int width;   // bytes per value: 1, 2, 4 or 8
+};
+
+struct ColumnChunk {
+    uint64_t offset, min, max;
+};
+
+inline const char COLUMN_MAGIC[8] = {'L', 'G', 'C', 'O', 'L', 'S', '0', '1'};
+
+class ColumnWriter {
+public:
+    ColumnWriter(const string& filename, const vector<ColumnInfo>& columns, Logger& logger, size_t blockRows = 65536);
+    ~ColumnWriter() { close(); }
+    bool isOpen() const { return out_.is_open(); }
+    size_t columnCount() const { return columns_.size(); }
+
+    // Takes any number of rows laid out row after row, columnCount() values each. Thread-safe.
+    void append(const vector<uint64_t>& rows);
+    // Flushes the last block and writes the index; the file is unreadable until this has run.
+    void close();
+
+private:
+    void flushBlock();
+
+    ofstream out_;
+    vector<ColumnInfo> columns_;
+    size_t blockRows_;
+    vector<vector<uint64_t>> pending_;
+    vector<uint64_t> blockRowCounts_;
+    vector<ColumnChunk> chunks_;
+    uint64_t offset_ = 0;
+    mutex mutex_;
+};
+
+class ColumnReader {
+public:
+    ColumnReader(const string& filename, Logger& logger);
+    ~ColumnReader();
+    bool isOpen() const { return base_ != nullptr; }
+    const vector<ColumnInfo>& columns() const { return columns_; }
+    int columnIndex(const string& name) const;
+    uint64_t rows() const { return rows_; }
+    size_t blocks() const { return blockRows_.size(); }
+    uint64_t blockRows(size_t block) const { return blockRows_[block]; }
+    const ColumnChunk& chunk(size_t block, int column) const { return chunks_[block * columns_.size() + column]; }
+
+    // Calls body(value) for every row of one column in file order, reading nothing but that column.
+    template <typename F>
+    void scan(int column, F body) const {
+        for (size_t b = 0; b < blocks(); b++) scanBlock(b, column, body);
+    }
+
+    template <typename F>
+    void scanBlock(size_t block, int column, F body) const {
+        const char* data = base_ + chunk(block, column).offset;
+        uint64_t n = blockRows_[block];
+        switch (columns_[column].width) {
+            case 1: scanAs<uint8_t>(data, n, body); break;
+            case 2: scanAs<uint16_t>(data, n, body); break;
+            case 4: scanAs<uint32_t>(data, n, body); break;
+            default: scanAs<uint64_t>(data, n, body); break;
+        }
+    }
+
+private:
+    template <typename T, typename F>
+    static void scanAs(const char* data, uint64_t n, F& body) {
+        const T* values = reinterpret_cast<const T*>(data);
+        for (uint64_t i = 0; i < n; i++) body(static_cast<uint64_t>(values[i]));
+    }
+
+    char* base_ = nullptr;
+    size_t size_ = 0;
+    vector<ColumnInfo> columns_;
+    vector<uint64_t> blockRows_;
+    vector<ColumnChunk> chunks_;
+    uint64_t rows_ = 0;
+};
+
+// Count, sum and range of the values of one column that fall in [low, high]. Blocks whose min/max
+// lie entirely outside are skipped and blocks entirely inside are counted without a filter.
+struct ColumnSummary {
+    uint64_t rows = 0, matching = 0, min = 0, max = 0, blocksSkipped = 0;
+    long double sum = 0;
+};
+ColumnSummary summarizeColumn(const ColumnReader& reader, int column,
+                              uint64_t low = 0, uint64_t high = numeric_limits<uint64_t>::max());
+
+// Per-battle columns: matchup, seed, winner, rounds, the starting composition of each side (unit
+// counts per type, count1_LI ... count2_Gu, and buffs1/buffs2 with the Light Infantry buffs of
+// positions 1-8, four bits per position in BUFF_CODES order), then survivors and damage dealt per
+// unit type for each side (survivors1_LI ... damage2_Gu).
+vector<ColumnInfo> battleColumns();
+inline const string BUFF_CODES[4] = {"Ho", "Sp", "Sh", "He"};
+inline const int BUFF_POSITIONS = 8;
+// The composition columns of a matchup; the same for all of its battles.
+vector<uint64_t> compositionRow(const vector<unique_ptr<Unit>>& team1, const vector<unique_ptr<Unit>>& team2);
+// Appends one row for a finished battle that was created with trackDamage().
+void appendBattleRow(vector<uint64_t>& rows, uint64_t matchupId, uint64_t seed, const vector<uint64_t>& composition,
+                     const Battle& battle);
+
+
+// One bit per row of a column file.
+struct Bitmap {
+    vector<uint64_t> words;
+
+    explicit Bitmap(uint64_t rows = 0) : words((rows + 63) / 64) {}
+    void set(uint64_t row) { words[row >> 6] |= 1ULL << (row & 63); }
+    bool test(uint64_t row) const { return words[row >> 6] >> (row & 63) & 1; }
+    Bitmap& operator&=(const Bitmap& other) {
+        for (size_t i = 0; i < words.size(); i++) words[i] &= other.words[i];
+        return *this;
+    }
+    Bitmap& operator|=(const Bitmap& other) {
+        for (size_t i = 0; i < words.size(); i++) words[i] |= other.words[i];
+        return *this;
+    }
+    // Complements the first `rows` bits and leaves the padding clear.
+    void flip(uint64_t rows) {
+        for (auto& word : words) word = ~word;
+        if (rows % 64) words.back() &= (1ULL << (rows % 64)) - 1;
+    }
+    uint64_t count() const {
+        uint64_t total = 0;
+        for (uint64_t word : words) total += popcount(word);
+        return total;
+    }
+    uint64_t countAnd(const Bitmap& other) const {
+        uint64_t total = 0;
+        for (size_t i = 0; i < words.size(); i++) total += popcount(words[i] & other.words[i]);
+        return total;
+    }
+};
+
+// One condition on a team's starting composition: a unit count comparison ("A >= 2"; a bare "W"
+// means at least one) or a Light Infantry buff at a position ("Sh@1"), optionally preceded by "not".
+struct TeamTerm {
+    enum class Kind { Count, Buff };
+    Kind kind = Kind::Count;
+    int type = 0, buff = 0, position = 1, value = 1;
+    string op = ">=";
+    bool negated = false;
+};
+
+// "<team terms> [vs <opponent terms>] [seat 1|2]", terms joined by "and". Results are counted from
+// the team's side: a battle where both sides match counts once for each of them.
+struct ResultQuery {
+    vector<TeamTerm> team, opponent;
+    int seat = 0;
+};
+bool parseResultQuery(const string& text, ResultQuery& query, string& error);
+
+struct QueryResult {
+    uint64_t battles = 0, wins = 0, draws = 0, losses = 0;
+    long double rounds = 0;
+};
+
+// Bitmap indexes over the composition columns of a battle column file. An index is built by one scan
+// of its column the first time a query needs it and kept afterwards: unit counts get one bitmap per
+// distinct value, buff masks one bitmap per bit. Answering a query is then AND/OR/popcount over
+// bitmaps, plus one pass over the rounds column for the average.
+class ResultIndex {
+public:
+    explicit ResultIndex(const ColumnReader& reader);
+    bool valid() const { return valid_; }
+    QueryResult run(const ResultQuery& query);
+    size_t indexBytes() const;
+private:
+    const vector<Bitmap>& equalityIndex(int column);
+    const vector<Bitmap>& bitIndex(int column);
+    Bitmap termBitmap(const TeamTerm& term, int side);
+    Bitmap teamBitmap(const vector<TeamTerm>& terms, int side);
+    long double sumRounds(const Bitmap& rows) const;
+
+    const ColumnReader& reader_;
+    bool valid_ = true;
+    int winner_, rounds_, counts_[2][UNIT_TYPES], buffs_[2];
+    map<int, vector<Bitmap>> equality_, bits_;
+};
+
+
+// Logistic model of team 1's expected score (win 1, draw 0.5) from the starting compositions alone:
+// unit counts per type and Light Infantry buff counts for each side, plus an intercept for the seat.
+// Scoring is a dot product, so it costs microseconds instead of a simulation.
+class OutcomeModel {
+public:
+    static const int FEATURES = 1 + 2 * UNIT_TYPES + 2 * 4;
+
+    // composition is laid out like compositionRow: counts of side 1, counts of side 2, buffs1, buffs2.
+    static void features(const uint64_t* composition, double* x);
+    double predict(const uint64_t* composition) const;
+    double predict(const vector<unique_ptr<Unit>>& team1, const vector<unique_ptr<Unit>>& team2) const {
+        return predict(compositionRow(team1, team2).data());
+    }
+    bool save(const string& filename, Logger& logger) const;
+    bool load(const string& filename, Logger& logger);
+
+    double weights[FEATURES] = {};
+};
+
+struct CalibrationBin {
+    double predicted = 0, observed = 0, battles = 0;
+};
+
+// How well the model's predictions match simulated scores on matchups it was not trained on.
+struct CalibrationReport {
+    long long trainMatchups = 0, testMatchups = 0;
+    double trainBattles = 0, testBattles = 0;
+    double brier = 0, baselineBrier = 0, logLoss = 0;
+    CalibrationBin bins[10];
+
+    string summary() const;
+};
+
+// Fits the model by Newton's method on the compositions of a battle column file, holding out every
+// fifth distinct matchup (chosen by hash, so all battles of one matchup land on the same side) for
+// the calibration report.
+bool trainOutcomeModel(const ColumnReader& reader, OutcomeModel& model, CalibrationReport& report, string& error);
+
+
+// Log of the evidence against success rate p after `successes` out of `trials`: the likelihood under a
+// uniform prior on the rate over the likelihood under p. For the true p its exponent is a martingale,
+// so by Ville's inequality it ever reaches 1 / alpha with probability at most alpha.
+double mixtureEvidence(int successes, int trials, double p);
+
+// Rates whose evidence is still below log(1 / alpha). Unlike a fixed-n interval such as Wilson's, it
+// covers the true rate at every trial count at once with probability 1 - alpha, so it may be checked
+// after each battle and a run stopped on it.
+pair<double, double> confidenceSequence(int successes, int trials, double alpha);
+
+
+// When a batch may stop before its battle budget. The estimate is team 1's share of decisive battles;
+// Precision stops once the confidence sequence is narrow enough, Decision once it excludes 50%. Both
+// are checked as often as the batch likes without raising the error rate above alpha.
+struct StoppingRule {
+    enum class Mode { Fixed, Precision, Decision };
+    Mode mode = Mode::Fixed;
+    double precision = 0.02;
+    double alpha = 0.05;
+    int minBattles = 20;
+
+    bool satisfied(const BatchStats& stats) const {
+        if (mode == Mode::Fixed || stats.battles < minBattles) return false;
+        int decisive = stats.wins1 + stats.wins2;
+        if (mode == Mode::Decision) return mixtureEvidence(stats.wins1, decisive, 0.5) >= log(1 / alpha);
+        auto [low, high] = confidenceSequence(stats.wins1, decisive, alpha);
+        return (high - low) / 2 <= precision;
+    }
+};
+
+
+class ThreadPool {
+public:
+    explicit ThreadPool(size_t threads) {
+        for (size_t i = 0; i < max<size_t>(threads, 1); i++) {
+            workers_.emplace_back([this, i] { work(i); });
+        }
+    }
+    ~ThreadPool() {
+        {
+            lock_guard<mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        ready_.notify_all();
+        for (auto& worker : workers_) worker.join();
+    }
+
+    // Tasks get the index of the worker thread running them, for per-thread scratch state.
+    void submit(function<void(size_t)> task) {
+        {
+            lock_guard<mutex> lock(mutex_);
+            tasks_.push(std::move(task));
+            pending_++;
+        }
+        ready_.notify_one();
+    }
+
+    void wait() {
+        unique_lock<mutex> lock(mutex_);
+        idle_.wait(lock, [this] { return pending_ == 0; });
+    }
+
+    size_t size() const { return workers_.size(); }
+
+private:
+    void work(size_t worker) {
+        while (true) {
+            function<void(size_t)> task;
+            {
+                unique_lock<mutex> lock(mutex_);
+                ready_.wait(lock, [this] { return stopping_ || !tasks_.empty(); });
+                if (tasks_.empty()) return;
+                task = std::move(tasks_.front());
+                tasks_.pop();
+            }
+            task(worker);
+            lock_guard<mutex> lock(mutex_);
+            if (--pending_ == 0) idle_.notify_all();
+        }
+    }
+
+    vector<thread> workers_;
+    queue<function<void(size_t)>> tasks_;
+    mutex mutex_;
+    condition_variable ready_, idle_;
+    size_t pending_ = 0;
+    bool stopping_ = false;
+};
+
+
+// Teams of a standard 100-point budget hold about ten units plus Wizard clones.
+inline const int INLINE_CAPACITY = 16;
+
+// A unit as plain data for the allocation-free engine path. Only state that changes during a
+// battle is kept; names and costs follow from the type and positions are always index + 1.
+struct InlineUnit {
+    char type;          // Unit::typeCode()
+    uint8_t buffs;      // Light Infantry buffs, bit b for BUFF_CODES[b]
+    int32_t hp, maxHp, attack, armor;
+    int32_t extra;      // damage taken (Light Infantry), charges (Healer), boost anchor (GuliayGorod)
+};
+
+// Up to INLINE_CAPACITY units stored in place, so a team is copied with a memcpy.
+struct InlineTeam {
+    InlineUnit units[INLINE_CAPACITY];
+    int size = 0;
+
+    // False if the team does not fit: too many units, a repeated buff or positions out of order.
+    static bool from(const vector<unique_ptr<Unit>>& team, InlineTeam& out);
+    vector<unique_ptr<Unit>> toUnits() const;
+};
+
+// Battle::run with a silent logger on inline teams: same rules, dice and result, but nothing on the
+// heap. Should a Wizard clone overflow a team, the round is restarted from its opening state on a
+// regular Battle, which finishes the fight. The rules are written twice, so checkInlineEngine keeps
+// the two copies honest.
+BattleResult playInline(const InlineTeam& team1, const InlineTeam& team2, int round, const SimulationOptions& options,
+                        uint64_t seed, bool antithetic = false);
+
+using InlineKernel = BattleResult (*)(const InlineTeam&, const InlineTeam&, int, const SimulationOptions&, uint64_t, bool);
+
+// playInline compiled for the exact unit types of both teams, so type checks and targeting are
+// resolved at compile time, if the pair is one of the hot matchups built into the engine;
+// playInline itself for any other pair. Look it up once per matchup, not per battle.
+InlineKernel findKernel(const InlineTeam& team1, const InlineTeam& team2);
+
+struct KernelVolume {
+    string types1, types2;   // unit type letters front to back, as findKernel matches them
+    uint64_t battles = 0;
+    bool compiled = false;   // findKernel has a kernel for the pair
+};
+
+// Stored battles per pair of type sequences, most played first. Matchups stored under simultaneous
+// rules are left out, since kernels only play sequential ones. Hot matchups are picked from the top.
+vector<KernelVolume> kernelVolume(ResultStore& store);
+
+// Plays `battles` random matchups (buffs, Wizards, round caps, antithetic dice, fast-forward on and
+// off) through both playInline and Battle::run, logs every battle whose results differ as an ERROR
+// and returns how many did. Every other battle is one of the findKernel pairs, played by its kernel.
+int checkInlineEngine(int battles, uint64_t seed, Logger& logger);
+
+
+// Calls body(i, worker) for every i in [0, count) across the pool and returns once all calls are done.
+void parallelFor(ThreadPool& pool, int count, const function<void(int, size_t)>& body);
+
+uint64_t randomSeed();
+double battleScore(const BattleResult& result);
+
+// Plays up to `battles` battles of the matchup (fewer if `stats` already holds samples or the stopping
+// rule is met), adding every result to `stats` and, when given, to the store record `entry`.
+// Battles are numbered on from the ones already in `stats`, and battle i uses dice seed
+// StreamDice::battleSeed(seed, i), so extending a stored matchup with the same seed plays new
+// battles. Returns how many were played.
+int playBatch(const vector<unique_ptr<Unit>>& team1, const vector<unique_ptr<Unit>>& team2,
+              const string& t1, const string& t2, int round, int battles, const SimulationOptions& options,
+              const StoppingRule& stopping, uint64_t seed, ThreadPool& pool, StoredMatchup* entry, BatchStats& stats,
+              ColumnWriter* columns = nullptr, uint64_t matchupId = 0, NotableBattles* notable = nullptr);
+
+BatchStats runBatch(const vector<unique_ptr<Unit>>& team1, const vector<unique_ptr<Unit>>& team2,
+                    const string& t1, const string& t2, int round, int battles, const SimulationOptions& options,
+                    const StoppingRule& stopping, uint64_t seed, ThreadPool& pool, ResultStore* store, Logger& logger,
+                    ColumnWriter* columns = nullptr, NotableBattles* notable = nullptr);
+
+// Plays one battle of a batch again from its summary, logging every move to `logger`.
+BattleResult replayBattle(const vector<unique_ptr<Unit>>& team1, const vector<unique_ptr<Unit>>& team2,
+                          const string& t1, const string& t2, int round, const SimulationOptions& options,
+                          const BattleSummary& battle, Logger& logger);
+
+// Plays both candidates against the same opponent and estimates the difference in their scores
+// (win 1, draw 0.5). With common random numbers, pair i of battles shares one dice seed, so the
+// opponent makes the same rolls against both candidates and most of the noise cancels in the
+// difference. Antithetic sampling adds a mirrored-dice battle to every sample.
+void runComparison(const vector<unique_ptr<Unit>>& candidateA, const vector<unique_ptr<Unit>>& candidateB,
+                   const vector<unique_ptr<Unit>>& opponent, const string& nameA, const string& nameB,
+                   const string& opponentName, int round, int battles, const SimulationOptions& options,
+                   bool commonRandomNumbers, bool antithetic, uint64_t seed, ThreadPool& pool, Logger& logger);
+
+struct WinEstimate {
+    int samples = 0, wins1 = 0, wins2 = 0, draws = 0;
+    double elapsedMs = 0;
+};
+
+// Forks the battle's current state and plays silent continuations with fresh dice on every worker
+// until the time budget runs out (or maxSamples is reached). The battle itself is only read.
+WinEstimate estimateWinProbability(const Battle& battle, chrono::milliseconds budget, ThreadPool& pool,
+                                   uint64_t seed, int maxSamples = 1000000);
+
+
+// Single-threaded counterpart of playBatch, for callers that spread whole matchups over threads instead.
+void playMatchup(const vector<unique_ptr<Unit>>& team1, const vector<unique_ptr<Unit>>& team2,
+                 const string& t1, const string& t2, int round, int battles, const SimulationOptions& options,
+                 const StoppingRule& stopping, uint64_t seed, StoredMatchup* entry, BatchStats& stats,
+                 ColumnWriter* columns = nullptr, uint64_t matchupId = 0);
+
+
+// Bounded multi-producer multi-consumer ring (Vyukov). Every cell carries a sequence number that says
+// whether it is free for the producer of the current lap or holds a value for its consumer, so push
+// and pop each take one CAS on their own counter and no lock. A full queue makes producers wait,
+// which is what keeps a fast stage from running ahead of a slow one.
+template <typename T>
+class BoundedQueue {
+public:
+    explicit BoundedQueue(size_t capacity) {
+        size_t size = 2;
+        while (size < capacity) size <<= 1;
+        cells_ = make_unique<Cell[]>(size);
+        mask_ = size - 1;
+        for (size_t i = 0; i < size; i++) cells_[i].sequence.store(i, memory_order_relaxed);
+    }
+
+    // Moves value in and returns true, or leaves it untouched and returns false if the queue is full.
+    bool tryPush(T& value) {
+        size_t pos = tail_.load(memory_order_relaxed);
+        while (true) {
+            Cell& cell = cells_[pos & mask_];
+            size_t sequence = cell.sequence.load(memory_order_acquire);
+            auto diff = static_cast<ptrdiff_t>(sequence - pos);
+            if (diff == 0) {
+                if (tail_.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) {
+                    cell.value = std::move(value);
+                    cell.sequence.store(pos + 1, memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = tail_.load(memory_order_relaxed);
+            }
+        }
+    }
+
+    bool tryPop(T& value) {
+        size_t pos = head_.load(memory_order_relaxed);
+        while (true) {
+            Cell& cell = cells_[pos & mask_];
+            size_t sequence = cell.sequence.load(memory_order_acquire);
+            auto diff = static_cast<ptrdiff_t>(sequence - (pos + 1));
+            if (diff == 0) {
+                if (head_.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) {
+                    value = std::move(cell.value);
+                    cell.sequence.store(pos + mask_ + 1, memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = head_.load(memory_order_relaxed);
+            }
+        }
+    }
+
+    void push(T& value) {
+        for (int attempt = 0; !tryPush(value); attempt++) backOff(attempt);
+    }
+
+    // Waits for a value; returns false once the queue is closed and drained.
+    bool pop(T& value) {
+        for (int attempt = 0; !tryPop(value); attempt++) {
+            if (closed_.load(memory_order_acquire)) return tryPop(value);
+            backOff(attempt);
+        }
+        return true;
+    }
+
+    // Producers call this after their last push; consumers then drain what is left and stop.
+    void close() { closed_.store(true, memory_order_release); }
+
+    size_t depth() const {
+        size_t head = head_.load(memory_order_relaxed), tail = tail_.load(memory_order_relaxed);
+        return tail > head ? min(tail - head, mask_ + 1) : 0;
+    }
+    size_t capacity() const { return mask_ + 1; }
+
+private:
+    struct Cell {
+        atomic<size_t> sequence;
+        T value;
+    };
+
+    static void backOff(int attempt) {
+        if (attempt < 64) this_thread::yield();
+        else this_thread::sleep_for(chrono::microseconds(100));
+    }
+
+    unique_ptr<Cell[]> cells_;
+    size_t mask_;
+    alignas(64) atomic<size_t> head_{0};
+    alignas(64) atomic<size_t> tail_{0};
+    atomic<bool> closed_{false};
+};
+
+
+struct MatchupJob {
+    long long id = 0;
+    MatchupSpec matchup;
+};
+
+struct MatchupOutcome {
+    long long id = 0;
+    string name1, name2;
+    int cost1 = 0, cost2 = 0;
+    BatchStats stats;
+};
+
+struct PipelineOptions {
+    int round = 1;
+    int battles = 1000;
+    SimulationOptions simulation;
+    StoppingRule stopping;
+    uint64_t seed = 0;
+    size_t workers = 1;
+    size_t queueCapacity = 256;
+};
+
+// Per-stage counters of one pipeline run. Queue depth is sampled on every push.
+struct PipelineReport {
+    struct Queue {
+        size_t capacity = 0, maxDepth = 0;
+        double depthSum = 0;
+        long long samples = 0;
+        double blockedSeconds = 0;
+    };
+    long long generated = 0, simulated = 0, aggregated = 0, battles = 0;
+    double seconds = 0, generatorSeconds = 0, workerSeconds = 0, aggregatorSeconds = 0;
+    Queue jobs, outcomes;
+
+    string summary() const;
+};
+
+// Streams matchups through three stages: `generate` fills the next matchup (false when there are no
+// more), a pool of workers plays each one with playMatchup, and `consume` sees every outcome on the
+// calling thread in completion order. The stages are joined by bounded queues, so memory stays flat
+// however many matchups flow through. Every matchup uses the same dice seed.
+PipelineReport runPipeline(const function<bool(MatchupSpec&)>& generate, const function<void(MatchupOutcome&)>& consume,
+                           const PipelineOptions& options, ResultStore* store, ColumnWriter* columns = nullptr);
+
+// Every unbuffed team (an ordered unit sequence) costing at most `budget`, shortest prefixes first,
+// produced one at a time so arbitrarily large spaces can be streamed.
+class TeamEnumerator {
+public:
+    TeamEnumerator(int budget, int maxUnits = 0) : budget_(budget), maxUnits_(maxUnits) {}
+    bool next(vector<unique_ptr<Unit>>& team);
+private:
+    int budget_, maxUnits_, cost_ = 0;
+    vector<int> current_;
+    bool started_ = false;
+};
+
+// Inverse of parseTeamSpec; runs of identical units are written as N*X.
+string formatTeamSpec(const vector<unique_ptr<Unit>>& team);
+
+#endif
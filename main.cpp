@@ -1,471 +1,4 @@
-#include <iostream>
-#include <vector>
-#include <string>
-#include <cstdlib>
-#include <ctime>
-#include <fstream>
-#include <sstream>
-#include <map>
-#include <chrono>
-#include <algorithm>
-#include <random>
-#include <stack>
-
-using namespace std;
-
-
-class Logger {
-public:
-    virtual void log(const string& message, const string& level = "INFO") = 0;
-    virtual ~Logger() = default;
-};
-
-
-class ConsoleLogger : public Logger {
-public:
-    void log(const string& message, const string& level) override {
-        cout << message << "\n";
-    }
-};
-
-
-class LoggerProxy : public Logger {
-public:
-    LoggerProxy(const string& filename) : file_logger(filename.c_str(), ios::app) {
-        real_logger = make_unique<ConsoleLogger>();
-        if (!file_logger.is_open()) {
-            real_logger->log("Failed to open log file: " + filename, "ERROR");
-        } else {
-            real_logger->log("Successfully opened log file: " + filename, "DEBUG");
-        }
-    }
-    void log(const string& message, const string& level) override {
-        real_logger->log(message, level);
-        if (file_logger.is_open()) {
-            auto now = chrono::system_clock::now();
-            auto time = chrono::system_clock::to_time_t(now);
-            string timestamp = ctime(&time);
-            timestamp.pop_back();
-            file_logger << "[" << timestamp << "] [" << level << "] " << message << "\n";
-            file_logger.flush();
-        }
-    }
-    ~LoggerProxy() {
-        if (file_logger.is_open()) {
-            file_logger.close();
-        }
-    }
-private:
-    unique_ptr<Logger> real_logger;
-    ofstream file_logger;
-};
-
-
-struct Buff {
-    string name;
-    int hp_boost, attack_boost, extra_attacks, armor, cost, damage_threshold;
-};
-
-const map<string, Buff> BUFFS = {
-    {"Ho", {"Horse", 5, 0, 2, 0, 5, 15}},
-    {"Sp", {"Spear", 0, 5, 0, 0, 3, 10}},
-    {"Sh", {"Shield", 0, 0, 0, 10, 4, 20}},
-    {"He", {"Helmet", 5, 0, 0, 0, 2, 25}}
-};
-
-
-class Unit {
-public:
-    string name;
-    int hp, max_hp, attack, position, cost;
-    virtual void attackUnit(Unit* target, const string& attackerTeam, const string& targetTeam, Logger& logger) = 0;
-    virtual void specialAbility(vector<unique_ptr<Unit>>& team, const string& teamName, int round, Logger& logger) {}
-    virtual unique_ptr<Unit> clone() const = 0;
-    virtual void saveExtra(ofstream& out) const { out << max_hp << ' '; }
-    virtual void loadExtra(istringstream& iss) { iss >> max_hp; }
-    virtual void updatePositions(vector<unique_ptr<Unit>>& team) {
-        for (size_t i = 0; i < team.size(); ++i) {
-            team[i]->position = i + 1;
-        }
-    }
-    virtual ~Unit() = default;
-};
-
-
-class GuliayGorod {
-public:
-    string name;
-    int hp, max_hp, cost;
-    GuliayGorod(int pos) {
-        name = "GuliayGorod";
-        hp = max_hp = 80;
-        cost = 25;
-        position = pos;
-    }
-    void boostAllies(vector<unique_ptr<Unit>>& team, const string& teamName, int round, Logger& logger) {
-        if (round != 1) return;
-        for (auto& unit : team) {
-            if (unit->hp > 0 && abs(unit->position - position) == 1) {
-                unit->hp += 10;
-                unit->max_hp += 10;
-                logger.log(teamName + ": GuliayGorod [" + to_string(position) + "] boosts " +
-                           unit->name + " [" + to_string(unit->position) + "] HP and max HP to " + to_string(unit->hp) + ".", "INFO");
-            }
-        }
-    }
-    int getPosition() const { return position; }
-    void setPosition(int pos) { position = pos; }
-private:
-    int position;
-};
-
-
-class GuliayGorodAdapter : public Unit {
-public:
-    GuliayGorodAdapter(int pos) : guliayGorod(pos) {
-        name = guliayGorod.name;
-        hp = guliayGorod.hp;
-        max_hp = guliayGorod.max_hp;
-        attack = 0;
-        position = pos;
-        cost = guliayGorod.cost;
-    }
-    void attackUnit(Unit*, const string&, const string&, Logger&) override {}
-    void specialAbility(vector<unique_ptr<Unit>>& team, const string& teamName, int round, Logger& logger) override {
-        guliayGorod.boostAllies(team, teamName, round, logger);
-    }
-    unique_ptr<Unit> clone() const override {
-        auto adapter = make_unique<GuliayGorodAdapter>(position);
-        adapter->hp = hp;
-        return adapter;
-    }
-    void saveExtra(ofstream& out) const override {}
-    void loadExtra(istringstream& iss) override {}
-private:
-    GuliayGorod guliayGorod;
-};
-
-
-class LightInfantry : public Unit {
-public:
-    vector<string> active_buffs;
-    int total_damage_taken = 0;
-    int armor = 0;
-    LightInfantry(int pos, const vector<string>& buffs = {}) {
-        name = "Light Infantry";
-        hp = max_hp = 50;
-        attack = 8;
-        position = pos;
-        cost = 10;
-        active_buffs = buffs;
-        applyBuffs();
-    }
-    void applyBuffs() {
-        double hp_ratio = max_hp > 0 ? static_cast<double>(hp) / max_hp : 1.0;
-        max_hp = 50;
-        attack = 8;
-        armor = 0;
-        for (const auto& buff : active_buffs) {
-            auto it = BUFFS.find(buff);
-            if (it != BUFFS.end()) {
-                max_hp += it->second.hp_boost;
-                attack += it->second.attack_boost;
-                armor += it->second.armor;
-            }
-        }
-        hp = static_cast<int>(max_hp * hp_ratio);
-        if (hp < 0) hp = 0;
-    }
-    void applyDamage(int damage, Logger& logger) {
-        int reduced_damage = max(0, damage - armor);
-        logger.log(name + " [" + to_string(position) + "] takes " + to_string(reduced_damage) +
-                   " damage (raw: " + to_string(damage) + ", armor: " + to_string(armor) +
-                   "). HP before: " + to_string(hp), "INFO");
-        hp -= reduced_damage;
-        if (reduced_damage > 0) {
-            total_damage_taken += reduced_damage;
-            checkBuffLoss(logger);
-        }
-        if (hp < 0) hp = 0;
-        logger.log(name + " [" + to_string(position) + "] HP after: " + to_string(hp), "INFO");
-    }
-    void checkBuffLoss(Logger& logger) {
-        vector<string> remaining_buffs;
-        for (const auto& buff : active_buffs) {
-            auto it = BUFFS.find(buff);
-            if (it != BUFFS.end() && total_damage_taken <= it->second.damage_threshold) {
-                remaining_buffs.push_back(buff);
-            } else if (it != BUFFS.end()) {
-                logger.log(name + " [" + to_string(position) + "] loses " + it->second.name +
-                           " due to " + to_string(total_damage_taken) + " damage taken.", "INFO");
-                if (it->second.hp_boost > 0) {
-                    max_hp -= it->second.hp_boost;
-                    hp = min(hp, max_hp);
-                }
-            }
-        }
-        active_buffs = remaining_buffs;
-        applyBuffs();
-    }
-    void attackUnit(Unit* target, const string& attackerTeam, const string& targetTeam, Logger& logger) override {
-        if (!target) return;
-        int attacks = rand() % 2 + (hasBuff("Ho") ? 4 : 2);
-        for (int i = 0; i < attacks && target->hp > 0; i++) {
-            logger.log(attackerTeam + ": " + name + " [" + to_string(position) + "] attacks " +
-                       targetTeam + ": " + target->name + " [" + to_string(target->position) + "] and deals " + to_string(attack) + " damage.", "INFO");
-            if (auto li = dynamic_cast<LightInfantry*>(target)) {
-                li->applyDamage(attack, logger);
-            } else {
-                target->hp -= attack;
-            }
-        }
-    }
-    bool hasBuff(const string& buff_code) const {
-        return find(active_buffs.begin(), active_buffs.end(), buff_code) != active_buffs.end();
-    }
-    unique_ptr<Unit> clone() const override {
-        auto li = make_unique<LightInfantry>(position, active_buffs);
-        li->hp = hp;
-        li->max_hp = max_hp;
-        li->total_damage_taken = total_damage_taken;
-        li->applyBuffs();
-        return li;
-    }
-    void saveExtra(ofstream& out) const override {
-        out << max_hp << ' ' << total_damage_taken << ' ';
-        for (const auto& buff : active_buffs) out << buff;
-        out << ' ';
-    }
-    void loadExtra(istringstream& iss) override {
-        iss >> max_hp >> total_damage_taken;
-        string buff_str;
-        iss >> buff_str;
-        active_buffs.clear();
-        for (size_t i = 0; i < buff_str.size(); i += 2) {
-            string buff_code = buff_str.substr(i, 2);
-            if (BUFFS.find(buff_code) != BUFFS.end()) {
-                active_buffs.push_back(buff_code);
-            }
-        }
-        applyBuffs();
-    }
-};
-
-class HeavyInfantry : public Unit {
-public:
-    HeavyInfantry(int pos) {
-        name = "Heavy Infantry"; hp = max_hp = 100; attack = 20; position = pos; cost = 30;
-    }
-    void attackUnit(Unit* target, const string& attackerTeam, const string& targetTeam, Logger& logger) override {
-        if (!target) return;
-        logger.log(attackerTeam + ": " + name + " [" + to_string(position) + "] attacks " +
-                   targetTeam + ": " + target->name + " [" + to_string(target->position) + "] and deals " + to_string(attack) + " damage.", "INFO");
-        if (auto li = dynamic_cast<LightInfantry*>(target)) {
-            li->applyDamage(attack, logger);
-        } else {
-            target->hp -= attack;
-        }
-    }
-    unique_ptr<Unit> clone() const override { return make_unique<HeavyInfantry>(position); }
-};
-
-class Archer : public Unit {
-public:
-    Archer(int pos) {
-        name = "Archer"; hp = max_hp = 40; attack = 7; position = pos; cost = 20;
-    }
-    void attackUnit(Unit* target, const string& attackerTeam, const string& targetTeam, Logger& logger) override {
-        if (!target) return;
-        int attacks = rand() % 5 + 1;
-        for (int i = 0; i < attacks && target->hp > 0; i++) {
-            logger.log(attackerTeam + ": " + name + " [" + to_string(position) + "] attacks " +
-                       targetTeam + ": " + target->name + " [" + to_string(target->position) + "] and deals " + to_string(attack) + " damage.", "INFO");
-            if (auto li = dynamic_cast<LightInfantry*>(target)) {
-                li->applyDamage(attack, logger);
-            } else {
-                target->hp -= attack;
-            }
-        }
-    }
-    unique_ptr<Unit> clone() const override { return make_unique<Archer>(position); }
-};
-
-class Wizard : public Unit {
-public:
-    Wizard(int pos) {
-        name = "Wizard"; hp = max_hp = 30; attack = 5; position = pos; cost = 30;
-    }
-    void attackUnit(Unit* target, const string& attackerTeam, const string& targetTeam, Logger& logger) override {
-        if (!target) return;
-        logger.log(attackerTeam + ": " + name + " [" + to_string(position) + "] attacks " +
-                   targetTeam + ": " + target->name + " [" + to_string(target->position) + "] and deals " + to_string(attack) + " damage.", "INFO");
-        if (auto li = dynamic_cast<LightInfantry*>(target)) {
-            li->applyDamage(attack, logger);
-        } else {
-            target->hp -= attack;
-        }
-    }
-    void specialAbility(vector<unique_ptr<Unit>>& team, const string& teamName, int round, Logger& logger) override {
-        if (rand() % 100 < 10) {
-            for (size_t i = 0; i < team.size(); i++) {
-                if (team[i]->hp > 0 &&
-                    (dynamic_cast<LightInfantry*>(team[i].get()) ||
-                     dynamic_cast<Archer*>(team[i].get()))) {
-                    string originalName = team[i]->name;
-                    auto cloned = team[i]->clone();
-                    cloned->position = i + 2;
-                    team.insert(team.begin() + i + 1, std::move(cloned));
-                    logger.log(teamName + ": " + name + " [" + to_string(position) + "] clones " + originalName + " at position " + to_string(i + 2) + "!", "INFO");
-                    updatePositions(team);
-                    break;
-                }
-            }
-        }
-    }
-    unique_ptr<Unit> clone() const override { return make_unique<Wizard>(position); }
-};
-
-class Healer : public Unit {
-public:
-    int healing_charges = 5;
-    Healer(int pos) {
-        name = "Healer"; hp = max_hp = 50; attack = 8; position = pos; cost = 15;
-    }
-    void attackUnit(Unit*, const string&, const string&, Logger&) override {}
-    void specialAbility(vector<unique_ptr<Unit>>& team, const string& teamName, int round, Logger& logger) override {
-        if (healing_charges > 0) {
-            for (auto& unit : team) {
-                if (unit->hp > 0 && unit->hp < 30 &&
-                    dynamic_cast<Wizard*>(unit.get()) == nullptr &&
-                    dynamic_cast<GuliayGorodAdapter*>(unit.get()) == nullptr) {
-                    unit->hp += 5;
-                    healing_charges--;
-                    logger.log(teamName + ": " + name + " [" + to_string(position) + "] heals " +
-                               unit->name + " [" + to_string(unit->position) + "] for 5 HP. Charges left: " + to_string(healing_charges) + ".", "INFO");
-                    break;
-                }
-            }
-        }
-    }
-    void saveExtra(ofstream& out) const override {
-        out << max_hp << ' ' << healing_charges << ' ';
-    }
-    void loadExtra(istringstream& iss) override {
-        iss >> max_hp >> healing_charges;
-    }
-    unique_ptr<Unit> clone() const override {
-        auto healer = make_unique<Healer>(position);
-        healer->healing_charges = healing_charges;
-        return healer;
-    }
-};
-
-
-class UnitFactory {
-public:
-    virtual unique_ptr<Unit> createUnit(const string& type, int pos, Logger& logger) = 0;
-    virtual void createTeam(vector<unique_ptr<Unit>>& team, const string& teamName, int balance, Logger& logger) = 0;
-    virtual ~UnitFactory() = default;
-};
-
-
-class GameManager {
-    static GameManager* instance;
-    GameManager() {}
-public:
-    static GameManager* getInstance() {
-        if (!instance) instance = new GameManager();
-        return instance;
-    }
-
-    void displayTeam(const vector<unique_ptr<Unit>>& team, const string& teamName, Logger& logger) {
-        logger.log(teamName + ":", "INFO");
-        if (team.empty()) {
-            logger.log("No units remaining.", "INFO");
-            return;
-        }
-        for (const auto& unit : team) {
-            string unit_info = "[" + to_string(unit->position) + "] " + unit->name + " - " +
-                               to_string(unit->hp) + "/" + to_string(unit->max_hp) + " HP";
-            if (auto li = dynamic_cast<LightInfantry*>(unit.get())) {
-                if (!li->active_buffs.empty()) {
-                    unit_info += " (Buffs: ";
-                    for (size_t i = 0; i < li->active_buffs.size(); ++i) {
-                        auto it = BUFFS.find(li->active_buffs[i]);
-                        unit_info += (it != BUFFS.end() ? it->second.name : li->active_buffs[i]);
-                        if (i < li->active_buffs.size() - 1) unit_info += ", ";
-                    }
-                    unit_info += ")";
-                }
-            }
-            logger.log(unit_info, "INFO");
-        }
-    }
-
-    bool isTeamAlive(const vector<unique_ptr<Unit>>& team) {
-        return !team.empty();
-    }
-
-    void cleanAndShift(vector<unique_ptr<Unit>>& team) {
-        team.erase(remove_if(team.begin(), team.end(),
-            [](const unique_ptr<Unit>& u) { return u->hp <= 0; }), team.end());
-        for (size_t i = 0; i < team.size(); i++) {
-            team[i]->position = i + 1;
-        }
-    }
-
-    void createTeam(vector<unique_ptr<Unit>>& team, const string& teamName, int balance, UnitFactory& factory, Logger& logger) {
-        factory.createTeam(team, teamName, balance, logger);
-        displayTeam(team, teamName, logger);
-    }
-
-    void simulateRound(vector<unique_ptr<Unit>>& t1, vector<unique_ptr<Unit>>& t2,
-                       const string& n1, const string& n2, int round, Logger& logger) {
-        logger.log("\nRound " + to_string(round) + ":", "INFO");
-        for (auto& u : t1) {
-            if (u->hp <= 0) continue;
-            u->specialAbility(t1, n1, round, logger);
-            if (t2.empty()) break;
-            if (dynamic_cast<Archer*>(u.get())) {
-                for (auto& tgt : t2) {
-                    if (tgt->hp > 0 && abs(u->position - tgt->position) <= 3) {
-                        u->attackUnit(tgt.get(), n1, n2, logger);
-                        break;
-                    }
-                }
-            } else if (u->position == 1) {
-                for (auto& tgt : t2) {
-                    if (tgt->hp > 0 && tgt->position == 1) {
-                        u->attackUnit(tgt.get(), n1, n2, logger);
-                        break;
-                    }
-                }
-            }
-        }
-
-        for (auto& u : t2) {
-            if (u->hp <= 0) continue;
-            u->specialAbility(t2, n2, round, logger);
-            if (t1.empty()) break;
-            if (dynamic_cast<Archer*>(u.get())) {
-                for (auto& tgt : t1) {
-                    if (tgt->hp > 0 && abs(u->position - tgt->position) <= 3) {
-                        u->attackUnit(tgt.get(), n2, n1, logger);
-                        break;
-                    }
-                }
-            } else if (u->position == 1) {
-                for (auto& tgt : t1) {
-                    if (tgt->hp > 0 && tgt->position == 1) {
-                        u->attackUnit(tgt.get(), n2, n1, logger);
-                        break;
-                    }
-                }
-            }
-        }
-    }
-};
-GameManager* GameManager::instance = nullptr;
+#include "lgame_core.h"
 
 
 class Command {
@@ -474,6 +7,8 @@ public:
     virtual void undo() = 0;
     virtual void redo() { execute(); }
     virtual string description() const = 0;
+    // Memory kept for undo/redo, charged against CommandManager's budget.
+    virtual size_t footprint() const { return 0; }
     virtual ~Command() = default;
 };
 
@@ -492,7 +27,7 @@ public:
 
         teamState_.clear();
         for (const auto& unit : team_) {
-            teamState_.push_back(unit->clone());
+            teamState_.push_back(UnitState(cloneUnit(*unit)));
         }
         executedBalance_ = balance_;
     }
@@ -506,8 +41,8 @@ public:
     void redo() override {
         team_.clear();
         balance_ = executedBalance_;
-        for (const auto& unit : teamState_) {
-            team_.push_back(unit->clone());
+        for (const auto& state : teamState_) {
+            team_.push_back(cloneUnit(*state));
         }
         logger_.log("Redoing team creation for " + teamName_, "INFO");
     }
@@ -516,6 +51,10 @@ public:
         return "Team creation for " + teamName_;
     }
 
+    size_t footprint() const override {
+        return sizeof(*this) + teamState_.size() * UNIT_STATE_BYTES;
+    }
+
 private:
     vector<unique_ptr<Unit>>& team_;
     string teamName_;
@@ -524,20 +63,23 @@ private:
     GameManager& gameManager_;
     Logger& logger_;
     int balance_;
-    vector<unique_ptr<Unit>> teamState_;
+    vector<UnitState> teamState_;
     int executedBalance_;
 };
 
 
+// Oldest commands are forgotten once the history outgrows its budget; the latest always stays undoable.
 class CommandManager {
 public:
-    CommandManager(Logger& logger) : logger_(logger) {}
+    CommandManager(Logger& logger, size_t budgetBytes = 16 << 20) : logger_(logger), budget_(budgetBytes) {}
 
     void execute(unique_ptr<Command> command) {
         command->execute();
-        executedCommands_.push(std::move(command));
-        while (!undoneCommands_.empty()) {
-            undoneCommands_.pop();
+        executedCommands_.push_back(std::move(command));
+        undoneCommands_.clear();
+        while (executedCommands_.size() > 1 && footprint() > budget_) {
+            logger_.log("Undo history full, forgetting: " + executedCommands_.front()->description(), "INFO");
+            executedCommands_.pop_front();
         }
     }
 
@@ -551,38 +93,47 @@ public:
 
     void undo() {
         if (!canUndo()) return;
-        auto command = std::move(executedCommands_.top());
+        auto command = std::move(executedCommands_.back());
         logger_.log("Performing undo operation: " + command->description(), "INFO");
-        executedCommands_.pop();
+        executedCommands_.pop_back();
         command->undo();
-        undoneCommands_.push(std::move(command));
+        undoneCommands_.push_back(std::move(command));
     }
 
     void redo() {
         if (!canRedo()) return;
-        auto command = std::move(undoneCommands_.top());
+        auto command = std::move(undoneCommands_.back());
         logger_.log("Performing redo operation: " + command->description(), "INFO");
-        undoneCommands_.pop();
+        undoneCommands_.pop_back();
         command->redo();
-        executedCommands_.push(std::move(command));
+        executedCommands_.push_back(std::move(command));
     }
 
     void clear() {
-        while (!executedCommands_.empty()) executedCommands_.pop();
-        while (!undoneCommands_.empty()) undoneCommands_.pop();
+        executedCommands_.clear();
+        undoneCommands_.clear();
     }
 
     string lastCommandDescription() const {
         if (executedCommands_.empty()) return "No commands to undo";
-        return executedCommands_.top()->description();
+        return executedCommands_.back()->description();
+    }
+
+    size_t footprint() const {
+        size_t bytes = 0;
+        for (const auto& command : executedCommands_) bytes += command->footprint();
+        for (const auto& command : undoneCommands_) bytes += command->footprint();
+        return bytes;
     }
 
 private:
-    stack<unique_ptr<Command>> executedCommands_;
-    stack<unique_ptr<Command>> undoneCommands_;
+    deque<unique_ptr<Command>> executedCommands_;
+    deque<unique_ptr<Command>> undoneCommands_;
     Logger& logger_;
+    size_t budget_;
 };
 
+
 class ManualUnitFactory : public UnitFactory {
 public:
     unique_ptr<Unit> createUnit(const string& type, int pos, Logger& logger) override {
@@ -657,6 +208,7 @@ public:
     }
 };
 
+
 class AutomaticUnitFactory : public UnitFactory {
 public:
     unique_ptr<Unit> createUnit(const string& type, int pos, Logger& logger) override {
@@ -730,111 +282,623 @@ public:
 };
 
 
-void saveGame(const string& filename, const string& t1, const string& t2, int round,
-              const vector<unique_ptr<Unit>>& team1, const vector<unique_ptr<Unit>>& team2, Logger& logger) {
-    ofstream out(filename);
-    if (!out) {
-        logger.log("Error: Could not save game to " + filename, "ERROR");
-        return;
-    }
-    out << t1 << '\n' << t2 << '\n' << round << '\n';
-    for (const auto& u : team1) {
-        out << u->name[0] << ' ' << u->position << ' ' << u->hp << ' ';
-        u->saveExtra(out);
-        out << '\n';
+// Builds the team from a one-line spec (see parseTeamSpec), dropping units the balance can't pay for.
+class SpecUnitFactory : public UnitFactory {
+public:
+    unique_ptr<Unit> createUnit(const string& type, int pos, Logger& logger) override {
+        return makeUnit(type, pos);
     }
-    out << "---\n";
-    for (const auto& u : team2) {
-        out << u->name[0] << ' ' << u->position << ' ' << u->hp << ' ';
-        u->saveExtra(out);
-        out << '\n';
+
+    void createTeam(vector<unique_ptr<Unit>>& team, const string& teamName, int balance, Logger& logger) override {
+        cout << teamName << " - Starting balance: " << balance << "\n";
+        cout << "Enter team spec (e.g. LI:Ho+Sp, HI, A, W, H, Gu): ";
+        cin.ignore(numeric_limits<streamsize>::max(), '\n');
+        string spec;
+        getline(cin, spec);
+        logger.log("Input team spec: " + spec, "INFO");
+        vector<unique_ptr<Unit>> units;
+        string error;
+        if (!parseTeamSpec(spec, units, error)) {
+            logger.log("Invalid team spec: " + error, "ERROR");
+            return;
+        }
+        for (auto& unit : units) {
+            int cost = unitCost(*unit);
+            if (cost > balance) {
+                logger.log("Insufficient balance for " + unit->name + ", skipping the rest of the spec.", "ERROR");
+                break;
+            }
+            balance -= cost;
+            unit->position = team.size() + 1;
+            cout << "Added " << unit->name << ". Remaining balance: " << balance << "\n";
+            team.push_back(std::move(unit));
+        }
+        logger.log("------------------", "INFO");
     }
-    out.close();
+};
+
+
+unique_ptr<UnitFactory> makeFactory(int choice) {
+    if (choice == 2) return make_unique<AutomaticUnitFactory>();
+    if (choice == 3) return make_unique<SpecUnitFactory>();
+    return make_unique<ManualUnitFactory>();
 }
 
-void loadGame(const string& filename, string& t1, string& t2, int& round,
-              vector<unique_ptr<Unit>>& team1, vector<unique_ptr<Unit>>& team2, Logger& logger) {
-    ifstream in(filename);
-    if (!in) {
-        logger.log("Error: Could not open file " + filename, "ERROR");
+
+struct CliOptions {
+    string team1Spec, team2Spec, name1 = "Team 1", name2 = "Team 2";
+    string loadFile, matchupsFile, storeFile, columnsFile, scanFile, scanColumn, queryFile, output = "text";
+    string trainFile, modelFile, predictModel, recordFile, replayFile, notablePrefix;
+    int battles = 1000, threads = 0, budget = 0, enumerateBudget = 0, maxUnits = 0, queueCapacity = 256;
+    int keyframeInterval = 256, replayRound = -1, replaySteps = 0, notableCount = 3, selfCheck = 0;
+    uint64_t seed = 0, scanLow = 0, scanHigh = numeric_limits<uint64_t>::max();
+    bool play = false, report = false, kernelReport = false;
+    SimulationOptions simulation;
+    StoppingRule stopping;
+};
+
+
+void printUsage(ostream& out) {
+    out << "Usage: Lgame [options]\n"
+           "  --team1 SPEC, --team2 SPEC   teams as specs, e.g. \"LI:Ho+Sp, 2*HI, A, W, H, Gu\"\n"
+           "  --name1 NAME, --name2 NAME   team names (default Team 1 / Team 2)\n"
+           "  --load FILE                  take both teams and the round from a save file\n"
+           "  --matchups FILE              one \"[name =] spec vs [name =] spec\" per line, '-' for stdin\n"
+           "  --enumerate COST             every unbuffed team costing at most COST against --team2\n"
+           "  --max-units N                limit enumerated teams to N units\n"
+           "  --battles N                  battles per matchup (default 1000)\n"
+           "  --play                       play a single logged battle instead of a batch\n"
+           "  --seed N                     dice seed shared by all matchups (default random)\n"
+           "  --round-cap N                draw after N rounds, 0 for none (default 100000)\n"
+           "  --no-fast-forward            simulate deterministic rounds one by one\n"
+           "  --simultaneous               both teams act on the state a round starts in (no first-mover edge)\n"
+           "  --stop fixed|precision|decision, --precision X   early stopping rule\n"
+           "  --store FILE                 accumulate results in a result store\n"
+           "  --threads N                  worker threads (default one per core)\n"
+           "  --queue N                    pipeline queue capacity for --matchups/--enumerate (default 256)\n"
+           "  --pipeline-report            print per-stage throughput and queue depth to stderr\n"
+           "  --budget N                   reject teams costing more than N\n"
+           "  --columns FILE               also write every battle to a columnar results file\n"
+           "  --notable PREFIX             replay the longest, biggest-upset, most-cloned and a random sample\n"
+           "                               of a batch's battles with full logs in PREFIX-<battle>.log\n"
+           "  --notable-count N            battles kept of each kind (default 3)\n"
+           "  --scan FILE [--column NAME] [--range LOW:HIGH]   list or summarize columns of such a file\n"
+           "  --query FILE                 answer composition queries over such a file, one per stdin line\n"
+           "  --train FILE --model OUT     fit an outcome model on such a file and print its calibration\n"
+           "  --predict MODEL              score --team1 against --team2 with a trained model\n"
+           "  --record FILE                play one battle round by round and write a seekable replay\n"
+           "  --keyframes N                full snapshot every N rounds of a replay (default 256)\n"
+           "  --replay FILE [--at ROUND] [--steps N]   describe a replay, show the teams before ROUND,\n"
+           "                               then step N rounds forward (or back for negative N)\n"
+           "  --self-check N               play N random battles through both engines and compare results\n"
+           "  --kernel-report              stored battles per pair of unit type sequences in --store, and\n"
+           "                               which pairs have a compiled kernel\n"
+           "  --output text|csv|json       report format (default text)\n";
+}
+
+
+// Throws invalid_argument (or the stoi family's exceptions) on a malformed command line.
+void parseCli(int argc, char* argv[], CliOptions& cli) {
+    for (int i = 1; i < argc; i++) {
+        string flag = argv[i];
+        auto value = [&]() -> string {
+            if (i + 1 >= argc) throw invalid_argument("missing value for " + flag);
+            return argv[++i];
+        };
+        if (flag == "--team1") cli.team1Spec = value();
+        else if (flag == "--team2") cli.team2Spec = value();
+        else if (flag == "--name1") cli.name1 = value();
+        else if (flag == "--name2") cli.name2 = value();
+        else if (flag == "--load") cli.loadFile = value();
+        else if (flag == "--matchups") cli.matchupsFile = value();
+        else if (flag == "--enumerate") cli.enumerateBudget = stoi(value());
+        else if (flag == "--max-units") cli.maxUnits = stoi(value());
+        else if (flag == "--store") cli.storeFile = value();
+        else if (flag == "--columns") cli.columnsFile = value();
+        else if (flag == "--scan") cli.scanFile = value();
+        else if (flag == "--query") cli.queryFile = value();
+        else if (flag == "--train") cli.trainFile = value();
+        else if (flag == "--model") cli.modelFile = value();
+        else if (flag == "--predict") cli.predictModel = value();
+        else if (flag == "--record") cli.recordFile = value();
+        else if (flag == "--notable") cli.notablePrefix = value();
+        else if (flag == "--notable-count") cli.notableCount = stoi(value());
+        else if (flag == "--replay") cli.replayFile = value();
+        else if (flag == "--keyframes") cli.keyframeInterval = stoi(value());
+        else if (flag == "--at") cli.replayRound = stoi(value());
+        else if (flag == "--steps") cli.replaySteps = stoi(value());
+        else if (flag == "--self-check") cli.selfCheck = stoi(value());
+        else if (flag == "--kernel-report") cli.kernelReport = true;
+        else if (flag == "--column") cli.scanColumn = value();
+        else if (flag == "--range") {
+            string range = value();
+            size_t colon = range.find(':');
+            if (colon == string::npos) throw invalid_argument("--range expects LOW:HIGH");
+            cli.scanLow = stoull(range.substr(0, colon));
+            cli.scanHigh = stoull(range.substr(colon + 1));
+        }
+        else if (flag == "--output") cli.output = value();
+        else if (flag == "--battles") cli.battles = stoi(value());
+        else if (flag == "--threads") cli.threads = stoi(value());
+        else if (flag == "--queue") cli.queueCapacity = stoi(value());
+        else if (flag == "--pipeline-report") cli.report = true;
+        else if (flag == "--budget") cli.budget = stoi(value());
+        else if (flag == "--seed") cli.seed = stoull(value());
+        else if (flag == "--round-cap") cli.simulation.roundCap = stoi(value());
+        else if (flag == "--no-fast-forward") cli.simulation.fastForward = false;
+        else if (flag == "--simultaneous") cli.simulation.simultaneous = true;
+        else if (flag == "--play") cli.play = true;
+        else if (flag == "--precision") cli.stopping.precision = stod(value());
+        else if (flag == "--stop") {
+            string mode = value();
+            if (mode == "fixed") cli.stopping.mode = StoppingRule::Mode::Fixed;
+            else if (mode == "precision") cli.stopping.mode = StoppingRule::Mode::Precision;
+            else if (mode == "decision") cli.stopping.mode = StoppingRule::Mode::Decision;
+            else throw invalid_argument("unknown stopping rule " + mode);
+        } else throw invalid_argument("unknown option " + flag);
+    }
+    if (cli.battles <= 0 || cli.threads < 0 || cli.budget < 0 || cli.simulation.roundCap < 0 || cli.stopping.precision <= 0 ||
+        cli.enumerateBudget < 0 || cli.maxUnits < 0 || cli.queueCapacity <= 0 || cli.keyframeInterval <= 0 ||
+        cli.notableCount <= 0 || cli.selfCheck < 0) {
+        throw invalid_argument("numeric options must be positive");
+    }
+    if (cli.output != "text" && cli.output != "csv" && cli.output != "json") {
+        throw invalid_argument("unknown output format " + cli.output);
+    }
+    if (!cli.scanFile.empty() || !cli.queryFile.empty() || !cli.replayFile.empty() || cli.selfCheck > 0) return;
+    if (!cli.trainFile.empty()) {
+        if (cli.modelFile.empty()) throw invalid_argument("--train needs --model");
         return;
     }
-    getline(in, t1);
-    getline(in, t2);
-    string roundStr;
-    getline(in, roundStr);
-    try {
-        round = stoi(roundStr);
-    } catch (...) {
-        logger.log("Error: Invalid round number in save file", "ERROR");
-        in.close();
+    if (cli.kernelReport) {
+        if (cli.storeFile.empty()) throw invalid_argument("--kernel-report needs --store");
         return;
     }
+    if (!cli.predictModel.empty() && (cli.team1Spec.empty() || cli.team2Spec.empty())) {
+        throw invalid_argument("--predict needs --team1 and --team2");
+    }
+    if (!cli.recordFile.empty() && (!cli.matchupsFile.empty() || cli.enumerateBudget > 0)) {
+        throw invalid_argument("--record plays a single matchup");
+    }
+    if (!cli.notablePrefix.empty() && (!cli.matchupsFile.empty() || cli.enumerateBudget > 0 || cli.play)) {
+        throw invalid_argument("--notable needs a single matchup batch");
+    }
+    bool teams = !cli.team1Spec.empty() && !cli.team2Spec.empty();
+    bool enumerate = cli.enumerateBudget > 0 && cli.team1Spec.empty() && !cli.team2Spec.empty();
+    int sources = !cli.matchupsFile.empty() + !cli.loadFile.empty() + teams + enumerate;
+    if (sources != 1 || (!teams && !enumerate && (!cli.team1Spec.empty() || !cli.team2Spec.empty()))) {
+        throw invalid_argument("give exactly one of --team1/--team2, --load, --matchups or --enumerate with --team2");
+    }
+    if (cli.play && (enumerate || !cli.matchupsFile.empty())) {
+        throw invalid_argument("--play needs a single matchup");
+    }
+}
 
-    string line;
-    while (getline(in, line) && line != "---") {
-        istringstream iss(line);
-        string type;
-        int pos, hp;
-        if (iss >> type >> pos >> hp) {
-            unique_ptr<Unit> u;
-            if (type == "L") u = make_unique<LightInfantry>(pos);
-            else if (type == "I") u = make_unique<HeavyInfantry>(pos);
-            else if (type == "A") u = make_unique<Archer>(pos);
-            else if (type == "W") u = make_unique<Wizard>(pos);
-            else if (type == "H") u = make_unique<Healer>(pos);
-            else if (type == "G") u = make_unique<GuliayGorodAdapter>(pos);
-            if (u) {
-                u->hp = hp;
-                u->loadExtra(iss);
-                team1.push_back(std::move(u));
-            } else {
-                logger.log("Warning: Invalid unit type '" + type + "' in team1", "ERROR");
-            }
-        } else {
-            logger.log("Warning: Invalid line in team1: " + line, "ERROR");
+
+string csvField(const string& text) {
+    if (text.find_first_of(",\"\n") == string::npos) return text;
+    string quoted = "\"";
+    for (char c : text) quoted += c == '"' ? string("\"\"") : string(1, c);
+    return quoted + "\"";
+}
+
+string jsonString(const string& text) {
+    string quoted = "\"";
+    for (char c : text) {
+        if (c == '"' || c == '\\') quoted += '\\';
+        if (static_cast<unsigned char>(c) >= 0x20) quoted += c;
+    }
+    return quoted + "\"";
+}
+
+
+void reportOutcome(const MatchupOutcome& outcome, const CliOptions& cli, uint64_t seed, Logger& logger) {
+    const BatchStats& stats = outcome.stats;
+    double averageRounds = stats.battles > 0 ? static_cast<double>(stats.totalRounds) / stats.battles : 0.0;
+    if (cli.output == "csv") {
+        cout << csvField(outcome.name1) << ',' << csvField(outcome.name2) << ',' << outcome.cost1 << ',' << outcome.cost2 << ','
+             << stats.battles << ',' << stats.wins1 << ',' << stats.wins2 << ',' << stats.draws << ','
+             << fixed << setprecision(2) << averageRounds << ',' << seed << "\n";
+    } else if (cli.output == "json") {
+        cout << "{\"name1\":" << jsonString(outcome.name1) << ",\"name2\":" << jsonString(outcome.name2)
+             << ",\"cost1\":" << outcome.cost1 << ",\"cost2\":" << outcome.cost2 << ",\"battles\":" << stats.battles
+             << ",\"wins1\":" << stats.wins1 << ",\"wins2\":" << stats.wins2 << ",\"draws\":" << stats.draws
+             << ",\"average_rounds\":" << fixed << setprecision(2) << averageRounds << ",\"seed\":" << seed << "}\n";
+    } else {
+        logger.log(outcome.name1 + " vs " + outcome.name2 + ": " + stats.summary(outcome.name1, outcome.name2), "INFO");
+    }
+    cout.flush();
+}
+
+
+bool withinBudget(const MatchupSpec& matchup, const CliOptions& cli) {
+    int cost1 = teamCost(matchup.team1), cost2 = teamCost(matchup.team2);
+    if (cli.budget == 0 || (cost1 <= cli.budget && cost2 <= cli.budget)) return true;
+    cerr << matchup.name1 << " vs " << matchup.name2 << ": team cost " << cost1 << "/" << cost2
+         << " exceeds the budget of " << cli.budget << "\n";
+    return false;
+}
+
+
+// Only the picked battles are played again, this time with every move logged to a file of their own.
+bool logNotable(const MatchupSpec& matchup, int round, const CliOptions& cli, const NotableBattles& notable, Logger& logger) {
+    bool allOk = true;
+    for (const auto& [kinds, battle] : notable.picks()) {
+        string filename = cli.notablePrefix + "-" + to_string(battle.index) + ".log";
+        FileLogger file(filename);
+        if (!file.isOpen()) {
+            cerr << "Error: could not create " << filename << "\n";
+            allOk = false;
+            continue;
+        }
+        BattleResult replayed = replayBattle(matchup.team1, matchup.team2, matchup.name1, matchup.name2, round,
+                                             cli.simulation, battle, file);
+        ostringstream line;
+        line << fixed << setprecision(2) << "Battle " << battle.index << " (" << kinds << "): seed " << battle.seed << ", "
+             << (battle.result.winner == 0 ? string("draw") : (battle.result.winner == 1 ? matchup.name1 : matchup.name2) + " wins")
+             << " in " << battle.result.rounds << " rounds, " << battle.clones << " clones, upset " << battle.upset
+             << " -> " << filename;
+        logger.log(line.str(), "INFO");
+        if (replayed.winner != battle.result.winner || replayed.rounds != battle.result.rounds) {
+            cerr << "Error: battle " << battle.index << " played differently when replayed\n";
+            allOk = false;
         }
     }
+    return allOk;
+}
 
-    while (getline(in, line)) {
-        istringstream iss(line);
-        string type;
-        int pos, hp;
-        if (iss >> type >> pos >> hp) {
-            unique_ptr<Unit> u;
-            if (type == "L") u = make_unique<LightInfantry>(pos);
-            else if (type == "I") u = make_unique<HeavyInfantry>(pos);
-            else if (type == "A") u = make_unique<Archer>(pos);
-            else if (type == "W") u = make_unique<Wizard>(pos);
-            else if (type == "H") u = make_unique<Healer>(pos);
-            else if (type == "G") u = make_unique<GuliayGorodAdapter>(pos);
-            if (u) {
-                u->hp = hp;
-                u->loadExtra(iss);
-                team2.push_back(std::move(u));
-            } else {
-                logger.log("Warning: Invalid unit type '" + type + "' in team2", "ERROR");
+
+// Plays a single matchup with every thread on its battles; false if the teams are rejected.
+bool runMatchup(MatchupSpec& matchup, int round, const CliOptions& cli, uint64_t seed, ResultStore* store,
+                ColumnWriter* columns) {
+    if (!withinBudget(matchup, cli)) return false;
+    ConsoleLogger console;
+    NullLogger silent;
+    Logger& logger = cli.output == "text" ? static_cast<Logger&>(console) : silent;
+    MatchupOutcome outcome{0, matchup.name1, matchup.name2, teamCost(matchup.team1), teamCost(matchup.team2), BatchStats()};
+    if (cli.play) {
+        Battle battle(std::move(matchup.team1), std::move(matchup.team2), matchup.name1, matchup.name2,
+                      make_unique<StreamDice>(seed), logger, cli.simulation, round);
+        outcome.stats.add(battle.run());
+        const BattleResult& result = battle.result();
+        logger.log(result.winner == 0 ? "Draw (" + drawReasonName(result.drawReason) + ")"
+                                      : (result.winner == 1 ? matchup.name1 : matchup.name2) + " wins", "INFO");
+        if (cli.output != "text") reportOutcome(outcome, cli, seed, logger);
+        return true;
+    }
+    ThreadPool pool(cli.threads > 0 ? static_cast<size_t>(cli.threads) : thread::hardware_concurrency());
+    NotableBattles notable(cli.notableCount);
+    bool keepNotable = !cli.notablePrefix.empty();
+    outcome.stats = runBatch(matchup.team1, matchup.team2, matchup.name1, matchup.name2, round, cli.battles,
+                             cli.simulation, cli.stopping, seed, pool, store, logger, columns, keepNotable ? &notable : nullptr);
+    if (cli.output != "text") reportOutcome(outcome, cli, seed, logger);
+    return !keepNotable || logNotable(matchup, round, cli, notable, logger);
+}
+
+
+// Many matchups: a generator stage reads or enumerates them, workers play whole matchups in parallel
+// and results are reported as they complete.
+bool runMatchupStream(const CliOptions& cli, uint64_t seed, ResultStore* store, ColumnWriter* columns) {
+    ifstream file;
+    if (!cli.matchupsFile.empty() && cli.matchupsFile != "-") {
+        file.open(cli.matchupsFile);
+        if (!file) {
+            cerr << "Error: could not open " << cli.matchupsFile << "\n";
+            return false;
+        }
+    }
+    istream& in = cli.matchupsFile == "-" ? cin : file;
+    vector<unique_ptr<Unit>> opponent;
+    string error;
+    if (cli.enumerateBudget > 0 && !parseTeamSpec(cli.team2Spec, opponent, error)) {
+        cerr << "Error: " << error << "\n";
+        return false;
+    }
+    TeamEnumerator enumerator(cli.enumerateBudget, cli.maxUnits);
+    bool allOk = true;
+    int lineNumber = 0;
+    auto generate = [&](MatchupSpec& matchup) {
+        if (cli.enumerateBudget > 0) {
+            if (!enumerator.next(matchup.team1)) return false;
+            matchup.name1 = formatTeamSpec(matchup.team1);
+            matchup.name2 = cli.name2;
+            matchup.team2 = cloneTeam(opponent);
+            return true;
+        }
+        string line;
+        while (getline(in, line)) {
+            lineNumber++;
+            size_t first = line.find_first_not_of(" \t\r");
+            if (first == string::npos || line[first] == '#') continue;
+            if (!parseMatchupSpec(line, matchup, error)) {
+                cerr << cli.matchupsFile << ":" << lineNumber << ": " << error << "\n";
+                allOk = false;
+                continue;
             }
-        } else {
-            logger.log("Warning: Invalid line in team2: " + line, "ERROR");
+            if (!withinBudget(matchup, cli)) {
+                allOk = false;
+                continue;
+            }
+            return true;
         }
+        return false;
+    };
+
+    ConsoleLogger console;
+    PipelineOptions options;
+    options.battles = cli.battles;
+    options.simulation = cli.simulation;
+    options.stopping = cli.stopping;
+    options.seed = seed;
+    options.workers = cli.threads > 0 ? static_cast<size_t>(cli.threads) : thread::hardware_concurrency();
+    options.queueCapacity = cli.queueCapacity;
+    PipelineReport report = runPipeline(generate, [&](MatchupOutcome& outcome) { reportOutcome(outcome, cli, seed, console); },
+                                        options, store, columns);
+    if (cli.report) cerr << report.summary() << "\n";
+    return allOk;
+}
+
+
+// Plays one silent battle without fast-forward, so every frame of the replay is exactly one round.
+bool recordReplay(MatchupSpec& matchup, int round, const CliOptions& cli, uint64_t seed) {
+    if (!withinBudget(matchup, cli)) return false;
+    NullLogger silent;
+    SimulationOptions options = cli.simulation;
+    options.fastForward = false;
+    Battle battle(std::move(matchup.team1), std::move(matchup.team2), matchup.name1, matchup.name2,
+                  make_unique<StreamDice>(seed), silent, options, round);
+    ReplayRecorder recorder(cli.recordFile, battle, seed, silent, cli.keyframeInterval);
+    if (!recorder.isOpen()) {
+        cerr << "Error: could not create " << cli.recordFile << "\n";
+        return false;
+    }
+    while (recorder.step()) {}
+    recorder.close();
+    const BattleResult& result = battle.result();
+    cout << (result.winner == 0 ? "Draw (" + drawReasonName(result.drawReason) + ")"
+                                : (result.winner == 1 ? matchup.name1 : matchup.name2) + " wins")
+         << " after " << result.rounds << " rounds, seed " << seed << ", replay written to " << cli.recordFile << "\n";
+    return true;
+}
+
+
+bool showReplay(const CliOptions& cli) {
+    NullLogger silent;
+    ReplayPlayer player(cli.replayFile, silent);
+    if (!player.isOpen()) {
+        cerr << "Error: " << cli.replayFile << " is not a readable replay file\n";
+        return false;
+    }
+    const BattleResult& result = player.result();
+    cout << player.name1() << " vs " << player.name2() << ", seed " << player.seed() << ": "
+         << (result.winner == 0 ? "draw (" + drawReasonName(result.drawReason) + ")"
+                                : (result.winner == 1 ? player.name1() : player.name2()) + " wins")
+         << " after " << result.rounds << " rounds; " << player.frames() << " frames, " << player.keyframes() << " keyframes\n";
+    if (cli.replayRound < 0) return true;
+    ConsoleLogger console;
+    GameManager gm;
+    auto show = [&] {
+        cout << "Before round " << player.round() << ":\n";
+        gm.displayTeam(player.team1(), player.name1(), console);
+        gm.displayTeam(player.team2(), player.name2(), console);
+    };
+    auto start = chrono::steady_clock::now();
+    if (!player.seekRound(cli.replayRound)) {
+        cerr << "Error: " << cli.replayFile << " is damaged\n";
+        return false;
+    }
+    double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    cout << fixed << setprecision(2) << "Seek: " << player.lastSeekCost() << " frames applied in " << ms << " ms\n";
+    show();
+    for (int step = 0; step < abs(cli.replaySteps); step++) {
+        if (!(cli.replaySteps > 0 ? player.stepForward() : player.stepBackward())) break;
+        show();
+    }
+    return true;
+}
+
+
+// Lists the columns of a columnar results file, or summarizes one column and reports the scan rate.
+bool scanColumns(const CliOptions& cli) {
+    NullLogger silent;
+    ColumnReader reader(cli.scanFile, silent);
+    if (!reader.isOpen()) {
+        cerr << "Error: " << cli.scanFile << " is not a readable column file\n";
+        return false;
+    }
+    if (cli.scanColumn.empty()) {
+        cout << reader.rows() << " rows in " << reader.blocks() << " blocks\n";
+        for (const auto& column : reader.columns()) cout << column.name << " (" << column.width << " bytes)\n";
+        return true;
+    }
+    int column = reader.columnIndex(cli.scanColumn);
+    if (column < 0) {
+        cerr << "Error: no column " << cli.scanColumn << " in " << cli.scanFile << "\n";
+        return false;
+    }
+    auto start = chrono::steady_clock::now();
+    ColumnSummary summary = summarizeColumn(reader, column, cli.scanLow, cli.scanHigh);
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    double bytes = static_cast<double>(reader.rows()) * reader.columns()[column].width;
+    cout << fixed << setprecision(3) << cli.scanColumn << ": " << summary.matching << " of " << summary.rows
+         << " rows in range, sum " << static_cast<double>(summary.sum) << ", mean "
+         << (summary.matching > 0 ? static_cast<double>(summary.sum / summary.matching) : 0.0)
+         << ", min " << summary.min << ", max " << summary.max << ", " << summary.blocksSkipped << " of "
+         << reader.blocks() << " blocks skipped, " << setprecision(2) << (seconds > 0 ? bytes / seconds / 1e9 : 0.0)
+         << " GB/s\n";
+    return true;
+}
+
+
+// Reads queries such as "A >= 2 and Sh@1 vs W seat 1" from stdin and answers each from bitmap indexes
+// over a columnar results file. Indexes are built on first use, so repeated features get cheaper.
+bool queryResults(const CliOptions& cli) {
+    NullLogger silent;
+    ColumnReader reader(cli.queryFile, silent);
+    if (!reader.isOpen()) {
+        cerr << "Error: " << cli.queryFile << " is not a readable column file\n";
+        return false;
+    }
+    ResultIndex index(reader);
+    if (!index.valid()) {
+        cerr << "Error: " << cli.queryFile << " has no composition columns\n";
+        return false;
     }
+    cout << reader.rows() << " battles loaded. Query: <team> [vs <opponent>] [seat 1|2], terms like A >= 2, W, not Gu, Sh@1 joined by 'and'.\n";
+    string line;
+    while (getline(cin, line)) {
+        if (line.find_first_not_of(" \t\r") == string::npos) continue;
+        if (line == "quit" || line == "exit") break;
+        ResultQuery query;
+        string error;
+        if (!parseResultQuery(line, query, error)) {
+            cout << "Error: " << error << "\n";
+            continue;
+        }
+        auto start = chrono::steady_clock::now();
+        QueryResult result = index.run(query);
+        double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        auto percent = [&](uint64_t count) { return result.battles > 0 ? 100.0 * count / result.battles : 0.0; };
+        cout << fixed << setprecision(1) << result.battles << " battles: wins " << result.wins << " (" << percent(result.wins)
+             << "%), draws " << result.draws << " (" << percent(result.draws) << "%), losses " << result.losses << " ("
+             << percent(result.losses) << "%), average rounds "
+             << (result.battles > 0 ? static_cast<double>(result.rounds / result.battles) : 0.0) << setprecision(2)
+             << "; " << ms << " ms, indexes " << index.indexBytes() / 1024 << " KiB\n";
+        cout.flush();
+    }
+    return true;
+}
+
+
+// Guards the inline engine against drifting from Battle::run; the seed is printed so a failure can be replayed.
+bool selfCheck(const CliOptions& cli, uint64_t seed) {
+    ConsoleLogger console;
+    int mismatches = checkInlineEngine(cli.selfCheck, seed, console);
+    cout << cli.selfCheck << " battles checked, " << mismatches << " mismatches, seed " << seed << "\n";
+    return mismatches == 0;
+}
+
 
-    for (size_t i = 0; i < team1.size(); i++) {
-        team1[i]->position = i + 1;
+// Where the stored volume goes, by unit types, so hotKernels lists the pairs that are actually played.
+bool kernelReport(const CliOptions& cli) {
+    ConsoleLogger console;
+    ResultStore store(cli.storeFile, console);
+    if (!store.isOpen()) return false;
+    vector<KernelVolume> volume = kernelVolume(store);
+    uint64_t total = 0;
+    for (const auto& pair : volume) total += pair.battles;
+    cout << total << " stored battles in " << volume.size() << " type pairs\n";
+    for (const auto& pair : volume) {
+        cout << setw(12) << pair.battles << fixed << setprecision(1) << setw(7) << (total > 0 ? 100.0 * pair.battles / total : 0.0) << "%  "
+             << (pair.compiled ? "kernel  " : "        ") << pair.types1 << " vs " << pair.types2 << "\n";
+    }
+    return true;
+}
+
+
+bool trainModel(const CliOptions& cli) {
+    ConsoleLogger console;
+    ColumnReader reader(cli.trainFile, console);
+    if (!reader.isOpen()) return false;
+    OutcomeModel model;
+    CalibrationReport report;
+    string error;
+    if (!trainOutcomeModel(reader, model, report, error)) {
+        cerr << "Error: " << error << "\n";
+        return false;
     }
-    for (size_t i = 0; i < team2.size(); i++) {
-        team2[i]->position = i + 1;
+    cout << report.summary() << "\n";
+    return model.save(cli.modelFile, console);
+}
+
+
+bool predictOutcome(const CliOptions& cli) {
+    ConsoleLogger console;
+    OutcomeModel model;
+    if (!model.load(cli.predictModel, console)) return false;
+    vector<unique_ptr<Unit>> team1, team2;
+    string error;
+    if (!parseTeamSpec(cli.team1Spec, team1, error) || !parseTeamSpec(cli.team2Spec, team2, error)) {
+        cerr << "Error: " << error << "\n";
+        return false;
+    }
+    cout << fixed << setprecision(3) << cli.name1 << " expected score against " << cli.name2 << ": "
+         << model.predict(team1, team2) << "\n";
+    return true;
+}
+
+
+// Non-interactive entry point: everything comes from the command line and spec files, nothing from cin prompts.
+int runCli(int argc, char* argv[]) {
+    CliOptions cli;
+    if (string(argv[1]) == "--help") {
+        printUsage(cout);
+        return 0;
+    }
+    try {
+        parseCli(argc, argv, cli);
+    } catch (const exception& e) {
+        cerr << "Error: " << e.what() << "\n";
+        printUsage(cerr);
+        return 2;
+    }
+    if (!cli.scanFile.empty()) return scanColumns(cli) ? 0 : 1;
+    if (!cli.queryFile.empty()) return queryResults(cli) ? 0 : 1;
+    if (!cli.trainFile.empty()) return trainModel(cli) ? 0 : 1;
+    if (!cli.predictModel.empty()) return predictOutcome(cli) ? 0 : 1;
+    if (!cli.replayFile.empty()) return showReplay(cli) ? 0 : 1;
+    if (cli.kernelReport) return kernelReport(cli) ? 0 : 1;
+    uint64_t seed = cli.seed != 0 ? cli.seed : randomSeed();
+    if (cli.selfCheck > 0) return selfCheck(cli, seed) ? 0 : 1;
+    NullLogger silent;
+    unique_ptr<ResultStore> store;
+    if (!cli.storeFile.empty()) {
+        store = make_unique<ResultStore>(cli.storeFile, silent);
+        if (!store->isOpen()) {
+            cerr << "Error: could not open result store " << cli.storeFile << "\n";
+            return 1;
+        }
+    }
+    unique_ptr<ColumnWriter> columns;
+    if (!cli.columnsFile.empty()) {
+        columns = make_unique<ColumnWriter>(cli.columnsFile, battleColumns(), silent);
+        if (!columns->isOpen()) {
+            cerr << "Error: could not create " << cli.columnsFile << "\n";
+            return 1;
+        }
+    }
+    if (cli.output == "csv") cout << "name1,name2,cost1,cost2,battles,wins1,wins2,draws,average_rounds,seed\n";
+
+    if (!cli.matchupsFile.empty() || cli.enumerateBudget > 0) {
+        return runMatchupStream(cli, seed, store.get(), columns.get()) ? 0 : 1;
     }
 
-    in.close();
+    MatchupSpec matchup;
+    int round = 1;
+    string error;
+    if (!cli.loadFile.empty()) {
+        if (!loadGame(cli.loadFile, matchup.name1, matchup.name2, round, matchup.team1, matchup.team2, silent)) {
+            cerr << "Error: could not load " << cli.loadFile << "\n";
+            return 1;
+        }
+    } else {
+        matchup.name1 = cli.name1;
+        matchup.name2 = cli.name2;
+        if (!parseTeamSpec(cli.team1Spec, matchup.team1, error) || !parseTeamSpec(cli.team2Spec, matchup.team2, error)) {
+            cerr << "Error: " << error << "\n";
+            return 1;
+        }
+    }
+    if (!cli.recordFile.empty()) return recordReplay(matchup, round, cli, seed) ? 0 : 1;
+    return runMatchup(matchup, round, cli, seed, store.get(), columns.get()) ? 0 : 1;
 }
 
 
-int main() {
+int main(int argc, char* argv[]) {
+    if (argc > 1) return runCli(argc, argv);
     srand(time(0));
     LoggerProxy logger("game.log");
-    GameManager* gm = GameManager::getInstance();
+    GameManager gm;
     CommandManager commandManager(logger);
     vector<unique_ptr<Unit>> team1, team2;
     string t1, t2, input;
@@ -869,20 +933,16 @@ int main() {
         getline(cin, t2);
 
         while (true) {
-            cout << "Choose team creation method for " << t1 << ": 1. Manual, 2. Automatic\nChoice: ";
+            cout << "Choose team creation method for " << t1 << ": 1. Manual, 2. Automatic, 3. Spec\nChoice: ";
             int team1_choice;
             unique_ptr<UnitFactory> team1_factory;
-            if (!(cin >> team1_choice) || (team1_choice != 1 && team1_choice != 2)) {
+            if (!(cin >> team1_choice) || team1_choice < 1 || team1_choice > 3) {
                 logger.log("Invalid team creation choice for " + t1 + ". Defaulting to Manual.", "ERROR");
                 team1_factory = make_unique<ManualUnitFactory>();
             } else {
-                if (team1_choice == 1) {
-                    team1_factory = make_unique<ManualUnitFactory>();
-                } else {
-                    team1_factory = make_unique<AutomaticUnitFactory>();
-                }
+                team1_factory = makeFactory(team1_choice);
             }
-            auto command = make_unique<CreateTeamCommand>(team1, t1, 100, *team1_factory, *gm, logger);
+            auto command = make_unique<CreateTeamCommand>(team1, t1, 100, *team1_factory, gm, logger);
             commandManager.execute(std::move(command));
 
             cout << "Undo team creation for " << t1 << "? (y/n): ";
@@ -892,20 +952,20 @@ int main() {
             }
 
             commandManager.undo();
-            gm->displayTeam(team1, t1, logger);
+            gm.displayTeam(team1, t1, logger);
             if (commandManager.canRedo()) {
                 cout << "Redo last undone team creation for " << t1 << "? (y/n): ";
                 cin >> input;
                 if (input == "y") {
                     commandManager.redo();
-                    gm->displayTeam(team1, t1, logger);
+                    gm.displayTeam(team1, t1, logger);
                     cout << "Undo team creation for " << t1 << "? (y/n): ";
                     cin >> input;
                     if (input != "y") {
                         break;
                     }
                     commandManager.undo();
-                    gm->displayTeam(team1, t1, logger);
+                    gm.displayTeam(team1, t1, logger);
                 }
             }
 
@@ -922,20 +982,16 @@ int main() {
         }
 
         while (true) {
-            cout << "Choose team creation method for " << t2 << ": 1. Manual, 2. Automatic\nChoice: ";
+            cout << "Choose team creation method for " << t2 << ": 1. Manual, 2. Automatic, 3. Spec\nChoice: ";
             int team2_choice;
             unique_ptr<UnitFactory> team2_factory;
-            if (!(cin >> team2_choice) || (team2_choice != 1 && team2_choice != 2)) {
+            if (!(cin >> team2_choice) || team2_choice < 1 || team2_choice > 3) {
                 logger.log("Invalid team creation choice for " + t2 + ". Defaulting to Manual.", "ERROR");
                 team2_factory = make_unique<ManualUnitFactory>();
             } else {
-                if (team2_choice == 1) {
-                    team2_factory = make_unique<ManualUnitFactory>();
-                } else {
-                    team2_factory = make_unique<AutomaticUnitFactory>();
-                }
+                team2_factory = makeFactory(team2_choice);
             }
-            auto command = make_unique<CreateTeamCommand>(team2, t2, 100, *team2_factory, *gm, logger);
+            auto command = make_unique<CreateTeamCommand>(team2, t2, 100, *team2_factory, gm, logger);
             commandManager.execute(std::move(command));
 
             cout << "Undo team creation for " << t2 << "? (y/n): ";
@@ -945,20 +1001,20 @@ int main() {
             }
 
             commandManager.undo();
-            gm->displayTeam(team2, t2, logger);
+            gm.displayTeam(team2, t2, logger);
             if (commandManager.canRedo()) {
                 cout << "Redo last undone team creation for " << t2 << "? (y/n): ";
                 cin >> input;
                 if (input == "y") {
                     commandManager.redo();
-                    gm->displayTeam(team2, t2, logger);
+                    gm.displayTeam(team2, t2, logger);
                     cout << "Undo team creation for " << t2 << "? (y/n): ";
                     cin >> input;
                     if (input != "y") {
                         break;
                     }
                     commandManager.undo();
-                    gm->displayTeam(team2, t2, logger);
+                    gm.displayTeam(team2, t2, logger);
                 }
             }
 
@@ -977,22 +1033,123 @@ int main() {
         commandManager.clear();
     }
 
-    cout << "Type 'Start' to begin: ";
+    cout << "Type 'Start' to begin, 'Batch' to simulate many battles or 'Compare' to compare both teams against an opponent: ";
     cin >> input;
+    if (input == "Batch") {
+        cout << "Number of battles: ";
+        int battles;
+        if (!(cin >> battles) || battles <= 0) {
+            logger.log("Invalid number of battles. Exiting.", "ERROR");
+            return 1;
+        }
+        SimulationOptions options;
+        cout << "Fast-forward deterministic rounds? (y/n): ";
+        cin >> input;
+        options.fastForward = input != "n";
+        cout << "Round cap (0 for none): ";
+        if (!(cin >> options.roundCap) || options.roundCap < 0) {
+            logger.log("Invalid round cap. Exiting.", "ERROR");
+            return 1;
+        }
+        StoppingRule stopping;
+        cout << "Stop early? (fixed, precision, decision): ";
+        cin >> input;
+        if (input == "precision") {
+            stopping.mode = StoppingRule::Mode::Precision;
+            cout << "Target half-width of the 95% confidence sequence (e.g. 0.02): ";
+            if (!(cin >> stopping.precision) || stopping.precision <= 0) {
+                logger.log("Invalid precision. Exiting.", "ERROR");
+                return 1;
+            }
+        } else if (input == "decision") {
+            stopping.mode = StoppingRule::Mode::Decision;
+        }
+        cout << "Result store file (or 'none'): ";
+        cin >> input;
+        unique_ptr<ResultStore> store;
+        if (input != "none") {
+            store = make_unique<ResultStore>(input, logger);
+            if (!store->isOpen()) store.reset();
+        }
+        ThreadPool pool(thread::hardware_concurrency());
+        runBatch(team1, team2, t1, t2, round, battles, options, stopping, randomSeed(), pool, store.get(), logger);
+        return 0;
+    }
+    if (input == "Compare") {
+        string opponentName;
+        vector<unique_ptr<Unit>> opponent;
+        cout << "Enter opponent team name: ";
+        cin.ignore(numeric_limits<streamsize>::max(), '\n');
+        getline(cin, opponentName);
+        cout << "Choose team creation method for " << opponentName << ": 1. Manual, 2. Automatic, 3. Spec\nChoice: ";
+        int opponent_choice;
+        unique_ptr<UnitFactory> opponent_factory = makeFactory(cin >> opponent_choice ? opponent_choice : 1);
+        gm.createTeam(opponent, opponentName, 100, *opponent_factory, logger);
+
+        int battles;
+        cout << "Number of paired samples: ";
+        if (!(cin >> battles) || battles <= 0) {
+            logger.log("Invalid number of samples. Exiting.", "ERROR");
+            return 1;
+        }
+        cout << "Common random numbers? (y/n): ";
+        cin >> input;
+        bool commonRandomNumbers = input != "n";
+        cout << "Antithetic sampling? (y/n): ";
+        cin >> input;
+        bool antithetic = input == "y";
+        uint64_t seed;
+        cout << "Seed (0 for random): ";
+        if (!(cin >> seed)) seed = 0;
+        if (seed == 0) seed = randomSeed();
+        ThreadPool pool(thread::hardware_concurrency());
+        runComparison(team1, team2, opponent, t1, t2, opponentName, round, battles, SimulationOptions(),
+                      commonRandomNumbers, antithetic, seed, pool, logger);
+        return 0;
+    }
     if (input != "Start") return 0;
 
-    while (gm->isTeamAlive(team1) && gm->isTeamAlive(team2)) {
-        gm->simulateRound(team1, team2, t1, t2, round++, logger);
-        gm->cleanAndShift(team1);
-        gm->cleanAndShift(team2);
-        gm->displayTeam(team1, t1, logger);
-        gm->displayTeam(team2, t2, logger);
-        cout << "Save game? (y/n): ";
-        cin >> input;
-        if (input == "y") saveGame("save.txt", t1, t2, round, team1, team2, logger);
+    Battle battle(std::move(team1), std::move(team2), t1, t2, make_unique<StreamDice>(randomSeed()), logger,
+                  SimulationOptions(), round);
+    ThreadPool pool(thread::hardware_concurrency());
+    BattleHistory history(battle, 64 << 20);
+    auto showRound = [&] {
+        gm.displayTeam(battle.team1(), t1, logger);
+        gm.displayTeam(battle.team2(), t2, logger);
+        WinEstimate estimate = estimateWinProbability(battle, chrono::milliseconds(50), pool, randomSeed());
+        if (estimate.samples > 0) {
+            auto percent = [&](int count) { return 100.0 * count / estimate.samples; };
+            ostringstream readout;
+            readout << fixed << setprecision(1) << "Win probability: " << t1 << " " << percent(estimate.wins1) << "%, "
+                    << t2 << " " << percent(estimate.wins2) << "%, draw " << percent(estimate.draws) << "% ("
+                    << estimate.samples << " continuations in " << setprecision(0) << estimate.elapsedMs << " ms)";
+            logger.log(readout.str(), "INFO");
+        }
+    };
+    while (history.step()) {
+        showRound();
+        while (true) {
+            cout << "Save game? (y/n, back/forward to step through rounds): ";
+            if (!(cin >> input)) input = "n";
+            if (input != "back" && input != "forward") break;
+            bool moved = input == "back" ? history.undo() : history.redo();
+            if (!moved) {
+                logger.log(input == "back" ? "No earlier round to return to." : "No later round to return to.", "INFO");
+                continue;
+            }
+            logger.log("State before round " + to_string(battle.round()) + ":", "INFO");
+            showRound();
+        }
+        if (input == "y") saveGame("save.txt", t1, t2, battle.round(), battle.team1(), battle.team2(), logger);
         logger.log("------------------", "INFO");
     }
 
-    cout << "\n" << (gm->isTeamAlive(team1) ? t1 : t2) << " wins!\n";
+    const BattleResult& result = battle.result();
+    if (result.winner == 0) {
+        logger.log("Draw (" + drawReasonName(result.drawReason) + ") after " + to_string(result.rounds) + " rounds.", "INFO");
+        cout << "\nDraw!\n";
+        return 0;
+    }
+    cout << "\n" << (result.winner == 1 ? t1 : t2) << " wins!\n";
     return 0;
-}
\ No newline at end of file
+}